@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <math.h>
 #include <time.h>
 #include <string.h>
@@ -8,6 +9,9 @@
 #include "nn.h"
 
 #define BITS 3
+#define CHECKPOINT_PATH "adder.ckpt"
+#define CHECKPOINT_EVERY 5000
+#define CKPT_FLAG_LBFGS 1
 
 #ifndef CLAMP
     #define CLAMP(v, lo, hi)  ((v) < (lo) ? (lo) : ((v) > (hi) ? (hi) : (v)))
@@ -44,7 +48,32 @@ static void draw_weight_heatmap(NN nn, int li,
                              (Vector2){rx, ry - 16}, 14, 0, WHITE);
 }
 
-void verify_nn_adder(Font font, NN nn, float rx, float ry, float rw, float rh) {
+// The answer for x + y in out, row x * 2^BITS + y like dataset_gen_adder, as the sum bits then the carry
+static uint64_t adder_bits(matrix out, size_t x, size_t y) {
+        size_t row = x * (1 << BITS) + y;
+        uint64_t bits = 0;
+        for (size_t j = 0; j < out.cols; j++) bits |= (uint64_t)(MATRIX_AT(out, row, j) > 0.5f) << j;
+        return bits;
+}
+
+// Mean squared error of out against to, and how many rows are right in every bit
+static float score_adder(matrix out, matrix to, size_t* exact) {
+        float cost = 0;
+        *exact = 0;
+        for (size_t i = 0; i < out.rows; i++) {
+                bool right = true;
+                for (size_t j = 0; j < out.cols; j++) {
+                        float d = MATRIX_AT(out, i, j) - MATRIX_AT(to, i, j);
+                        cost += d * d;
+                        right = right && (MATRIX_AT(out, i, j) > 0.5f) == (MATRIX_AT(to, i, j) > 0.5f);
+                }
+                *exact += right;
+        }
+        return cost / out.rows;
+}
+
+// out holds the model's answer for every pair, so each cell shows whether it is right
+void verify_nn_adder(Font font, matrix out, float rx, float ry, float rw, float rh) {
         const size_t n     = (1 << BITS);
         const size_t total = n * n;
         float aspect  = rw/rh;
@@ -64,7 +93,8 @@ void verify_nn_adder(Font font, NN nn, float rx, float ry, float rw, float rh) {
                         Vector2 m = MeasureTextEx(font, add, s_small, 0);
                         float bx = rx + (idx % columns)*cellW + (cellW - m.x)/2;
                         float by = ry + (idx / columns)*cellH + (cellH - (2*s_small+PAD))/2;
-                        DrawTextEx(font, add, (Vector2){bx, by}, s_small, 0, WHITE);
+                        bool right = adder_bits(out, x, y) == x + y;
+                        DrawTextEx(font, add, (Vector2){bx, by}, s_small, 0, right ? WHITE : RED);
                 }
         }
         Vector2 mpos = GetMousePosition();
@@ -76,16 +106,9 @@ void verify_nn_adder(Font font, NN nn, float rx, float ry, float rw, float rh) {
                         size_t x = hidx / n;
                         size_t y = hidx % n;
                         size_t sum = x + y;
-                        for (size_t j = 0; j < BITS; j++) {
-                                MATRIX_AT(NN_INPUT(nn), 0, j)        = (x >> j) & 1;
-                                MATRIX_AT(NN_INPUT(nn), 0, j + BITS) = (y >> j) & 1;
-                        }
-                        nn_forward(nn);
-                        size_t approx = 0;
-                        for (size_t j = 0; j < BITS; j++) {
-                                approx |= ((MATRIX_AT(NN_OUTPUT(nn), 0, j) > 0.5f) << j);
-                        }
-                        bool overflow = MATRIX_AT(NN_OUTPUT(nn), 0, BITS) > 0.5f;
+                        uint64_t bits = adder_bits(out, x, y);
+                        size_t approx = bits & (n - 1);
+                        bool overflow = (bits >> BITS) & 1;
                         char line1[32], line2[32];
                         snprintf(line1, sizeof line1, "%zu+%zu=%zu", x, y, sum);
                         snprintf(line2, sizeof line2, "NN:%2zu%s", approx, overflow?"O":"");
@@ -106,25 +129,26 @@ void verify_nn_adder(Font font, NN nn, float rx, float ry, float rw, float rh) {
         }
 }
 
-int main(void) {
-        srand((unsigned)time(NULL));
-        size_t n       = (1 << BITS);
-        size_t samples = n * n;
-        matrix ti = matrix_alloc(samples, 2 * BITS, 2 * BITS);
-        matrix to = matrix_alloc(samples, BITS + 1, BITS + 1);
-        for (size_t i = 0; i < samples; i++) {
-                size_t x = i / n, y = i % n, sum = x + y;
-                for (size_t j = 0; j < BITS; j++) {
-                        ti.elements[i * ti.stride + j]        = (x >> j) & 1;
-                        ti.elements[i * ti.stride + j + BITS] = (y >> j) & 1;
-                        to.elements[i * to.stride + j]        = (sum >> j) & 1;
-                }
-                to.elements[i * to.stride + BITS] = (sum >= n);
+int main(int argc, char** argv) {
+        bool resume = argc > 1 && strcmp(argv[1], "--resume") == 0;
+        if (argc > 1 && !resume) {
+                fprintf(stderr, "Usage: %s [--resume]\n", argv[0]);
+                return 1;
         }
+        nn_seed((uint64_t)time(NULL));
+        Dataset_Gen gen = dataset_gen_adder(BITS);
+        matrix ti = matrix_alloc(gen.count, gen.in_cols, gen.in_cols);
+        matrix to = matrix_alloc(gen.count, gen.out_cols, gen.out_cols);
+        dataset_gen_fill(gen, 0, ti, to);
         size_t arch[] = { 2 * BITS, 4 * BITS, BITS + 1 };
         NN nn   = nn_alloc(arch, ARRAY_SIZE(arch));
         NN grad = nn_alloc(arch, ARRAY_SIZE(arch));
         nn_randomise(nn, -1.0f, 1.0f);
+        NN_LBFGS opt = nn_lbfgs_alloc(nn, 4);
+        // Every frame scores all pairs at once in the same context and outputs
+        NN_Model model = nn_model(nn);
+        NN_Context ctx = nn_context_alloc(model, gen.count);
+        matrix out = matrix_alloc(gen.count, gen.out_cols, gen.out_cols);
         const int WIN_F = 80;
         InitWindow(16*WIN_F, 9*WIN_F, "NN Adder");
         SetConfigFlags(FLAG_WINDOW_RESIZABLE);
@@ -135,36 +159,80 @@ int main(void) {
         size_t epoch = 0, max_epoch = 100000, eps = 100;
         float rate = 0.1f;
         bool paused = false;
+        bool use_lbfgs = false;
+        NN_Checkpoint ckpt = nn_checkpoint_alloc(CHECKPOINT_PATH);
+        ckpt.compress = true;
+        if (resume) {
+                NN_Train_State state = {0};
+                if (!nn_checkpoint_load(CHECKPOINT_PATH, nn, &opt, &state)) {
+                        fprintf(stderr, "ERROR: could not resume from %s\n", CHECKPOINT_PATH);
+                        return 1;
+                }
+                epoch = state.epoch;
+                rate = state.rate;
+                use_lbfgs = state.flags & CKPT_FLAG_LBFGS;
+                plot = (Plot) { .items = state.costs, .count = state.cost_count, .capacity = state.cost_count };
+                printf("Resumed %s at epoch %zu\n", CHECKPOINT_PATH, epoch);
+        }
         while (!WindowShouldClose()) {
                 if (IsKeyPressed(KEY_SPACE)) paused = !paused;
                 if (IsKeyPressed(KEY_R)) {
                         epoch = 0;
                         nn_randomise(nn, -1.0f, 1.0f);
+                        nn_lbfgs_reset(&opt);
                         plot.count = 0;
                 }
+                if (IsKeyPressed(KEY_L)) {
+                        use_lbfgs = !use_lbfgs;
+                        nn_lbfgs_reset(&opt);
+                }
                 for (size_t i = 0; i < eps && !paused && epoch < max_epoch; i++) {
-                        nn_backprop(nn, &grad, ti, to);
-                        nn_learn(nn, grad, rate);
-                        da_append(&plot, nn_cost(nn, ti, to));
+                        if (use_lbfgs) {
+                                da_append(&plot, nn_lbfgs_step(nn, &grad, &opt, ti, to));
+                        } else {
+                                nn_backprop(nn, &grad, ti, to);
+                                nn_learn(nn, grad, rate);
+                                da_append(&plot, nn_cost(nn, ti, to));
+                        }
                         epoch++;
+                        if (epoch % CHECKPOINT_EVERY == 0) {
+                                nn_checkpoint_save(&ckpt, nn, &opt, (NN_Train_State) {
+                                        .epoch = epoch, .rate = rate, .flags = use_lbfgs ? CKPT_FLAG_LBFGS : 0,
+                                        .costs = plot.items, .cost_count = plot.count,
+                                });
+                        }
                 }
+                nn_infer(model, &ctx, ti, out);
+                size_t exact;
+                float cost = score_adder(out, to, &exact);
                 BeginDrawing();
                 ClearBackground((Color){0x18,0x18,0x18,0xFF});
                 int W = GetRenderWidth(), H = GetRenderHeight();
                 int cellW = W/3, cellH = H*2/3, offY = H/2 - cellH/2;
                 gui_plot(plot, 0, offY, cellW, cellH);
                 gui_render_nn(nn, cellW, offY, cellW, cellH);
-                verify_nn_adder(font, nn, 2*cellW, offY, cellW, cellH);
+                verify_nn_adder(font, out, 2*cellW, offY, cellW, cellH);
                 draw_weight_heatmap(nn, 0, 2*cellW, offY + cellH + 20,
                                                         cellW, H - (offY + cellH + 20) - 20);
-                char st[64];
-                snprintf(st, sizeof st, "Epoch %zu/%zu  Rate %.3f  Cost %.4f",
-                                 epoch, max_epoch, rate, nn_cost(nn, ti, to));
+                char st[128];
+                snprintf(st, sizeof st, "Epoch %zu/%zu  %s  Rate %.3f  Cost %.4f  Exact %llu/%llu",
+                                 epoch, max_epoch, use_lbfgs ? "L-BFGS" : "GD", rate, cost,
+                                 (unsigned long long)exact, (unsigned long long)gen.count);
                 DrawTextEx(font, st, (Vector2){10,10}, H*0.04f, 0, WHITE);
                 EndDrawing();
         }
+        nn_checkpoint_wait(&ckpt);
+        nn_checkpoint_save(&ckpt, nn, &opt, (NN_Train_State) {
+                .epoch = epoch, .rate = rate, .flags = use_lbfgs ? CKPT_FLAG_LBFGS : 0,
+                .costs = plot.items, .cost_count = plot.count,
+        });
+        if (!nn_checkpoint_wait(&ckpt)) fprintf(stderr, "ERROR: could not write %s\n", CHECKPOINT_PATH);
+        nn_checkpoint_free(&ckpt);
         nn_free(&nn);
         nn_free(&grad);
+        nn_lbfgs_free(&opt);
+        nn_context_free(&ctx);
+        matrix_free(&out);
         matrix_free(&ti);
         matrix_free(&to);
         CloseWindow();
@@ -2,10 +2,24 @@
 
 set -xe
 
-CFLAGS="-O3 -Wall -Wextra -I./headers/"
-LIBS="-lm"
+CFLAGS="-O3 -march=native -Wall -Wextra -I./headers/"
+LIBS="-lm -lpthread"
 
 clang $CFLAGS `pkg-config --cflags raylib` -o xor xor.c $LIBS `pkg-config --libs raylib` -lglfw -ldl -lpthread
 clang $CFLAGS `pkg-config --cflags raylib` -o adder adder.c $LIBS `pkg-config --libs raylib` -lglfw -ldl -lpthread
 clang $CFLAGS `pkg-config --cflags raylib` -o gui gui.c $LIBS `pkg-config --libs raylib` -lglfw -ldl -lpthread
-clang $CFLAGS `pkg-config --cflags raylib` -o img2nn img2nn.c $LIBS `pkg-config --libs raylib` -lglfw -ldl -lpthread
\ No newline at end of file
+clang $CFLAGS `pkg-config --cflags raylib` -o img2nn img2nn.c $LIBS `pkg-config --libs raylib` -lglfw -ldl -lpthread
+clang $CFLAGS -o quantize quantize.c $LIBS
+clang $CFLAGS -o prune prune.c $LIBS
+clang $CFLAGS -o mat2bit mat2bit.c $LIBS
+clang $CFLAGS -o img2mat img2mat.c $LIBS
+clang $CFLAGS -o csv2mat csv2mat.c $LIBS
+clang $CFLAGS -o nn_serve nn_serve.c $LIBS
+clang $CFLAGS -o nn_shm nn_shm.c $LIBS
+clang $CFLAGS -o nn2c nn2c.c $LIBS
+clang $CFLAGS -o nn_score nn_score.c $LIBS
+clang $CFLAGS -o distill distill.c $LIBS
+clang $CFLAGS -o nn_csr_check nn_csr_check.c $LIBS
+clang $CFLAGS -o nn_registry_check nn_registry_check.c $LIBS
+clang $CFLAGS -c -o nn_hpp_check_c.o nn_hpp_check.c
+clang++ -std=c++17 $CFLAGS -o nn_hpp_check nn_hpp_check.cpp nn_hpp_check_c.o $LIBS
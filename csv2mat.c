@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <time.h>
+
+#define SV_IMPLEMENTATION
+#include "sv.h"
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+// One newline aligned slice of the file, parsed by one thread
+typedef struct {
+    String_View text;
+    char delim;
+    size_t cols;
+    size_t rows;                // data rows in text, counted by the first pass
+    size_t first_row;           // global index of the first of them
+    float* out;                 // rows * cols floats shared by every chunk
+    bool failed;
+    size_t error_row;
+    size_t error_col;
+} Chunk;
+
+char* args_shift(int* argc, char*** argv) {
+    assert(*argc > 0);
+    char* result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A line without its trailing '\r' and surrounding blanks, empty lines carry no row
+static String_View next_line(String_View* text) {
+    const char* newline = memchr(text->data, '\n', text->count);
+    size_t n = newline != NULL ? (size_t) (newline - text->data) : text->count;
+    String_View line = sv_from_parts(text->data, n);
+    sv_chop_left(text, newline != NULL ? n + 1 : n);
+    if (line.count > 0 && !isspace((unsigned char) line.data[0]) && !isspace((unsigned char) line.data[line.count - 1])) {
+        return line;
+    }
+    return sv_trim(line);
+}
+
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// strtof on a stack copy for what the fast path does not handle (nan, inf, huge exponents, hex)
+static bool sv_parse_float_slow(String_View sv, float* out) {
+    char buffer[64];
+    if (sv.count == 0 || sv.count >= sizeof(buffer)) return false;
+    memcpy(buffer, sv.data, sv.count);
+    buffer[sv.count] = '\0';
+    char* end;
+    *out = strtof(buffer, &end);
+    return end == buffer + sv.count;
+}
+
+// Parses decimals like 12, -0.5 or 3e-4 without allocating. Up to 19 significant digits
+// and powers of ten up to 22 are exact in a double, so the result is rounded only once
+// before the conversion to float
+static bool sv_parse_float(String_View sv, float* out) {
+    const char* p = sv.data;
+    const char* end = sv.data + sv.count;
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-')) negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exp10 = 0;
+    bool any = false;
+    for (; p < end && isdigit((unsigned char) *p); p++) {
+        any = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else {
+            exp10 += 1;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && isdigit((unsigned char) *p); p++) {
+            any = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exp10 -= 1;
+            }
+        }
+    }
+    if (!any) return sv_parse_float_slow(sv, out);
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negative_exp = false;
+        if (p < end && (*p == '+' || *p == '-')) negative_exp = *p++ == '-';
+        if (p == end || !isdigit((unsigned char) *p)) return false;
+        int e = 0;
+        for (; p < end && isdigit((unsigned char) *p); p++) {
+            if (e < 10000) e = e * 10 + (*p - '0');
+        }
+        exp10 += negative_exp ? -e : e;
+    }
+    if (p != end) return sv_parse_float_slow(sv, out);
+
+    double value = (double) mantissa;
+    if (mantissa != 0) {
+        if (exp10 < -22 || exp10 > 22 || mantissa > ((uint64_t) 1 << 53)) return sv_parse_float_slow(sv, out);
+        value = exp10 < 0 ? value / pow10_table[-exp10] : value * pow10_table[exp10];
+    }
+    *out = (float) (negative ? -value : value);
+    return true;
+}
+
+static void* count_rows(void* arg) {
+    Chunk* chunk = arg;
+    String_View text = chunk->text;
+    while (text.count > 0) {
+        if (next_line(&text).count > 0) chunk->rows += 1;
+    }
+    return NULL;
+}
+
+static void* parse_rows(void* arg) {
+    Chunk* chunk = arg;
+    String_View text = chunk->text;
+    float* out = chunk->out + chunk->first_row * chunk->cols;
+    size_t row = 0;
+    while (text.count > 0 && !chunk->failed) {
+        String_View line = next_line(&text);
+        if (line.count == 0) continue;
+        size_t col = 0;
+        for (; col < chunk->cols; col++) {
+            bool last = col + 1 == chunk->cols;
+            String_View field = sv_trim(sv_chop_by_delim(&line, chunk->delim));
+            if (!sv_parse_float(field, &out[col]) || (last && line.count > 0)) break;
+        }
+        if (col < chunk->cols) {
+            chunk->failed = true;
+            chunk->error_row = chunk->first_row + row;
+            chunk->error_col = col;
+        }
+        out += chunk->cols;
+        row += 1;
+    }
+    return NULL;
+}
+
+// Runs fn over every chunk, one thread each, the calling thread takes the first
+static void run_chunks(Chunk* chunks, size_t count, void* (*fn)(void*)) {
+    pthread_t* threads = malloc(count * sizeof(*threads));
+    assert(threads != NULL);
+    for (size_t i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, fn, &chunks[i]) != 0) threads[i] = pthread_self();
+    }
+    fn(&chunks[0]);
+    for (size_t i = 1; i < count; i++) {
+        if (pthread_equal(threads[i], pthread_self())) {
+            fn(&chunks[i]);
+        } else {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    free(threads);
+}
+
+int main(int argc, char** argv) {
+    const char* program = args_shift(&argc, &argv);
+    const char* usage = "Usage: %s <input.csv> <output.mat> [--delim <c>] [--header] [--threads <n>]\n";
+    if (argc < 2) {
+        fprintf(stderr, usage, program);
+        return 1;
+    }
+    const char* in_path = args_shift(&argc, &argv);
+    const char* out_path = args_shift(&argc, &argv);
+
+    char delim = ',';
+    bool header = false;
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    while (argc > 0) {
+        const char* flag = args_shift(&argc, &argv);
+        if (strcmp(flag, "--delim") == 0 && argc > 0) {
+            const char* d = args_shift(&argc, &argv);
+            delim = strcmp(d, "\\t") == 0 ? '\t' : d[0];
+        } else if (strcmp(flag, "--header") == 0) {
+            header = true;
+        } else if (strcmp(flag, "--threads") == 0 && argc > 0) {
+            thread_count = strtol(args_shift(&argc, &argv), NULL, 10);
+        } else {
+            fprintf(stderr, usage, program);
+            return 1;
+        }
+    }
+    if (thread_count < 1) thread_count = 1;
+
+    double start = now_secs();
+    int fd = open(in_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "ERROR: could not read %s\n", in_path);
+        return 1;
+    }
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map %s\n", in_path);
+        return 1;
+    }
+    madvise((void*) data, st.st_size, MADV_SEQUENTIAL);
+    String_View text = sv_from_parts(data, st.st_size);
+
+    // The first non empty line fixes the column count, and is skipped as a header
+    // when asked to or when its first field is not a number
+    String_View rest = text;
+    String_View first = next_line(&rest);
+    while (first.count == 0 && rest.count > 0) first = next_line(&rest);
+    if (first.count == 0) {
+        fprintf(stderr, "ERROR: %s has no rows\n", in_path);
+        return 1;
+    }
+    size_t cols = 1;
+    for (size_t i = 0; i < first.count; i++) cols += first.data[i] == delim;
+    float probe;
+    String_View first_field = first;
+    if (header || !sv_parse_float(sv_trim(sv_chop_by_delim(&first_field, delim)), &probe)) {
+        text = rest;
+        header = true;
+    }
+
+    // Chunks end right after a newline so no line is split between two threads
+    size_t chunk_count = (size_t) thread_count;
+    if (chunk_count > text.count) chunk_count = text.count > 0 ? text.count : 1;
+    Chunk* chunks = calloc(chunk_count, sizeof(*chunks));
+    assert(chunks != NULL);
+    size_t at = 0;
+    for (size_t i = 0; i < chunk_count; i++) {
+        size_t target = i + 1 == chunk_count ? text.count : (text.count / chunk_count) * (i + 1);
+        if (target < at) target = at;
+        const char* newline = target < text.count ? memchr(text.data + target, '\n', text.count - target) : NULL;
+        size_t stop = newline != NULL ? (size_t) (newline - text.data) + 1 : text.count;
+        if (i + 1 == chunk_count) stop = text.count;
+        chunks[i] = (Chunk) { .text = sv_from_parts(text.data + at, stop - at), .delim = delim, .cols = cols };
+        at = stop;
+    }
+
+    run_chunks(chunks, chunk_count, count_rows);
+    size_t rows = 0;
+    for (size_t i = 0; i < chunk_count; i++) {
+        chunks[i].first_row = rows;
+        rows += chunks[i].rows;
+    }
+    if (rows == 0) {
+        fprintf(stderr, "ERROR: %s has no data rows\n", in_path);
+        return 1;
+    }
+
+    // Parsed straight into the mapped .mat file, the same layout matrix_save writes
+    size_t out_size = MATRIX_FILE_HEADER_SIZE + rows * cols * sizeof(float);
+    int out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0 || ftruncate(out_fd, out_size) != 0) {
+        fprintf(stderr, "ERROR: could not create %s\n", out_path);
+        return 1;
+    }
+    uint8_t* out = mmap(NULL, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    close(out_fd);
+    if (out == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map %s\n", out_path);
+        unlink(out_path);
+        return 1;
+    }
+    memcpy(out, "nn.h.mat", 8);
+    memcpy(out + 8, &rows, sizeof(rows));
+    memcpy(out + 16, &cols, sizeof(cols));
+    for (size_t i = 0; i < chunk_count; i++) chunks[i].out = (float*) (out + MATRIX_FILE_HEADER_SIZE);
+    run_chunks(chunks, chunk_count, parse_rows);
+
+    for (size_t i = 0; i < chunk_count; i++) {
+        if (!chunks[i].failed) continue;
+        fprintf(stderr, "ERROR: %s: data row %zu, column %zu: expected %zu numeric columns\n",
+                in_path, chunks[i].error_row + 1, chunks[i].error_col + 1, cols);
+        munmap(out, out_size);
+        unlink(out_path);
+        return 1;
+    }
+    munmap(out, out_size);
+    munmap((void*) data, st.st_size);
+
+    double secs = now_secs() - start;
+    printf("%s: %zu rows x %zu cols%s -> %s in %.3f s (%.1f MB/s on %zu threads)\n",
+           in_path, rows, cols, header ? " (header skipped)" : "", out_path,
+           secs, st.st_size / secs / 1e6, chunk_count);
+    free(chunks);
+    return 0;
+}
@@ -0,0 +1,334 @@
+// Distills a trained model into smaller ones and reports what each costs and keeps.
+//
+// The teacher's outputs over every input of the dataset are computed once with nn_predict
+// and cached as a .mat of inputs followed by those soft targets, the layout gui.c trains on.
+// Each student architecture, a .arch file like gui.c takes, is trained against the cache
+// with nn_backprop and nn_learn and saved next to its .arch as a .nn. The report gives,
+// for the teacher and every student, parameters, single row and batched latency, the cost
+// against the teacher and the share of rows that agree with the teacher and with the labels.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <time.h>
+
+#define SV_IMPLEMENTATION
+#include "sv.h"
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+#define MAX_LAYERS 64
+#define LATENCY_ROWS 4096       // rows timed one at a time
+#define BATCH_ROWS (64 * 1024)  // rows timed through nn_predict
+
+typedef struct {
+    const char* name;
+    size_t params;
+    double row_ns;              // one row at a time through nn_infer
+    double batch_ns;            // per row through nn_predict
+    float cost;                 // mean squared error against the soft targets, as nn_cost computes it
+    double teacher_match;
+    double label_match;         // negative when the dataset has no labels
+} Report;
+
+char* args_shift(int* argc, char*** argv) {
+    assert(*argc > 0);
+    char* result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Whitespace separated layer sizes, as gui.c reads them. 0 on failure
+static size_t load_arch(const char* path, size_t* arch) {
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) return 0;
+    char buffer[4096];
+    size_t n = fread(buffer, 1, sizeof(buffer), in);
+    fclose(in);
+    String_View content = sv_trim_left(sv_from_parts(buffer, n));
+    size_t count = 0;
+    while (content.count > 0 && isdigit((unsigned char) content.data[0]) && count < MAX_LAYERS) {
+        arch[count++] = sv_chop_u64(&content);
+        content = sv_trim_left(content);
+    }
+    if (content.count > 0 || count < 2) return 0;
+    for (size_t i = 0; i < count; i++) {
+        if (arch[i] == 0) return 0;
+    }
+    return count;
+}
+
+// A .bit is unpacked, a .mat is mapped. elements is NULL on failure
+static matrix load_data(const char* path) {
+    if (!sv_ends_with(sv_from_cstr(path), sv_from_cstr(".bit"))) return matrix_map(path, MATRIX_MAP_SEQUENTIAL);
+    matrix t = {0};
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) return t;
+    matrix_packed p = matrix_packed_load(in);
+    fclose(in);
+    t = matrix_alloc(p.rows, p.cols, p.cols);
+    matrix_unpack(t, p, 0);
+    matrix_packed_free(&p);
+    return t;
+}
+
+static bool newer_than(const struct stat* a, const struct stat* b) {
+    return a->st_mtim.tv_sec > b->st_mtim.tv_sec
+        || (a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec >= b->st_mtim.tv_nsec);
+}
+
+// The cache is reused while it is newer than both the teacher and the data and has their shape
+static matrix soft_targets(const char* cache_path, const char* teacher_path, const char* data_path,
+                           NN teacher, matrix inputs, bool* cached) {
+    struct stat cache_st, teacher_st, data_st;
+    size_t cols = inputs.cols + NN_OUTPUT(teacher).cols;
+    if (stat(cache_path, &cache_st) == 0 && stat(teacher_path, &teacher_st) == 0 && stat(data_path, &data_st) == 0
+        && newer_than(&cache_st, &teacher_st) && newer_than(&cache_st, &data_st)) {
+        matrix t = matrix_map(cache_path, MATRIX_MAP_SEQUENTIAL);
+        if (t.elements != NULL && t.rows == inputs.rows && t.cols == cols) {
+            *cached = true;
+            return t;
+        }
+        if (t.elements != NULL) matrix_unmap(&t);
+    }
+
+    *cached = false;
+    matrix t = matrix_alloc(inputs.rows, cols, cols);
+    matrix ti = matrix_cols(t, 0, inputs.cols);
+    for (size_t i = 0; i < inputs.rows; i++) matrix_copy(matrix_row(ti, i), matrix_row(inputs, i));
+    nn_predict(nn_model(teacher), ti, matrix_cols(t, inputs.cols, NN_OUTPUT(teacher).cols));
+    FILE* out = fopen(cache_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "WARNING: could not write the soft target cache %s\n", cache_path);
+        return t;
+    }
+    matrix_save(out, t);
+    if (fclose(out) != 0) fprintf(stderr, "WARNING: could not write the soft target cache %s\n", cache_path);
+    return t;
+}
+
+// A row agrees when its argmax does, or with --argmax off when every output is on the same
+// side of 0.5 as the reference
+static double match_rate(matrix y, matrix reference, bool argmax) {
+    size_t matches = 0;
+    for (size_t i = 0; i < y.rows; i++) {
+        const float* a = &MATRIX_AT(y, i, 0);
+        const float* b = &MATRIX_AT(reference, i, 0);
+        bool same = true;
+        if (argmax) {
+            size_t ia = 0, ib = 0;
+            for (size_t j = 1; j < y.cols; j++) {
+                if (a[j] > a[ia]) ia = j;
+                if (b[j] > b[ib]) ib = j;
+            }
+            same = ia == ib;
+        } else {
+            for (size_t j = 0; j < y.cols && same; j++) same = (a[j] > 0.5f) == (b[j] > 0.5f);
+        }
+        matches += same;
+    }
+    return (double) matches / y.rows;
+}
+
+static Report measure(const char* name, NN nn, matrix inputs, matrix soft, matrix labels, bool argmax) {
+    NN_Model model = nn_model(nn);
+    Report r = { .name = name, .params = nn_param_count(nn), .label_match = -1 };
+    matrix y = matrix_alloc(inputs.rows, soft.cols, soft.cols);
+
+    NN_Context ctx = nn_context_alloc(model, 1);
+    size_t rows = inputs.rows < LATENCY_ROWS ? inputs.rows : LATENCY_ROWS;
+    double start = now_secs();
+    for (size_t i = 0; i < rows; i++) nn_infer(model, &ctx, matrix_row(inputs, i), matrix_row(y, i));
+    r.row_ns = (now_secs() - start) / rows * 1e9;
+    nn_context_free(&ctx);
+
+    // Best of three, the first run also pulls the weights into cache
+    rows = inputs.rows < BATCH_ROWS ? inputs.rows : BATCH_ROWS;
+    matrix x = { .rows = rows, .cols = inputs.cols, .stride = inputs.stride, .elements = inputs.elements };
+    matrix yb = { .rows = rows, .cols = y.cols, .stride = y.stride, .elements = y.elements };
+    for (int run = 0; run < 3; run++) {
+        start = now_secs();
+        nn_predict(model, x, yb);
+        double ns = (now_secs() - start) / rows * 1e9;
+        if (run == 0 || ns < r.batch_ns) r.batch_ns = ns;
+    }
+
+    nn_predict(model, inputs, y);
+    double cost = 0;
+    for (size_t i = 0; i < y.rows; i++) {
+        for (size_t j = 0; j < y.cols; j++) {
+            float d = MATRIX_AT(y, i, j) - MATRIX_AT(soft, i, j);
+            cost += d * d;
+        }
+    }
+    r.cost = cost / y.rows;
+    r.teacher_match = match_rate(y, soft, argmax);
+    if (labels.elements != NULL) r.label_match = match_rate(y, labels, argmax);
+    matrix_free(&y);
+    return r;
+}
+
+static void print_report(const Report* r, const Report* teacher) {
+    printf("%-24s %10zu %10.1f %10.1f %7.2fx %12.6f %9.2f%%", r->name, r->params, r->row_ns, r->batch_ns,
+           teacher->batch_ns / r->batch_ns, r->cost, r->teacher_match * 100);
+    if (r->label_match >= 0) {
+        printf(" %9.2f%%", r->label_match * 100);
+    } else {
+        printf(" %10s", "-");
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    const char* program = args_shift(&argc, &argv);
+    const char* usage = "Usage: %s <teacher.nn> <data.mat|data.bit> <student.arch>... [--epochs <n>] [--rate <r>] "
+                        "[--batch <rows>] [--cache <soft.mat>] [--seed <n>] [--argmax]\n";
+    if (argc < 3) {
+        fprintf(stderr, usage, program);
+        return 1;
+    }
+    const char* teacher_path = args_shift(&argc, &argv);
+    const char* data_path = args_shift(&argc, &argv);
+    const char** student_paths = malloc(argc * sizeof(*student_paths));
+    assert(student_paths != NULL);
+    size_t student_count = 0;
+    while (argc > 0 && strncmp(argv[0], "--", 2) != 0) student_paths[student_count++] = args_shift(&argc, &argv);
+
+    size_t epochs = 1000;
+    float rate = 1;
+    size_t batch_rows = 0;
+    const char* cache_path = NULL;
+    uint64_t seed = 42;
+    bool argmax = false;
+    while (argc > 0) {
+        const char* flag = args_shift(&argc, &argv);
+        if (strcmp(flag, "--epochs") == 0 && argc > 0) {
+            epochs = strtoul(args_shift(&argc, &argv), NULL, 10);
+        } else if (strcmp(flag, "--rate") == 0 && argc > 0) {
+            rate = strtof(args_shift(&argc, &argv), NULL);
+        } else if (strcmp(flag, "--batch") == 0 && argc > 0) {
+            batch_rows = strtoul(args_shift(&argc, &argv), NULL, 10);
+        } else if (strcmp(flag, "--cache") == 0 && argc > 0) {
+            cache_path = args_shift(&argc, &argv);
+        } else if (strcmp(flag, "--seed") == 0 && argc > 0) {
+            seed = strtoull(args_shift(&argc, &argv), NULL, 10);
+        } else if (strcmp(flag, "--argmax") == 0) {
+            argmax = true;
+        } else {
+            fprintf(stderr, usage, program);
+            return 1;
+        }
+    }
+    if (student_count == 0) {
+        fprintf(stderr, usage, program);
+        return 1;
+    }
+
+    NN teacher = nn_load(teacher_path);
+    if (teacher.count == 0) {
+        fprintf(stderr, "ERROR: could not load teacher %s\n", teacher_path);
+        return 1;
+    }
+    size_t in_cols = NN_INPUT(teacher).cols;
+    size_t out_cols = NN_OUTPUT(teacher).cols;
+
+    // Rows of inputs alone, or inputs followed by labels
+    matrix data = load_data(data_path);
+    if (data.elements == NULL || data.rows == 0) {
+        fprintf(stderr, "ERROR: could not read data %s\n", data_path);
+        return 1;
+    }
+    if (data.cols != in_cols && data.cols != in_cols + out_cols) {
+        fprintf(stderr, "ERROR: %s has %zu columns, the teacher takes %zu inputs and gives %zu outputs\n",
+                data_path, data.cols, in_cols, out_cols);
+        return 1;
+    }
+    matrix inputs = matrix_cols(data, 0, in_cols);
+    matrix labels = data.cols > in_cols ? matrix_cols(data, in_cols, out_cols) : (matrix) {0};
+
+    char default_cache[4096];
+    if (cache_path == NULL) {
+        snprintf(default_cache, sizeof(default_cache), "%s.soft.mat", teacher_path);
+        cache_path = default_cache;
+    }
+    bool cached;
+    double start = now_secs();
+    matrix soft_t = soft_targets(cache_path, teacher_path, data_path, teacher, inputs, &cached);
+    printf("soft targets for %zu rows %s %s in %.3f s\n", data.rows, cached ? "read from" : "written to",
+           cache_path, now_secs() - start);
+    matrix ti = matrix_cols(soft_t, 0, in_cols);
+    matrix to = matrix_cols(soft_t, in_cols, out_cols);
+    if (batch_rows == 0 || batch_rows > data.rows) batch_rows = data.rows;
+
+    Report* reports = malloc((student_count + 1) * sizeof(*reports));
+    assert(reports != NULL);
+    reports[0] = measure(teacher_path, teacher, inputs, to, labels, argmax);
+
+    size_t trained = 0;
+    for (size_t s = 0; s < student_count; s++) {
+        size_t arch[MAX_LAYERS];
+        size_t count = load_arch(student_paths[s], arch);
+        if (count == 0 || arch[0] != in_cols || arch[count - 1] != out_cols) {
+            fprintf(stderr, "ERROR: %s is not an architecture from %zu inputs to %zu outputs\n",
+                    student_paths[s], in_cols, out_cols);
+            continue;
+        }
+
+        NN nn = nn_alloc(arch, count);
+        NN g = nn_alloc(arch, count);
+        nn_seed(seed);
+        nn_randomise(nn, -1, 1);
+        start = now_secs();
+        size_t batches = (data.rows + batch_rows - 1) / batch_rows;
+        for (size_t e = 0; e < epochs; e++) {
+            for (size_t b = 0; b < batches; b++) {
+                size_t first = b * batch_rows;
+                size_t rows = data.rows - first < batch_rows ? data.rows - first : batch_rows;
+                matrix bi = { .rows = rows, .cols = ti.cols, .stride = ti.stride, .elements = &MATRIX_AT(ti, first, 0) };
+                matrix bo = { .rows = rows, .cols = to.cols, .stride = to.stride, .elements = &MATRIX_AT(to, first, 0) };
+                nn_backprop(nn, &g, bi, bo);
+                nn_learn(nn, g, rate);
+            }
+            if ((e + 1) % (epochs / 10 > 0 ? epochs / 10 : 1) == 0 || e + 1 == epochs) {
+                printf("%s: epoch %zu/%zu, cost %f\n", student_paths[s], e + 1, epochs, nn_cost(nn, ti, to));
+            }
+        }
+        printf("%s: trained in %.3f s\n", student_paths[s], now_secs() - start);
+
+        // small.arch is saved as small.nn
+        char out_path[4096];
+        String_View stem = sv_from_cstr(student_paths[s]);
+        if (sv_ends_with(stem, sv_from_cstr(".arch"))) stem.count -= strlen(".arch");
+        snprintf(out_path, sizeof(out_path), SV_Fmt ".nn", SV_Arg(stem));
+        if (!nn_save(out_path, nn)) fprintf(stderr, "ERROR: could not write %s\n", out_path);
+
+        reports[++trained] = measure(student_paths[s], nn, inputs, to, labels, argmax);
+        nn_free(&nn);
+        nn_free(&g);
+    }
+
+    printf("\n%-24s %10s %10s %10s %8s %12s %10s %10s\n", "model", "params", "row ns", "batch ns", "speedup",
+           "cost", "teacher", "labels");
+    for (size_t i = 0; i <= trained; i++) print_report(&reports[i], &reports[0]);
+
+    free(reports);
+    free(student_paths);
+    if (cached) {
+        matrix_unmap(&soft_t);
+    } else {
+        matrix_free(&soft_t);
+    }
+    if (sv_ends_with(sv_from_cstr(data_path), sv_from_cstr(".bit"))) {
+        matrix_free(&data);
+    } else {
+        matrix_unmap(&data);
+    }
+    nn_free(&teacher);
+    return trained == student_count ? 0 : 1;
+}
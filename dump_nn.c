@@ -135,7 +135,7 @@ void nn_render(Olivec_Canvas img, NN nn) {
 
 
 int main(void) {
-    srand(time(0));
+    nn_seed((uint64_t)time(0));
 
     size_t arch[] = {2, 5, 3, 5, 1};
     size_t arch_count = ARRAY_SIZE(arch);
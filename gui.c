@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "raylib.h"
 #include <time.h>
 #include <float.h>
@@ -109,12 +110,12 @@ void plot_cost(Cost_Plot plot, int rx, int ry, int rw, int rh) {
 
 
 int main(int argc, char** argv) {
-    srand(time(0));
+    nn_seed((uint64_t)time(0));
 
     const char* program = args_shift(&argc, &argv);
 
     if (argc <= 0) {
-        fprintf(stderr, "Usage: %s <model.arch> <model.mat>\n", program);
+        fprintf(stderr, "Usage: %s <model.arch> <model.mat|model.bit> [--bf16] [--stream <rows>]\n", program);
         fprintf(stderr, "ERROR: no architecture file was provided\n");
         return 1;
     }
@@ -122,13 +123,28 @@ int main(int argc, char** argv) {
     const char* arch_file_path = args_shift(&argc, &argv);
     
     if (argc <= 0) {
-        fprintf(stderr, "Usage: %s <model.arch> <model.mat>\n", program);
+        fprintf(stderr, "Usage: %s <model.arch> <model.mat|model.bit> [--bf16] [--stream <rows>]\n", program);
         fprintf(stderr, "ERROR: no data file was provided\n");
         return 1;
     }
     
     const char* data_file_path = args_shift(&argc, &argv); 
 
+    bool use_bf16 = false;
+    size_t stream_rows = 0;
+    while (argc > 0) {
+        const char* flag = args_shift(&argc, &argv);
+        if (strcmp(flag, "--bf16") == 0) {
+            use_bf16 = true;
+        } else if (strcmp(flag, "--stream") == 0 && argc > 0) {
+            stream_rows = strtoull(args_shift(&argc, &argv), NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s <model.arch> <model.mat|model.bit> [--bf16] [--stream <rows>]\n", program);
+            fprintf(stderr, "ERROR: unknown flag %s\n", flag);
+            return 1;
+        }
+    }
+
     unsigned int buffer_len = 0;
     unsigned char* buffer = LoadFileData(arch_file_path, &buffer_len);
     if (buffer == NULL) {
@@ -146,32 +162,72 @@ int main(int argc, char** argv) {
         content = sv_trim_left(content);
     }
 
-    FILE* in = fopen(data_file_path, "rb");
-    if (in == NULL) {
-        fprintf(stderr, "ERROR: could not read file %s:\n", data_file_path);
+    if (use_bf16 && stream_rows > 0) {
+        fprintf(stderr, "ERROR: --bf16 and --stream cannot be combined\n");
         return 1;
     }
-    matrix t = matrix_load(in);
-    fclose(in);
+
+    // Streaming keeps only two chunks of the data in memory and trains on one chunk per step
+    matrix t = {0};
+    Matrix_Stream stream = {0};
+    size_t data_cols;
+    bool packed = sv_ends_with(sv_from_cstr(data_file_path), sv_from_cstr(".bit"));
+    if (packed && stream_rows > 0) {
+        fprintf(stderr, "ERROR: --stream expects a .mat file\n");
+        return 1;
+    }
+    if (packed) {
+        FILE* in = fopen(data_file_path, "rb");
+        if (in == NULL) {
+            fprintf(stderr, "ERROR: could not open packed file %s\n", data_file_path);
+            return 1;
+        }
+        matrix_packed p = matrix_packed_load(in);
+        fclose(in);
+        t = matrix_alloc(p.rows, p.cols, p.cols);
+        matrix_unpack(t, p, 0);
+        matrix_packed_free(&p);
+        data_cols = t.cols;
+    } else if (stream_rows > 0) {
+        stream = matrix_stream_open(data_file_path, stream_rows);
+        if (stream.fd < 0) {
+            fprintf(stderr, "ERROR: could not open matrix file %s\n", data_file_path);
+            return 1;
+        }
+        data_cols = stream.cols;
+    } else {
+        t = matrix_map(data_file_path, MATRIX_MAP_SEQUENTIAL);
+        if (t.elements == NULL) {
+            fprintf(stderr, "ERROR: could not map matrix file %s\n", data_file_path);
+            return 1;
+        }
+        data_cols = t.cols;
+    }
 
     NN_ASSERT(arch.count > 1);
     size_t ins_sz = arch.items[0];
     size_t outs_sz = arch.items[arch.count - 1];
-    NN_ASSERT(t.cols == ins_sz + outs_sz);
-
-    matrix ti = {
-        .rows = t.rows,
-        .cols = ins_sz,
-        .stride = t.stride,
-        .elements = &MATRIX_AT(t, 0, 0),
-    };
-
-    matrix to = {
-        .rows = t.rows,
-        .cols = outs_sz,
-        .stride = t.stride,
-        .elements = &MATRIX_AT(t, 0, ins_sz),
-    };
+    NN_ASSERT(data_cols == ins_sz + outs_sz);
+
+    // With --bf16 only the bf16 copy stays resident, the float rows are released once converted
+    matrix ti = {0};
+    matrix to = {0};
+    matrix_bf16 ti16 = {0};
+    matrix_bf16 to16 = {0};
+    if (use_bf16) {
+        matrix_bf16 t16 = matrix_bf16_alloc(t.rows, t.cols, t.cols);
+        matrix_to_bf16(t16, t);
+        if (packed) {
+            matrix_free(&t);
+        } else {
+            matrix_unmap(&t);
+        }
+        ti16 = (matrix_bf16) { .rows = t16.rows, .cols = ins_sz, .stride = t16.stride, .elements = t16.elements };
+        to16 = (matrix_bf16) { .rows = t16.rows, .cols = outs_sz, .stride = t16.stride, .elements = t16.elements + ins_sz };
+    } else if (stream_rows == 0) {
+        ti = matrix_cols(t, 0, ins_sz);
+        to = matrix_cols(t, ins_sz, outs_sz);
+    }
 
     NN nn = nn_alloc(arch.items, arch.count);
     NN g = nn_alloc(arch.items, arch.count);
@@ -189,7 +245,8 @@ int main(int argc, char** argv) {
 
     size_t epochs = 0;
     size_t max_epoch = 10000;
-    size_t epochs_per_frame = 500;
+    size_t epochs_per_frame = stream_rows > 0 ? 1 : 500;
+    float cost = 0;
     bool paused = false;
     while (!WindowShouldClose()) {
         if (IsKeyPressed(KEY_SPACE)) {
@@ -200,14 +257,41 @@ int main(int argc, char** argv) {
             nn_randomise(nn, -1, 1);
             plot.count = 0;
         }
+        if (IsKeyPressed(KEY_S)) {
+            const char* model_file_path = "model.nn";
+            if (nn_save(model_file_path, nn)) {
+                printf("Saved %s after %zu epochs\n", model_file_path, epochs);
+            } else {
+                fprintf(stderr, "ERROR: could not save model %s\n", model_file_path);
+            }
+        }
         for (size_t i = 0; i < epochs_per_frame && !paused && epochs < max_epoch; i++) {
             if (epochs < max_epoch) {
-                nn_backprop(nn, &g, ti, to);
-                nn_learn(nn, g, rate);
+                if (stream_rows > 0) {
+                    float c = 0;
+                    size_t chunks = 0;
+                    matrix chunk;
+                    while (matrix_stream_next(&stream, &chunk)) {
+                        matrix cti = matrix_cols(chunk, 0, ins_sz);
+                        matrix cto = matrix_cols(chunk, ins_sz, outs_sz);
+                        nn_backprop(nn, &g, cti, cto);
+                        nn_learn(nn, g, rate);
+                        c += nn_cost(nn, cti, cto);
+                        chunks++;
+                    }
+                    cost = chunks > 0 ? c / chunks : 0;
+                } else if (use_bf16) {
+                    nn_backprop_bf16(nn, &g, ti16, to16);
+                    nn_learn(nn, g, rate);
+                    cost = nn_cost_bf16(nn, ti16, to16);
+                } else {
+                    nn_backprop(nn, &g, ti, to);
+                    nn_learn(nn, g, rate);
+                    cost = nn_cost(nn, ti, to);
+                }
                 epochs++;
-                float c = nn_cost(nn, ti, to);
-                da_append(&plot, c);
-                printf("epoch: %zu: cost = %f\n", epochs, c);
+                da_append(&plot, cost);
+                printf("epoch: %zu: cost = %f\n", epochs, cost);
             }
         }
 
@@ -229,7 +313,7 @@ int main(int argc, char** argv) {
             nn_render_raylib(nn, rx, ry, rw, rh);
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu / %zu, Rate = %f, Cost = %f", epochs, max_epoch, rate, nn_cost(nn, ti, to));
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu / %zu, Rate = %f, Cost = %f", epochs, max_epoch, rate, cost);
             DrawText(buffer, 0, 0, h * 0.04, WHITE);
         }
         EndDrawing();
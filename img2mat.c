@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <time.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+typedef struct {
+    char* path;
+    size_t label;
+} Sample;
+
+typedef struct {
+    Sample* items;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+typedef struct {
+    char** items;
+    size_t count;
+    size_t capacity;
+} Names;
+
+#define DA_INIT_CAP 256
+#define da_append(da, item) \
+    do { \
+        if ((da)->count >= (da)->capacity) { \
+            (da)->capacity = (da)->capacity == 0 ? DA_INIT_CAP : (da)->capacity * 2; \
+            (da)->items = realloc((da)->items, (da)->capacity * sizeof(*(da)->items)); \
+            assert((da)->items != NULL && "More RAM Needed"); \
+        } \
+        (da)->items[(da)->count++] = (item); \
+    } while (0)
+
+// Shared by the decoder threads, each one claims the next undecoded sample from `next`
+typedef struct {
+    Samples samples;
+    size_t class_count;
+    int width;
+    int height;
+    matrix t;
+    atomic_size_t next;
+    atomic_size_t failed;       // index + 1 of a sample that could not be decoded, 0 if none
+} Decode_Job;
+
+char* args_shift(int* argc, char*** argv) {
+    assert(*argc > 0);
+    char* result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char* path_join(const char* dir, const char* name) {
+    size_t n = strlen(dir) + 1 + strlen(name) + 1;
+    char* path = malloc(n);
+    assert(path != NULL);
+    snprintf(path, n, "%s/%s", dir, name);
+    return path;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Lists the entries of dir that are directories (want_dirs) or .png files, sorted so labels and row order are stable
+static bool list_dir(const char* dir, bool want_dirs, Names* names) {
+    DIR* d = opendir(dir);
+    if (d == NULL) return false;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char* path = path_join(dir, entry->d_name);
+        struct stat st;
+        bool keep = stat(path, &st) == 0;
+        if (want_dirs) {
+            keep = keep && S_ISDIR(st.st_mode);
+        } else {
+            const char* ext = strrchr(entry->d_name, '.');
+            keep = keep && S_ISREG(st.st_mode) && ext != NULL && strcasecmp(ext, ".png") == 0;
+        }
+        free(path);
+        if (keep) da_append(names, strdup(entry->d_name));
+    }
+    closedir(d);
+    qsort(names->items, names->count, sizeof(*names->items), compare_names);
+    return true;
+}
+
+// The cache is fresh when it is newer than the root and every class folder, adding or
+// removing an image updates the modification time of the folder holding it
+static bool is_older(struct stat a, struct stat b) {
+    if (a.st_mtim.tv_sec != b.st_mtim.tv_sec) return a.st_mtim.tv_sec < b.st_mtim.tv_sec;
+    return a.st_mtim.tv_nsec < b.st_mtim.tv_nsec;
+}
+
+static bool cache_is_fresh(const char* cache_path, const char* root, Names classes) {
+    struct stat cache, st;
+    if (stat(cache_path, &cache) != 0 || stat(root, &st) != 0) return false;
+    if (!is_older(st, cache)) return false;
+    for (size_t c = 0; c < classes.count; c++) {
+        char* dir = path_join(root, classes.items[c]);
+        bool older = stat(dir, &st) == 0 && is_older(st, cache);
+        free(dir);
+        if (!older) return false;
+    }
+    return true;
+}
+
+static void* decode_worker(void* arg) {
+    Decode_Job* job = arg;
+    size_t pixels = (size_t)job->width * job->height;
+    for (;;) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->samples.count) break;
+        Sample s = job->samples.items[i];
+
+        int w, h, comp;
+        uint8_t* img = stbi_load(s.path, &w, &h, &comp, 1);
+        if (img == NULL || w != job->width || h != job->height) {
+            size_t none = 0;
+            atomic_compare_exchange_strong(&job->failed, &none, i + 1);
+            stbi_image_free(img);
+            continue;
+        }
+
+        float* row = &MATRIX_AT(job->t, i, 0);
+        for (size_t p = 0; p < pixels; p++) row[p] = img[p] / 255.f;
+        for (size_t c = 0; c < job->class_count; c++) row[pixels + c] = (float)(c == s.label);
+        stbi_image_free(img);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    const char* program = args_shift(&argc, &argv);
+    const char* usage = "Usage: %s <image folder> <output.mat> [--force] [--threads <n>]\n";
+
+    if (argc < 2) {
+        fprintf(stderr, usage, program);
+        return 1;
+    }
+    const char* root = args_shift(&argc, &argv);
+    const char* out_path = args_shift(&argc, &argv);
+
+    bool force = false;
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    while (argc > 0) {
+        const char* flag = args_shift(&argc, &argv);
+        if (strcmp(flag, "--force") == 0) {
+            force = true;
+        } else if (strcmp(flag, "--threads") == 0 && argc > 0) {
+            thread_count = strtol(args_shift(&argc, &argv), NULL, 10);
+        } else {
+            fprintf(stderr, usage, program);
+            return 1;
+        }
+    }
+    if (thread_count < 1) thread_count = 1;
+
+    double start = now_secs();
+
+    Names classes = {0};
+    if (!list_dir(root, true, &classes) || classes.count == 0) {
+        fprintf(stderr, "ERROR: %s has no class folders\n", root);
+        return 1;
+    }
+
+    if (!force && cache_is_fresh(out_path, root, classes)) {
+        matrix t = matrix_map(out_path, MATRIX_MAP_SEQUENTIAL);
+        if (t.elements != NULL) {
+            printf("%s is up to date: %zu samples x %zu cols, mapped in %.3f ms\n",
+                   out_path, t.rows, t.cols, (now_secs() - start) * 1e3);
+            matrix_unmap(&t);
+            return 0;
+        }
+    }
+
+    Decode_Job job = { .class_count = classes.count };
+    for (size_t c = 0; c < classes.count; c++) {
+        char* dir = path_join(root, classes.items[c]);
+        Names files = {0};
+        if (!list_dir(dir, false, &files)) {
+            fprintf(stderr, "ERROR: could not read folder %s\n", dir);
+            return 1;
+        }
+        for (size_t i = 0; i < files.count; i++) {
+            da_append(&job.samples, ((Sample) { .path = path_join(dir, files.items[i]), .label = c }));
+            free(files.items[i]);
+        }
+        free(files.items);
+        free(dir);
+    }
+    if (job.samples.count == 0) {
+        fprintf(stderr, "ERROR: no .png images under %s\n", root);
+        return 1;
+    }
+
+    int comp;
+    if (!stbi_info(job.samples.items[0].path, &job.width, &job.height, &comp)) {
+        fprintf(stderr, "ERROR: could not read image %s\n", job.samples.items[0].path);
+        return 1;
+    }
+    size_t pixels = (size_t)job.width * job.height;
+    job.t = matrix_alloc(job.samples.count, pixels + classes.count, pixels + classes.count);
+
+    if ((size_t)thread_count > job.samples.count) thread_count = job.samples.count;
+    // The main thread decodes alongside the workers and covers for any that could not start
+    pthread_t* threads = malloc(thread_count * sizeof(*threads));
+    assert(threads != NULL);
+    for (long i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[i], NULL, decode_worker, &job) != 0) threads[i] = pthread_self();
+    }
+    decode_worker(&job);
+    for (long i = 1; i < thread_count; i++) {
+        if (!pthread_equal(threads[i], pthread_self())) pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    size_t failed = atomic_load(&job.failed);
+    if (failed != 0) {
+        fprintf(stderr, "ERROR: could not decode %s as a %dx%d image\n",
+                job.samples.items[failed - 1].path, job.width, job.height);
+        return 1;
+    }
+    double decoded = now_secs();
+
+    // Written next to the cache and renamed, so a later run never maps a half written file
+    size_t tmp_len = strlen(out_path) + sizeof(".tmp");
+    char* tmp_path = malloc(tmp_len);
+    assert(tmp_path != NULL);
+    snprintf(tmp_path, tmp_len, "%s.tmp", out_path);
+    FILE* out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: could not open %s for writing\n", tmp_path);
+        return 1;
+    }
+    matrix_save(out, job.t);
+    bool ok = !ferror(out);
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp_path, out_path) != 0) {
+        fprintf(stderr, "ERROR: could not write %s\n", out_path);
+        remove(tmp_path);
+        return 1;
+    }
+    free(tmp_path);
+
+    printf("decoded %zu images of %dx%d on %ld threads in %.3f ms, wrote %s in %.3f ms\n",
+           job.samples.count, job.width, job.height, thread_count,
+           (decoded - start) * 1e3, out_path, (now_secs() - decoded) * 1e3);
+    printf("architecture: %zu ... %zu\n", pixels, classes.count);
+    for (size_t c = 0; c < classes.count; c++) printf("  output %zu = %s\n", c, classes.items[c]);
+
+    for (size_t i = 0; i < job.samples.count; i++) free(job.samples.items[i].path);
+    free(job.samples.items);
+    for (size_t c = 0; c < classes.count; c++) free(classes.items[c]);
+    free(classes.items);
+    matrix_free(&job.t);
+    return 0;
+}
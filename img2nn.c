@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <time.h>
 #include <float.h>
@@ -17,18 +18,21 @@ char *args_shift(int *argc, char ***argv) {
     return result;
 }
 
+float fourier_freqs[] = {1, 2, 4};
+
 int main(int argc, char** argv) {
-    srand(time(0));
+    nn_seed((uint64_t)time(0));
     
     const char* program = args_shift(&argc, &argv);
 
     if (argc <= 0) {
-        fprintf(stderr, "Usage: %s <input.png\n>", program);
+        fprintf(stderr, "Usage: %s <input.png> [--resume]\n", program);
         fprintf(stderr, "ERROR: no input file is provided\n");
         return 1;
     }
 
     const char* img_file_path = args_shift(&argc, &argv);
+    bool resume = argc > 0 && strcmp(args_shift(&argc, &argv), "--resume") == 0;
 
     int img_width, img_height, img_comp;
     uint8_t* img_pixels = (uint8_t*) stbi_load(img_file_path, &img_width, &img_height, &img_comp, 0);
@@ -46,24 +50,29 @@ int main(int argc, char** argv) {
     printf("%s size %dx%d %d bits\n", img_file_path, img_width, img_height, img_comp * 8);
 
 
-    matrix t = matrix_alloc(img_width * img_height, 3, 3);
+    size_t enc_cols = matrix_fourier_cols(2, ARRAY_SIZE(fourier_freqs));
+    matrix coords = matrix_alloc(img_width * img_height, 2, 2);
+    matrix t = matrix_alloc(img_width * img_height, enc_cols + 1, enc_cols + 1);
 
     for (int y = 0; y < img_height; y++) {
         for (int x = 0; x < img_width; x++) {
             size_t i = y * img_width + x;
-            MATRIX_AT(t, i, 0) = (float) x / (img_width - 1);
-            MATRIX_AT(t, i, 1) = (float) y / (img_height - 1);
-            MATRIX_AT(t, i, 2) = img_pixels[i] / 255.f;
+            MATRIX_AT(coords, i, 0) = (float) x / (img_width - 1);
+            MATRIX_AT(coords, i, 1) = (float) y / (img_height - 1);
+            MATRIX_AT(t, i, enc_cols) = img_pixels[i] / 255.f;
         }
     }
 
     matrix ti = {
         .rows = t.rows,
-        .cols = 2,
+        .cols = enc_cols,
         .stride = t.stride,
         .elements = &MATRIX_AT(t, 0, 0),
     };
 
+    matrix_fourier_features(ti, coords, fourier_freqs, ARRAY_SIZE(fourier_freqs));
+    matrix_free(&coords);
+
     matrix to = {
         .rows = t.rows,
         .cols = 1,
@@ -74,11 +83,14 @@ int main(int argc, char** argv) {
     // MATRIX_DISPLAY(ti);
     // MATRIX_DISPLAY(to);
 
-    size_t arch[] = {2, 7, 5, 1};
+    size_t arch[] = {ti.cols, 7, 5, 1};
     NN nn = nn_alloc(arch, ARRAY_SIZE(arch));
     NN g = nn_alloc(arch, ARRAY_SIZE(arch));
     // NN g = nn_alloc(arch.items, arch.count);
     nn_randomise(nn, -1, 1);
+    NN_Model model = nn_model(nn);
+    NN_Context ctx = nn_context_alloc(model, t.rows);
+    matrix preview = matrix_alloc(t.rows, 1, 1);
 
     size_t WINDOW_FACTOR = 80;
     size_t WINDOW_WIDTH = (16 * WINDOW_FACTOR);
@@ -109,6 +121,24 @@ int main(int argc, char** argv) {
     size_t epochs_per_frame = 100;
     float rate = 1.0f;
     bool paused = false;
+
+    // Checkpoints go next to the image, e.g. 6.png.ckpt
+    char ckpt_path[4096];
+    snprintf(ckpt_path, sizeof(ckpt_path), "%s.ckpt", img_file_path);
+    size_t ckpt_every = 1000;
+    NN_Checkpoint ckpt = nn_checkpoint_alloc(ckpt_path);
+    ckpt.compress = true;
+    if (resume) {
+        NN_Train_State state = {0};
+        if (!nn_checkpoint_load(ckpt_path, nn, NULL, &state)) {
+            fprintf(stderr, "ERROR: could not resume from %s\n", ckpt_path);
+            return 1;
+        }
+        epochs = state.epoch;
+        rate = state.rate;
+        plot = (Plot) { .items = state.costs, .count = state.cost_count, .capacity = state.cost_count };
+        printf("Resumed %s at epoch %zu\n", ckpt_path, epochs);
+    }
     while (!WindowShouldClose()) {
         if (IsKeyPressed(KEY_SPACE)) {
             paused = !paused;
@@ -126,6 +156,11 @@ int main(int argc, char** argv) {
                 float c = nn_cost(nn, ti, to);
                 da_append(&plot, c);
                 printf("epoch: %zu: cost = %f\n", epochs, c);
+                if (epochs % ckpt_every == 0) {
+                    nn_checkpoint_save(&ckpt, nn, NULL, (NN_Train_State) {
+                        .epoch = epochs, .rate = rate, .costs = plot.items, .cost_count = plot.count,
+                    });
+                }
             }
         }
 
@@ -148,12 +183,10 @@ int main(int argc, char** argv) {
             
             float scale = 20;
 
+            nn_infer(model, &ctx, ti, preview);
             for (size_t y = 0; y < (size_t) img_height; y++) {
                 for (size_t x = 0; x < (size_t) img_width; x++) {
-                    MATRIX_AT(NN_INPUT(nn), 0, 0) = (float) x / (img_width - 1);
-                    MATRIX_AT(NN_INPUT(nn), 0, 1) = (float) y / (img_height - 1);
-                    nn_forward(nn);
-                    uint8_t pixel = MATRIX_AT(NN_OUTPUT(nn), 0, 0) * 255.f;
+                    uint8_t pixel = MATRIX_AT(preview, y * img_width + x, 0) * 255.f;
                     ImageDrawPixel(&preview_image, x, y, CLITERAL(Color) { pixel, pixel, pixel, 255 });
                 }
             }
@@ -173,6 +206,13 @@ int main(int argc, char** argv) {
         // if (i == 10000) CloseWindow();
     }
 
+    nn_checkpoint_wait(&ckpt);
+    nn_checkpoint_save(&ckpt, nn, NULL, (NN_Train_State) {
+        .epoch = epochs, .rate = rate, .costs = plot.items, .cost_count = plot.count,
+    });
+    if (!nn_checkpoint_wait(&ckpt)) fprintf(stderr, "ERROR: could not write %s\n", ckpt_path);
+    nn_checkpoint_free(&ckpt);
+
     for (size_t y = 0; y < (size_t) img_height; y++) {
         for (size_t x = 0; x < (size_t) img_width; x++) {
             uint8_t pixel = img_pixels[y * img_width + x]; 
@@ -182,12 +222,11 @@ int main(int argc, char** argv) {
         printf("\n");
     }
 
+    nn_infer(model, &ctx, ti, preview);
+    nn_context_free(&ctx);
     for (size_t y = 0; y < (size_t) img_height; y++) {
         for (size_t x = 0; x < (size_t) img_width; x++) {
-            MATRIX_AT(NN_INPUT(nn), 0, 0) = (float) x / (img_width - 1);
-            MATRIX_AT(NN_INPUT(nn), 0, 1) = (float) y / (img_width - 1);
-            nn_forward(nn);
-            uint8_t pixel = MATRIX_AT(NN_OUTPUT(nn), 0, 0) * 255.f;
+            uint8_t pixel = MATRIX_AT(preview, y * img_width + x, 0) * 255.f;
             if (pixel) printf("%3u ", pixel);
             else printf("   ");
         }
@@ -199,15 +238,21 @@ int main(int argc, char** argv) {
     uint8_t* out_pixels = malloc(sizeof(*out_pixels) * out_height * out_width);
     assert(out_pixels != NULL);
 
+    matrix out_coords = matrix_alloc(out_width * out_height, 2, 2);
     for (size_t y = 0; y < (size_t) out_height; y++) {
         for (size_t x = 0; x < (size_t) out_width; x++) {
-            MATRIX_AT(NN_INPUT(nn), 0, 0) = (float) x / (out_width - 1);
-            MATRIX_AT(NN_INPUT(nn), 0, 1) = (float) y / (out_height - 1);
-            nn_forward(nn);
-            uint8_t pixel = MATRIX_AT(NN_OUTPUT(nn), 0, 0) * 255.f;
-            out_pixels[y * out_width + x] = pixel;
+            MATRIX_AT(out_coords, y * out_width + x, 0) = (float) x / (out_width - 1);
+            MATRIX_AT(out_coords, y * out_width + x, 1) = (float) y / (out_height - 1);
         }
-    }   
+    }
+    matrix out_ti = matrix_alloc(out_coords.rows, enc_cols, enc_cols);
+    matrix out_to = matrix_alloc(out_coords.rows, 1, 1);
+    matrix_fourier_features(out_ti, out_coords, fourier_freqs, ARRAY_SIZE(fourier_freqs));
+    nn_predict(model, out_ti, out_to);
+    for (size_t i = 0; i < out_to.rows; i++) out_pixels[i] = MATRIX_AT(out_to, i, 0) * 255.f;
+    matrix_free(&out_coords);
+    matrix_free(&out_ti);
+    matrix_free(&out_to);
 
     const char* out_file_path = "upscaled.png";
 
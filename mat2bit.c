@@ -0,0 +1,37 @@
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <input.mat> <output.bit>\n", argv[0]);
+        return 1;
+    }
+
+    matrix m = matrix_map(argv[1], MATRIX_MAP_SEQUENTIAL);
+    if (m.elements == NULL) {
+        fprintf(stderr, "ERROR: could not map matrix file %s\n", argv[1]);
+        return 1;
+    }
+
+    matrix_packed p = matrix_pack(m);
+
+    FILE* out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: could not open %s for writing\n", argv[2]);
+        return 1;
+    }
+    matrix_packed_save(out, p);
+    fclose(out);
+
+    size_t bit_cols = 0;
+    for (size_t s = 0; s < p.segment_count; s++) {
+        if (p.segments[s].kind == MATRIX_PACKED_BITS) bit_cols += p.segments[s].count;
+    }
+    printf("%zu rows x %zu cols, %zu bit columns, %zu float columns in %zu segments\n",
+           p.rows, p.cols, bit_cols, p.cols - bit_cols, p.segment_count);
+    printf("%zu -> %zu bytes of row data\n", m.rows * m.cols * sizeof(float), p.rows * p.row_bytes);
+
+    matrix_packed_free(&p);
+    matrix_unmap(&m);
+    return 0;
+}
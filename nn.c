@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -9,30 +10,30 @@
 #define BITS 4
 #define IMG_WIDTH 800
 #define IMG_HEIGHT 600
+#define TABLE_ROWS_MAX (1 << 16)
+#define BATCH_ROWS 1024
+#define PREFETCH_DEPTH 4
+#define PREFETCH_PRODUCERS 2
 
 int main(void) {
-    srand((unsigned)time(NULL));
-
-    size_t n = (1 << BITS);
-    size_t rows = n * n;
-    matrix ti = matrix_alloc(rows, 2 * BITS, 2 * BITS);
-    matrix to = matrix_alloc(rows, BITS + 1, BITS + 1);
-
-    for (size_t i = 0; i < rows; i++) {
-        size_t x = i / n;
-        size_t y = i % n;
-        size_t z = x + y;
-        for (size_t j = 0; j < BITS; j++) {
-            MATRIX_AT(ti, i, j) = (float)((x >> j) & 1);
-            MATRIX_AT(ti, i, j + BITS) = (float)((y >> j) & 1);
-        }
-        for (size_t j = 0; j < BITS; j++) {
-            MATRIX_AT(to, i, j) = (float)((z >> j) & 1);
-        }
-        MATRIX_AT(to, i, BITS) = (float)(z >= n);
+    nn_seed((uint64_t)time(NULL));
+
+    // Small adders train on the whole truth table, wide ones on random batches
+    // that producer threads synthesize ahead of the training loop
+    Dataset_Gen gen = dataset_gen_adder(BITS);
+    NN_Prefetch batches = {0};
+    matrix ti, to;
+    if (gen.count <= TABLE_ROWS_MAX) {
+        ti = matrix_alloc(gen.count, gen.in_cols, gen.in_cols);
+        to = matrix_alloc(gen.count, gen.out_cols, gen.out_cols);
+        dataset_gen_fill(gen, 0, ti, to);
+    } else {
+        batches = nn_prefetch_alloc(PREFETCH_DEPTH, PREFETCH_PRODUCERS, BATCH_ROWS, gen.in_cols, gen.out_cols,
+                                    nn_prefetch_gen_fill, &gen);
+        nn_prefetch_next(&batches, &ti, &to);
     }
 
-    size_t architecture[] = { 2 * BITS, 4 * BITS, BITS + 1 };
+    size_t architecture[] = { gen.in_cols, 2 * gen.in_cols, gen.out_cols };
     NN nn = nn_alloc(architecture, ARRAY_SIZE(architecture));
     NN g = nn_alloc(architecture, ARRAY_SIZE(architecture));
     nn_randomise(nn, -1, 1);
@@ -50,6 +51,7 @@ int main(void) {
     size_t frame_count = 0;
 
     for (size_t iter = 0; iter < total_iters; iter++) {
+        if (batches.slots != NULL) nn_prefetch_next(&batches, &ti, &to);
         nn_backprop(nn, &g, ti, to);
         nn_learn(nn, g, rate);
 
@@ -68,6 +70,14 @@ int main(void) {
     printf("Final Cost = %f\n", nn_cost(nn, ti, to));
     printf("Generated %zu frames.\n", frame_count);
 
+    if (batches.slots != NULL) {
+        printf("Data stalls: %zu of %zu batches, %.3f ms total, %.3f ms max\n",
+               (size_t)batches.stalls, (size_t)batches.consumed, batches.stall_secs * 1e3, batches.max_stall_secs * 1e3);
+        nn_prefetch_free(&batches);
+    } else {
+        matrix_free(&ti);
+        matrix_free(&to);
+    }
     nn_free(&nn);
     nn_free(&g);
     return 0;
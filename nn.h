@@ -1,6 +1,13 @@
 #ifndef NN_HEADER 
 #define NN_HEADER
 
+// The implementation uses POSIX and BSD calls (pread, mmap, madvise, shm_open, clock_gettime,
+// strdup, st_mtim) that strict -std=c11 builds hide. This only helps when nn.h comes before
+// the program's own system includes
+#if defined(NN_IMPLEMENTATION) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 // ----- libraries ------
 #include <stdio.h>
 #include <stddef.h>
@@ -8,6 +15,15 @@
 #include <math.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
 // ----------------------
 
 // ----- standard macros -----
@@ -20,6 +36,10 @@
 #include <assert.h>
 #define NN_ASSERT assert
 #endif // NN_ASSERT
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 // ---------------------------
 
 // ----- custom macros -----
@@ -29,12 +49,33 @@
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 #define NN_INPUT(nn) ((nn).inputs[0])
 #define NN_OUTPUT(nn) ((nn).inputs[(nn).count])
+
+// a * b + c, rounded once where the target has fma and twice elsewhere. Training and inference
+// spell every multiply-add with it, so the bits do not depend on -ffp-contract or -std, and
+// nn.hpp and the code nn2c emits follow the same rule
+#if defined(__FMA__) || defined(__ARM_FEATURE_FMA)
+#define NN_MADD(a, b, c) fmaf((a), (b), (c))
+#else
+#define NN_MADD(a, b, c) ((a) * (b) + (c))
+#endif
 // -------------------------
 
 
 // ----- utility functions -----
+// State of the generator behind rand_float, checkpoints save and restore it so resumed runs stay bit-exact
+uint64_t nn_rng_state = 0x853c49e6748fea9bull;
+
+void nn_seed(uint64_t seed) {
+    nn_rng_state = seed;
+}
+
+// splitmix64, the top 24 bits give a float in [0, 1]
 float rand_float() {
-    return (float) rand() / (float) RAND_MAX;
+    uint64_t z = (nn_rng_state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return (float) (z >> 40) / (float) ((1u << 24) - 1);
 }
 
 float sigmoidf(float x) {
@@ -53,6 +94,16 @@ typedef struct {
 // ----------------------------
 
 
+// ----- matrix mapping -----
+#define MATRIX_FILE_HEADER_SIZE (8 + 2 * sizeof(size_t))
+
+typedef enum {
+    MATRIX_MAP_SEQUENTIAL,      // whole passes over the rows, e.g. epochs
+    MATRIX_MAP_RANDOM,          // shuffled or sparse row access
+} Matrix_Map_Advice;
+// ---------------------------
+
+
 // ----- matrix methods declaration -----
 matrix matrix_alloc(size_t rows, size_t cols, size_t stride);
 void matrix_display(matrix m, const char* name, size_t padding);
@@ -67,15 +118,222 @@ matrix matrix_data_alloc(float* data, size_t rows, size_t cols, size_t stride);
 void matrix_free(matrix* m);
 void matrix_save(FILE* out, matrix m);
 matrix matrix_load(FILE* in);
+void matrix_save_compressed(FILE* out, matrix m);
+matrix matrix_map(const char* path, Matrix_Map_Advice advice);
+void matrix_unmap(matrix* m);
+matrix matrix_cols(matrix m, size_t first, size_t count);
+size_t matrix_fourier_cols(size_t cols, size_t freq_count);
+void matrix_fourier_features(matrix destination, matrix source, const float* freqs, size_t freq_count);
 // -------------------------------------
 
 
+// ----- matrix stream structure -----
+typedef struct {
+    int fd;                     // negative when the file could not be opened
+    size_t rows;                // rows in the whole file
+    size_t cols;
+    size_t chunk_rows;
+    size_t position;            // rows handed out so far in this epoch
+    matrix buffers[2];          // the chunk handed out and the chunk being read
+    size_t front;               // index of the buffer last handed out
+    bool pending;               // a background read into buffers[1 - front] is in flight
+    size_t pending_row;
+    size_t pending_count;
+    bool pending_ok;
+    pthread_t reader;           // started by the first matrix_stream_next, reads every chunk after that
+    bool started;
+    _Atomic uint64_t seq;       // 2 * r + 1: read r is requested, 2 * r + 2: read r is done
+    uint64_t reads;             // reads handed out so far
+    atomic_bool quit;
+} Matrix_Stream;
+// -----------------------------------
+
+
+// ----- matrix stream methods declaration -----
+Matrix_Stream matrix_stream_open(const char* path, size_t chunk_rows);
+bool matrix_stream_next(Matrix_Stream* s, matrix* chunk);
+void matrix_stream_close(Matrix_Stream* s);
+// --------------------------------------------
+
+
+// ----- packed matrix structure -----
+typedef enum {
+    MATRIX_PACKED_BITS,         // 0/1 columns, one bit each, least significant bit first
+    MATRIX_PACKED_FLOATS,       // any other columns, stored as float32
+} Matrix_Packed_Kind;
+
+typedef struct {
+    uint32_t kind;              // Matrix_Packed_Kind
+    uint32_t count;             // consecutive columns of that kind
+} Matrix_Packed_Segment;
+
+typedef struct {
+    size_t rows;
+    size_t cols;
+    size_t row_bytes;           // every row is its segments back to back, bit segments rounded up to whole bytes
+    size_t segment_count;
+    Matrix_Packed_Segment* segments;
+    uint8_t* data;
+} matrix_packed;
+// ------------------------------------
+
+
+// ----- packed matrix methods declaration -----
+matrix_packed matrix_pack(matrix m);
+void matrix_unpack(matrix destination, matrix_packed p, size_t first_row);
+void matrix_packed_save(FILE* out, matrix_packed p);
+matrix_packed matrix_packed_load(FILE* in);
+void matrix_packed_free(matrix_packed* p);
+// ---------------------------------------------
+
+
+// ----- compression structure -----
+#define NN_Z_MAGIC 0x315a4e4eu      // "NNZ1"
+#define NN_Z_BLOCK (256 * 1024)     // blocks are shuffled and compressed independently, one per task
+#define NN_Z_RAW_BLOCK 0x80000000u  // set in a block size entry when the block is stored uncompressed
+
+typedef struct {
+    uint32_t magic;
+    uint32_t elem_size;         // byte shuffle width, 1 leaves the bytes in place
+    uint64_t raw_size;
+    uint32_t block_size;
+    uint32_t block_count;
+} NN_Z_Header;
+// followed by block_count uint32_t compressed block sizes and the blocks back to back
+// ----------------------------------
+
+
+// ----- compression methods declaration -----
+size_t nn_compress_bound(size_t size);
+size_t nn_compress(void* destination, size_t capacity, const void* source, size_t size, size_t elem_size, size_t thread_count);
+size_t nn_decompressed_size(const void* source, size_t source_size);
+bool nn_decompress(void* destination, size_t size, const void* source, size_t source_size, size_t thread_count);
+// --------------------------------------------
+
+
+// ----- dataset generator structure -----
+typedef struct Dataset_Gen Dataset_Gen;
+struct Dataset_Gen {
+    uint64_t count;             // number of distinct samples, row indices are taken modulo count
+    size_t in_cols;
+    size_t out_cols;
+    uint64_t param;             // generator specific: bit width of the adder, truth table of a gate
+    void (*row)(const Dataset_Gen* gen, uint64_t index, float* in, float* out);
+    void* user;
+};
+
+// Truth tables of two input gates, bit (x * 2 + y) holds x OP y
+#define DATASET_GATE_OR   0xE
+#define DATASET_GATE_AND  0x8
+#define DATASET_GATE_NAND 0x7
+#define DATASET_GATE_NOR  0x1
+#define DATASET_GATE_XOR  0x6
+// ---------------------------------------
+
+
+// ----- dataset generator methods declaration -----
+Dataset_Gen dataset_gen_adder(size_t bits);
+Dataset_Gen dataset_gen_gate(uint8_t truth_table);
+Dataset_Gen dataset_gen_xor(void);
+void dataset_gen_fill(Dataset_Gen gen, uint64_t first, matrix ti, matrix to);
+void dataset_gen_sample(Dataset_Gen gen, uint64_t seed, matrix ti, matrix to);
+// -------------------------------------------------
+
+
+// ----- prefetch pipeline structure -----
+// Writes batch number `batch` into ti/to. Called concurrently from every producer thread
+typedef void (*NN_Prefetch_Fill)(void* user, uint64_t batch, matrix ti, matrix to);
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t seq;  // 2 * b: free for batch b, 2 * b + 1: batch b is ready
+    matrix t;                   // inputs followed by outputs on every row
+    matrix ti;                  // column views into t
+    matrix to;
+} NN_Prefetch_Slot;
+
+typedef struct {
+    size_t depth;               // batches prepared ahead of the trainer
+    size_t producer_count;
+    NN_Prefetch_Fill fill;
+    void* user;
+    NN_Prefetch_Slot* slots;
+    pthread_t* producers;
+    _Atomic uint64_t next_batch;    // next batch number a producer will claim
+    atomic_bool quit;
+    bool started;
+    uint64_t consumed;          // batches handed to the trainer so far
+    // instrumentation, trainer side
+    uint64_t stalls;            // hand outs where the batch was not ready yet
+    double stall_secs;          // total time the trainer waited for data
+    double max_stall_secs;
+} NN_Prefetch;
+// ---------------------------------------
+
+
+// ----- prefetch pipeline methods declaration -----
+NN_Prefetch nn_prefetch_alloc(size_t depth, size_t producer_count, size_t batch_rows, size_t in_cols, size_t out_cols,
+                              NN_Prefetch_Fill fill, void* user);
+void nn_prefetch_next(NN_Prefetch* p, matrix* ti, matrix* to);
+void nn_prefetch_free(NN_Prefetch* p);
+void nn_prefetch_gen_fill(void* gen, uint64_t batch, matrix ti, matrix to);
+void nn_prefetch_packed_fill(void* packed, uint64_t batch, matrix ti, matrix to);
+// -------------------------------------------------
+
+
+// ----- bf16 matrix structure -----
+typedef struct {
+    size_t rows;
+    size_t cols;
+    size_t stride;
+    uint16_t* elements;         // upper 16 bits of the float32 pattern (bfloat16)
+} matrix_bf16;
+// ---------------------------------
+
+
+// ----- bf16 methods declaration -----
+uint16_t float_to_bf16(float x);
+float bf16_to_float(uint16_t x);
+void floats_to_bf16(uint16_t* destination, const float* source, size_t n);
+void bf16_to_floats(float* destination, const uint16_t* source, size_t n);
+matrix_bf16 matrix_bf16_alloc(size_t rows, size_t cols, size_t stride);
+void matrix_to_bf16(matrix_bf16 destination, matrix source);
+void matrix_from_bf16(matrix destination, matrix_bf16 source);
+void matrix_bf16_free(matrix_bf16* m);
+// ------------------------------------
+
+
+// ----- CSR matrix structure -----
+#define NN_CSR_ROW_BLOCK 8      // rows of the dense operand that share every loaded CSR entry, one AVX vector
+
+typedef struct {
+    size_t rows;
+    size_t cols;
+    size_t nnz;                 // number of stored (non zero) elements
+    size_t* row_ptr;            // rows + 1 offsets into col_idx / values
+    uint32_t* col_idx;
+    float* values;
+} matrix_csr;
+// --------------------------------
+
+
+// ----- CSR methods declaration -----
+matrix_csr matrix_csr_from_dense(matrix m);
+void matrix_csr_multiplication(matrix destination, matrix m1, matrix_csr m2);
+float matrix_density(matrix m);
+void matrix_csr_free(matrix_csr* m);
+// -----------------------------------
+
+
 // ----- NN structure ------
 typedef struct {
     size_t count;
     matrix* weights;
     matrix* biases;
     matrix* inputs;
+    matrix_csr* sparse;         // optional CSR copy of each layer's weights, used by nn_forward when row_ptr != NULL.
+                                // Dropped by whatever changes the weights, nn_sparsify builds it again
+    void* mapping;              // file image weights and biases point into, set by nn_map and nn_shm_attach
+    size_t mapping_size;
 } NN;
 // -------------------------
 
@@ -91,9 +349,311 @@ void nn_finite_difference(NN nn, NN* g, float eps, matrix ti, matrix to);
 void nn_learn(NN nn, NN g, float rate);
 void nn_zero(NN* nn);
 void nn_backprop(NN nn, NN* g, matrix ti, matrix to);
+float nn_cost_bf16(NN nn, matrix_bf16 ti, matrix_bf16 to);
+void nn_backprop_bf16(NN nn, NN* g, matrix_bf16 ti, matrix_bf16 to);
 void nn_render_to_png(NN nn, int width, int height, const char* filename, float cost);
+size_t nn_param_count(NN nn);
+void nn_params_get(NN nn, float* x);
+void nn_params_set(NN nn, const float* x);
 // ----------------------------------
 
+
+// ----- L-BFGS structure -----
+typedef struct {
+    size_t n;                   // number of parameters in the flattened vector
+    size_t history;             // number of (s, y) correction pairs kept
+    size_t count;               // number of pairs currently stored
+    size_t head;                // ring index where the next pair is written
+    bool ready;                 // cost and gradient below are valid for the current parameters
+    float cost;                 // cost at the current parameters
+    float scale;                // length of the first step tried without curvature pairs, 1 after a reset
+    float* x;                   // current parameters
+    float* g;                   // gradient at the current parameters
+    float* g_next;              // gradient at the accepted line search point
+    float* d;                   // search direction
+    float* xt;                  // line search trial point
+    float* s;                   // history * n parameter differences
+    float* y;                   // history * n gradient differences
+    float* rho;                 // 1 / (y . s) per pair
+    float* alpha;               // two-loop recursion scratch
+} NN_LBFGS;
+// ----------------------------
+
+
+// ----- L-BFGS methods declaration -----
+NN_LBFGS nn_lbfgs_alloc(NN nn, size_t history);
+void nn_lbfgs_reset(NN_LBFGS* opt);
+float nn_lbfgs_step(NN nn, NN* g, NN_LBFGS* opt, matrix ti, matrix to);
+void nn_lbfgs_free(NN_LBFGS* opt);
+// --------------------------------------
+
+
+// ----- int8 NN structure -----
+#define NN_Q8_MAX 127           // activations are quantized to [0, 127] so pmaddubsw pairs never saturate
+#define NN_Q8_ALIGN 32
+#define NN_Q8_ROW_BLOCK 4       // rows that share each loaded weight vector in the batched kernel
+#define NN_Q8_TILE_ROWS 256     // rows nn_q8_forward runs through one context at a time
+
+typedef struct {
+    size_t rows;                // layer inputs
+    size_t cols;                // layer outputs
+    size_t k_pad;               // rows rounded up to NN_Q8_ALIGN
+    int8_t* weights;            // cols x k_pad, transposed so every output is one contiguous dot product
+    int32_t* weight_sums;       // per output sum of its int8 weights, folds the input zero point out of the dot
+    float* weight_scales;       // per output channel weight scale
+    float* biases;
+    float in_scale;             // per layer input activation scale
+    int32_t in_zero;            // per layer input activation zero point
+} NN_Q8_Layer;
+
+// Read only once built, one NN_Q8 can be shared by any number of threads
+typedef struct {
+    size_t count;
+    NN_Q8_Layer* layers;
+} NN_Q8;
+
+// Per thread quantized activations for up to max_batch rows
+typedef struct {
+    size_t max_batch;
+    size_t count;
+    uint8_t** in;               // per layer, max_batch rows of k_pad, the padding stays zero
+    int32_t* acc;               // max_batch rows of the widest layer's dot products
+} NN_Q8_Context;
+// -----------------------------
+
+
+// ----- int8 methods declaration -----
+NN_Q8 nn_quantize(NN nn, matrix ti);
+NN_Q8_Context nn_q8_context_alloc(NN_Q8 q, size_t max_batch);
+void nn_q8_context_free(NN_Q8_Context* ctx);
+void nn_q8_infer(NN_Q8 q, NN_Q8_Context* ctx, matrix x, matrix y);
+void nn_q8_forward(NN_Q8 q, matrix x, matrix y);
+float nn_q8_cost(NN_Q8 q, matrix ti, matrix to);
+size_t nn_q8_bytes(NN_Q8 q);
+void nn_q8_free(NN_Q8* q);
+// ------------------------------------
+
+
+// ----- pruning methods declaration -----
+size_t nn_prune_threshold(NN nn, float threshold);
+size_t nn_prune_top_k(NN nn, float keep);
+void nn_prune_mask(NN nn, NN g);
+void nn_sparsify(NN* nn, float max_density);
+// ---------------------------------------
+
+
+// ----- model file structure -----
+#define NN_FILE_MAGIC "nn.h.mdl"
+#define NN_FILE_VERSION 1
+#define NN_FILE_VERSION_CSR 2   // written instead when a layer is stored as CSR, version 1 readers reject it
+#define NN_FILE_ALIGN 64
+#define NN_FILE_LAYER_CSR 1u    // NN_File_Layer flag, the weights tensor is a CSR image
+#ifndef NN_FILE_MAX_EXPANDED
+#define NN_FILE_MAX_EXPANDED (1ull << 32) // bytes of dense weights all CSR layers of a file may expand to
+#endif
+#define NN_SHM_PREFIX "shm:"    // model paths naming a shared memory segment instead of a file
+
+typedef enum {
+    NN_ACT_SIGMOID,
+} NN_Activation;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t layer_count;       // architecture entries, nn.count + 1
+    uint64_t file_size;
+    uint32_t checksum;          // CRC32 of header, architecture and layer table with this field zeroed
+    uint32_t reserved;
+} NN_File_Header;
+
+typedef struct {
+    uint32_t activation;        // NN_Activation applied after this layer
+    uint32_t weights_checksum;  // CRC32 of the weights tensor
+    uint32_t biases_checksum;   // CRC32 of the biases tensor
+    uint32_t flags;             // NN_FILE_LAYER_CSR or 0, always 0 in version 1
+    uint64_t weights_offset;    // NN_FILE_ALIGN aligned, rows * cols floats, or with NN_FILE_LAYER_CSR
+                                // a uint64 nnz, rows + 1 uint32 row offsets, nnz uint32 columns and nnz floats
+    uint64_t biases_offset;     // NN_FILE_ALIGN aligned, cols floats
+} NN_File_Layer;
+// --------------------------------
+
+
+// ----- model file methods declaration -----
+bool nn_save(const char* path, NN nn);
+NN nn_load(const char* path);
+NN nn_map(const char* path);
+void nn_unmap(NN* nn);
+bool nn_shm_publish(const char* name, NN nn);
+NN nn_shm_attach(const char* name);
+bool nn_shm_unlink(const char* name);
+// ------------------------------------------
+
+
+// ----- checkpoint structure -----
+#define NN_CKPT_MAGIC "nn.h.ckp"
+#define NN_CKPT_VERSION 1
+
+// Training loop state that is not part of the network itself
+typedef struct {
+    uint64_t epoch;
+    float rate;
+    uint32_t flags;             // tool specific, e.g. which optimizer is active
+    float* costs;               // cost history, one entry per epoch
+    size_t cost_count;
+} NN_Train_State;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t epoch;
+    uint64_t rng_state;
+    float rate;
+    uint32_t layer_count;
+    uint64_t param_count;
+    uint64_t cost_count;
+    uint64_t opt_history;       // 0 when no L-BFGS state is stored
+    uint64_t opt_count;
+    uint64_t opt_head;
+    uint32_t opt_ready;
+    float opt_cost;
+} NN_Checkpoint_Header;
+// followed by uint64_t arch[layer_count + 1], the nn_params_get vector, the L-BFGS
+// x, g, s, y and rho arrays when present, the costs and a CRC32 of everything before it
+
+typedef struct {
+    char* path;
+    uint8_t* buffer;            // serialized snapshot, owned by the writer thread while busy
+    size_t size;
+    size_t capacity;
+    pthread_t writer;
+    atomic_bool busy;
+    bool launched;              // writer needs to be joined
+    bool last_ok;               // result of the last finished write
+    size_t written;
+    size_t skipped;             // saves dropped because the previous write was still running
+    bool compress;              // store an nn_compress frame of the snapshot, compressed on the writer thread
+    uint8_t* packed;            // writer side scratch for the compressed frame
+    size_t packed_capacity;
+} NN_Checkpoint;
+// --------------------------------
+
+
+// ----- checkpoint methods declaration -----
+NN_Checkpoint nn_checkpoint_alloc(const char* path);
+bool nn_checkpoint_save(NN_Checkpoint* c, NN nn, const NN_LBFGS* opt, NN_Train_State state);
+bool nn_checkpoint_wait(NN_Checkpoint* c);
+void nn_checkpoint_free(NN_Checkpoint* c);
+bool nn_checkpoint_load(const char* path, NN nn, NN_LBFGS* opt, NN_Train_State* state);
+// ------------------------------------------
+
+
+// ----- inference structure -----
+#define NN_INFER_ROW_BLOCK 8    // rows that share each weight row while it is in L1
+#define NN_PREDICT_TILE_BYTES (256 * 1024) // activations nn_predict keeps live per tile, about an L2
+
+// Read only view of the parameters of an NN. One model can be shared by any number of
+// threads as long as the NN it was taken from is neither trained nor freed meanwhile
+typedef struct {
+    size_t count;
+    const matrix* weights;
+    const matrix* biases;
+    const matrix_csr* sparse;   // the NN's CSR copies or NULL, used like nn_forward does
+    size_t width;               // widest hidden layer, 0 for a single layer network
+} NN_Model;
+
+// Per thread activations for up to max_batch rows, the hidden layers ping pong between two buffers
+typedef struct {
+    size_t max_batch;
+    size_t width;
+    float* buffers[2];
+} NN_Context;
+// -------------------------------
+
+
+// ----- inference methods declaration -----
+NN_Model nn_model(NN nn);
+NN_Context nn_context_alloc(NN_Model model, size_t max_batch);
+void nn_context_free(NN_Context* ctx);
+void nn_infer(NN_Model model, NN_Context* ctx, matrix x, matrix y);
+void nn_predict(NN_Model model, matrix x, matrix y);
+// -----------------------------------------
+
+
+// ----- truth table structure -----
+#ifndef NN_LUT_MAX_INPUTS
+#define NN_LUT_MAX_INPUTS 20    // 2^20 rows, out_cols * 4 MiB of outputs
+#endif // NN_LUT_MAX_INPUTS
+#define NN_LUT_BLOCK 1024       // rows scored per batch, the unit of work of a thread
+
+// Every output of a model whose inputs are all 0 or 1. Row i is the answer for the input
+// whose column j is bit j of i, so inference is one indexed load. The accuracy fields are
+// filled when compiled against a generator, from the same pass over every input
+typedef struct {
+    size_t in_cols;
+    size_t out_cols;
+    uint64_t count;             // 1 << in_cols rows
+    float* outputs;             // count rows of out_cols floats, NULL when the model has too many inputs
+    uint64_t* packed;           // count words, bit j set when output j > 0.5, NULL for more than 64 outputs
+    uint64_t wrong_rows;        // rows with any output on the wrong side of 0.5 from the generator's
+    uint64_t wrong_bits;        // outputs on the wrong side of 0.5
+    double cost;                // mean over rows of the squared error, what nn_cost gives on the full table
+} NN_LUT;
+// ---------------------------------
+
+
+// ----- truth table methods declaration -----
+NN_LUT nn_lut_compile(NN_Model model, const Dataset_Gen* gen, size_t thread_count);
+size_t nn_lut_index(NN_LUT lut, const float* in);
+const float* nn_lut_lookup(NN_LUT lut, const float* in);
+void nn_lut_free(NN_LUT* lut);
+// -------------------------------------------
+
+
+// ----- model registry structure -----
+#define NN_REGISTRY_READERS 64
+
+// One published model, readers only ever see fully loaded entries
+typedef struct {
+    NN nn;
+    NN_Model model;
+    uint64_t version;           // 1 for the first publish, then one more per publish
+    bool mapped;                // nn came from nn_shm_attach and is released with nn_unmap
+} NN_Registry_Entry;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t epoch;    // global epoch the reader entered in, 0 while outside
+} NN_Registry_Reader;
+
+// Readers pin the current entry with two stores and a load, never a lock. A publish swaps
+// the entry, bumps the global epoch and frees the old entry once every reader has either
+// left or entered after the swap. Loading and that wait happen on the publishing thread only
+typedef struct {
+    char* path;                 // a model file, or NN_SHM_PREFIX and a segment name
+    _Atomic(NN_Registry_Entry*) current;
+    _Atomic uint64_t epoch;     // starts at 1 so a reader epoch of 0 means outside
+    NN_Registry_Reader readers[NN_REGISTRY_READERS];
+    _Atomic size_t reader_count;
+    atomic_bool publishing;     // publishes are serialized, a concurrent one fails
+    struct stat seen;           // the file as of the last reload attempt, reloading thread only
+    bool incomplete;            // that attempt found a segment nn_shm_publish was still writing
+    size_t reloads;
+    size_t failed_reloads;
+} NN_Registry;
+// -------------------------------------
+
+
+// ----- model registry methods declaration -----
+NN_Registry nn_registry_alloc(const char* path);
+size_t nn_registry_reader(NN_Registry* reg);
+const NN_Registry_Entry* nn_registry_enter(NN_Registry* reg, size_t reader);
+void nn_registry_exit(NN_Registry* reg, size_t reader);
+bool nn_registry_publish(NN_Registry* reg, NN nn);
+bool nn_registry_changed(const NN_Registry* reg);
+bool nn_registry_reload(NN_Registry* reg);
+void nn_registry_free(NN_Registry* reg);
+// ----------------------------------------------
+
 #ifdef NN_ENABLE_GUI
 #include <float.h>
 #include "raylib.h"
@@ -154,7 +714,7 @@ void matrix_randomise(matrix m, float low, float high) {
     for (size_t i = 0; i < m.rows; i++) {
         for (size_t j = 0; j < m.cols; j++) {
             NN_ASSERT(i < m.rows && j < m.cols);
-            MATRIX_AT(m, i, j) = rand_float() * (high - low) + low;
+            MATRIX_AT(m, i, j) = NN_MADD(rand_float(), high - low, low);
         }
     }
 }
@@ -182,7 +742,7 @@ void matrix_multiplication(matrix destination, matrix m1, matrix m2) {
         for (size_t j = 0; j < destination.cols; j++) {
             MATRIX_AT(destination, i, j) = 0;
             for (size_t k = 0; k < m1.cols; k++) {
-                MATRIX_AT(destination, i, j) += (MATRIX_AT(m1, i, k) * MATRIX_AT(m2, k, j));
+                MATRIX_AT(destination, i, j) = NN_MADD(MATRIX_AT(m1, i, k), MATRIX_AT(m2, k, j), MATRIX_AT(destination, i, j));
             }
         }
     }
@@ -258,229 +818,3157 @@ void matrix_save(FILE* out, matrix m) {
     fwrite(&m.rows, sizeof(m.rows), 1, out);
     fwrite(&m.cols, sizeof(m.cols), 1, out);
     for (size_t i = 0; i < m.rows; i++) {
-        size_t n = fwrite(&MATRIX_AT(m, i, 0), sizeof(*m.elements), m.cols, out);
-        while (n < m.rows * m.cols && !ferror(out)) {
-            size_t k = fwrite(m.elements + n, sizeof(*m.elements), m.rows * m.cols - n, out);
-            n += k;
+        size_t n = 0;
+        while (n < m.cols && !ferror(out)) {
+            n += fwrite(&MATRIX_AT(m, i, n), sizeof(*m.elements), m.cols - n, out);
         }
     }
 }
 
+// Same header as matrix_save with the "nn.h.mtz" magic, followed by the frame size and an nn_compress frame
+// of the row major floats. Not mappable, matrix_load reads it back
+void matrix_save_compressed(FILE* out, matrix m) {
+    size_t size = m.rows * m.cols * sizeof(*m.elements);
+    float* dense = NN_MALLOC(size);
+    uint8_t* frame = NN_MALLOC(nn_compress_bound(size));
+    NN_ASSERT(dense != NULL && frame != NULL);
+    for (size_t i = 0; i < m.rows; i++) memcpy(dense + i * m.cols, &MATRIX_AT(m, i, 0), m.cols * sizeof(*m.elements));
+    uint64_t frame_size = nn_compress(frame, nn_compress_bound(size), dense, size, sizeof(*m.elements), 0);
+    NN_ASSERT(frame_size > 0);
+
+    const char* mm = "nn.h.mtz";
+    fwrite(mm, strlen(mm), 1, out);
+    fwrite(&m.rows, sizeof(m.rows), 1, out);
+    fwrite(&m.cols, sizeof(m.cols), 1, out);
+    fwrite(&frame_size, sizeof(frame_size), 1, out);
+    fwrite(frame, 1, frame_size, out);
+    free(dense);
+    free(frame);
+}
+
+// Reads both the plain "nn.h.mat" layout and the "nn.h.mtz" layout written by matrix_save_compressed
 matrix matrix_load(FILE* in) {
     uint64_t mm;
     fread(&mm, sizeof(mm), 1, in);
-    NN_ASSERT(mm == 0x74616d2e682e6e);
+    NN_ASSERT(mm == 0x74616d2e682e6e6e || mm == 0x7a746d2e682e6e6e);
     size_t rows, cols;
     fread(&rows, sizeof(rows), 1, in);
     fread(&cols, sizeof(cols), 1, in);
     matrix m = matrix_alloc(rows, cols, cols);
 
+    if (mm == 0x7a746d2e682e6e6e) {
+        uint64_t frame_size;
+        fread(&frame_size, sizeof(frame_size), 1, in);
+        uint8_t* frame = NN_MALLOC(frame_size);
+        NN_ASSERT(frame != NULL);
+        size_t got = fread(frame, 1, frame_size, in);
+        NN_ASSERT(got == frame_size);
+        NN_ASSERT(nn_decompressed_size(frame, frame_size) == rows * cols * sizeof(*m.elements));
+        bool ok = nn_decompress(m.elements, rows * cols * sizeof(*m.elements), frame, frame_size, 0);
+        NN_ASSERT(ok);
+        (void) ok;
+        free(frame);
+        return m;
+    }
+
     size_t n = fread(m.elements, sizeof(*m.elements), rows * cols, in);
-    while (n < rows * cols && !ferror(in)) {
-        size_t k = fread(m.elements, sizeof(*m.elements) + n, rows * cols - n, in);
+    while (n < rows * cols && !ferror(in) && !feof(in)) {
+        size_t k = fread(m.elements + n, sizeof(*m.elements), rows * cols - n, in);
         n += k;
     }
 
     return m;
 }
-// -------------------------------------
 
+// The returned matrix is read only and points straight into the page cache.
+// On failure elements is NULL.
+matrix matrix_map(const char* path, Matrix_Map_Advice advice) {
+    matrix m = {0};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return m;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < MATRIX_FILE_HEADER_SIZE) {
+        close(fd);
+        return m;
+    }
+    char header[MATRIX_FILE_HEADER_SIZE];
+    size_t rows, cols;
+    bool valid = pread(fd, header, sizeof(header), 0) == (ssize_t) sizeof(header);
+    memcpy(&rows, header + 8, sizeof(rows));
+    memcpy(&cols, header + 8 + sizeof(rows), sizeof(cols));
+    valid = valid && memcmp(header, "nn.h.mat", 8) == 0 && rows > 0 && cols > 0;
+    valid = valid && rows <= ((size_t) st.st_size - MATRIX_FILE_HEADER_SIZE) / sizeof(float) / cols;
+    if (!valid) {
+        close(fd);
+        return m;
+    }
 
-// ------- nn methods definition -------
-NN nn_alloc(size_t* architecture, size_t layer_count) {
-    NN nn; 
-    nn.count = layer_count - 1;
+    // Only the header and the elements are mapped, whatever trails them in the file is not,
+    // and matrix_unmap recomputes the same size from rows and cols
+    size_t size = MATRIX_FILE_HEADER_SIZE + rows * cols * sizeof(float);
+    void* base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return m;
 
-    nn.inputs = NN_MALLOC(layer_count * sizeof(matrix));
-    NN_ASSERT(nn.inputs != NULL);
-    nn.weights = NN_MALLOC((layer_count - 1) * sizeof(matrix));
-    NN_ASSERT(nn.weights != NULL);
-    nn.biases = NN_MALLOC((layer_count - 1) * sizeof(matrix));
-    NN_ASSERT(nn.biases != NULL);
+    madvise(base, size, advice == MATRIX_MAP_RANDOM ? MADV_RANDOM : MADV_SEQUENTIAL);
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = cols;
+    m.elements = (float*) ((char*) base + MATRIX_FILE_HEADER_SIZE);
+    return m;
+}
 
-    nn.inputs[0] = matrix_alloc(1, architecture[0], architecture[0]);
-    for (size_t i = 1; i < layer_count; i++) {
-        nn.inputs[i] = matrix_alloc(nn.inputs[i - 1].rows, architecture[i], architecture[i]);
-        nn.weights[i - 1] = matrix_alloc(nn.inputs[i - 1].cols, architecture[i], architecture[i]);
-        nn.biases[i - 1] = matrix_alloc(nn.inputs[i - 1].rows, architecture[i], architecture[i]);
+void matrix_unmap(matrix* m) {
+    NN_ASSERT(m != NULL);
+    NN_ASSERT(m -> elements != NULL);
+    void* base = (char*) m -> elements - MATRIX_FILE_HEADER_SIZE;
+    munmap(base, MATRIX_FILE_HEADER_SIZE + m -> rows * m -> cols * sizeof(*m -> elements));
+    m -> elements = NULL;
+}
+
+matrix matrix_cols(matrix m, size_t first, size_t count) {
+    NN_ASSERT(m.elements != NULL);
+    NN_ASSERT(count > 0 && first + count <= m.cols);
+    return (matrix) {
+        .rows = m.rows,
+        .cols = count,
+        .stride = m.stride,
+        .elements = &MATRIX_AT(m, 0, first)
+    };
+}
+size_t matrix_fourier_cols(size_t cols, size_t freq_count) {
+    return cols * (1 + 2 * freq_count);
+}
+
+// Row layout: the raw values, then sin(2 pi f v) and cos(2 pi f v) for every frequency f and value v
+void matrix_fourier_features(matrix destination, matrix source, const float* freqs, size_t freq_count) {
+    NN_ASSERT(destination.elements != NULL && source.elements != NULL);
+    NN_ASSERT(freq_count == 0 || freqs != NULL);
+    NN_ASSERT(destination.rows == source.rows);
+    NN_ASSERT(destination.cols == matrix_fourier_cols(source.cols, freq_count));
+    const float two_pi = 6.28318530718f;
+    for (size_t i = 0; i < source.rows; i++) {
+        size_t c = 0;
+        for (size_t j = 0; j < source.cols; j++) {
+            MATRIX_AT(destination, i, c++) = MATRIX_AT(source, i, j);
+        }
+        for (size_t f = 0; f < freq_count; f++) {
+            for (size_t j = 0; j < source.cols; j++) {
+                float phase = two_pi * freqs[f] * MATRIX_AT(source, i, j);
+                MATRIX_AT(destination, i, c++) = sinf(phase);
+                MATRIX_AT(destination, i, c++) = cosf(phase);
+            }
+        }
     }
-    return nn;
 }
+// -------------------------------------
 
-void nn_display(NN nn, const char* name) {
-    printf("%s = [\n", name);
-    char wname[32], bname[32];
-    for (size_t i = 0; i < nn.count; i++) {
-        snprintf(wname, sizeof(wname), "wei->weights%zu", i);
-        snprintf(bname, sizeof(bname), "bs%zu", i);
-        matrix_display(nn.weights[i], wname, 4);
-        matrix_display(nn.biases[i], bname, 4);
+
+// ----- matrix stream methods definition -----
+// Spins briefly, then yields, then sleeps, so a thread that is far ahead of the other side does not burn a core.
+// Returns false when quit is set first
+static bool nn__seq_wait(_Atomic uint64_t* seq, uint64_t want, atomic_bool* quit) {
+    for (size_t spins = 0; atomic_load_explicit(seq, memory_order_acquire) != want; spins++) {
+        if (atomic_load_explicit(quit, memory_order_relaxed)) return false;
+        if (spins < 64) continue;
+        if (spins < 1024) {
+            sched_yield();
+        } else {
+            nanosleep(&(struct timespec) { .tv_nsec = 20000 }, NULL);
+        }
     }
-    printf("]\n");
+    return true;
 }
 
-void nn_randomise(NN nn, float low, float high) {
-    for (size_t i = 0; i < nn.count; i++) {
-        matrix_randomise(nn.weights[i], low, high);
-        matrix_randomise(nn.biases[i], low, high);
+static void nn__stream_read(Matrix_Stream* s) {
+    matrix dst = s -> buffers[1 - s -> front];
+    size_t size = s -> pending_count * s -> cols * sizeof(float);
+    off_t offset = MATRIX_FILE_HEADER_SIZE + s -> pending_row * s -> cols * sizeof(float);
+    size_t n = 0;
+    while (n < size) {
+        ssize_t k = pread(s -> fd, (char*) dst.elements + n, size - n, offset + n);
+        if (k <= 0) break;
+        n += k;
     }
-} 
+    s -> pending_ok = n == size;
+}
 
-void nn_free(NN* nn) {
-    NN_ASSERT(nn != NULL);
-    for (size_t i = 0; i < nn -> count; i++) {
-        matrix_free(&nn -> weights[i]);
-        matrix_free(&nn -> biases[i]);
-        matrix_free(&nn -> inputs[i]);
+// Reads chunk after chunk as matrix_stream_next asks for them, until matrix_stream_close
+static void* nn__stream_reader(void* arg) {
+    Matrix_Stream* s = arg;
+    for (uint64_t r = 0; nn__seq_wait(&s -> seq, 2 * r + 1, &s -> quit); r++) {
+        nn__stream_read(s);
+        atomic_store_explicit(&s -> seq, 2 * r + 2, memory_order_release);
     }
-    matrix_free(&nn -> inputs[nn -> count]);
-    free(nn -> inputs);
-    free(nn -> weights);
-    free(nn -> biases);
-    nn -> inputs = NULL;
-    nn -> weights = NULL;
-    nn -> biases = NULL;
-    nn -> count = 0;
+    return NULL;
 }
 
-void nn_forward(NN nn) {
-    NN_ASSERT(nn.inputs != NULL && nn.weights != NULL && nn.biases != NULL);
-    for (size_t i = 0; i < nn.count; i++) {
-        matrix_multiplication(nn.inputs[i + 1], nn.inputs[i], nn.weights[i]);
-        matrix_addition(nn.inputs[i + 1], nn.biases[i]);
-        matrix_sigmoid(nn.inputs[i + 1]);
+// Without a reader thread nothing is pending, and matrix_stream_next reads the chunk itself
+static void nn__stream_launch(Matrix_Stream* s, size_t row) {
+    if (!s -> started) s -> started = pthread_create(&s -> reader, NULL, nn__stream_reader, s) == 0;
+    s -> pending = s -> started;
+    if (!s -> pending) return;
+    s -> pending_row = row;
+    s -> pending_count = s -> rows - row < s -> chunk_rows ? s -> rows - row : s -> chunk_rows;
+    atomic_store_explicit(&s -> seq, 2 * s -> reads + 1, memory_order_release);
+}
+
+// Memory is two chunks regardless of the file size. On failure fd is negative,
+// which includes a file too short for the rows its header claims, as in matrix_map.
+Matrix_Stream matrix_stream_open(const char* path, size_t chunk_rows) {
+    NN_ASSERT(chunk_rows > 0);
+    Matrix_Stream s = {0};
+    atomic_init(&s.seq, 0);
+    atomic_init(&s.quit, false);
+    s.fd = open(path, O_RDONLY);
+    if (s.fd < 0) return s;
+    struct stat st;
+    char magic[8];
+    size_t dims[2];
+    bool valid = fstat(s.fd, &st) == 0 && (size_t) st.st_size >= MATRIX_FILE_HEADER_SIZE;
+    valid = valid && pread(s.fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, "nn.h.mat", 8) == 0;
+    valid = valid && pread(s.fd, dims, sizeof(dims), 8) == sizeof(dims) && dims[0] > 0 && dims[1] > 0;
+    valid = valid && dims[0] <= ((size_t) st.st_size - MATRIX_FILE_HEADER_SIZE) / sizeof(float) / dims[1];
+    if (!valid) {
+        close(s.fd);
+        s.fd = -1;
+        return s;
     }
+    s.rows = dims[0];
+    s.cols = dims[1];
+    s.chunk_rows = chunk_rows < s.rows ? chunk_rows : s.rows;
+    s.buffers[0] = matrix_alloc(s.chunk_rows, s.cols, s.cols);
+    s.buffers[1] = matrix_alloc(s.chunk_rows, s.cols, s.cols);
+    return s;
 }
 
-float nn_cost(NN nn, matrix ti, matrix to) {
-    NN_ASSERT(ti.elements != NULL && to.elements != NULL);
-    NN_ASSERT(ti.rows == to.rows);
-    NN_ASSERT(to.cols == NN_OUTPUT(nn).cols);
-    float result = 0;
-    size_t n = ti.rows;
-    for (size_t i = 0; i < n; i++) {
-        matrix x = matrix_row(ti, i);
-        matrix y = matrix_row(to, i);
-        matrix_copy(NN_INPUT(nn), x);
-        nn_forward(nn);
-        size_t q =  to.cols;
-        for (size_t j = 0; j < q; j++) {
-            float d = MATRIX_AT(NN_OUTPUT(nn), 0, j) - MATRIX_AT(y, 0, j);
-            result += d * d;
-        }
+// Hands out the next chunk of the epoch and starts reading the one after it,
+// wrapping to the start of the file for the next epoch. Returns false once
+// at the end of every epoch. The chunk stays valid until the next call, and
+// the stream must not be copied once it has been read from.
+bool matrix_stream_next(Matrix_Stream* s, matrix* chunk) {
+    NN_ASSERT(s != NULL && s -> fd >= 0 && chunk != NULL);
+    if (s -> position >= s -> rows) {
+        s -> position = 0;
+        return false;
     }
-    return result / n;
+    if (!s -> pending) {
+        s -> pending_row = s -> position;
+        s -> pending_count = s -> rows - s -> position < s -> chunk_rows ? s -> rows - s -> position : s -> chunk_rows;
+        nn__stream_read(s);
+    } else {
+        s -> reads += 1;
+        nn__seq_wait(&s -> seq, 2 * s -> reads, &s -> quit);
+        s -> pending = false;
+    }
+    NN_ASSERT(s -> pending_row == s -> position);
+    if (!s -> pending_ok) return false;
+
+    s -> front = 1 - s -> front;
+    size_t count = s -> pending_count;
+    s -> position += count;
+    nn__stream_launch(s, s -> position < s -> rows ? s -> position : 0);
+
+    *chunk = s -> buffers[s -> front];
+    chunk -> rows = count;
+    return true;
 }
 
-void nn_finite_difference(NN nn, NN* g, float eps, matrix ti, matrix to) {
-    NN_ASSERT(g -> weights != NULL && g -> biases != NULL);
-    NN_ASSERT(nn.weights != NULL && nn.biases != NULL);
-    float c = nn_cost(nn, ti, to);
-    float saved;
-    for (size_t i = 0; i < nn.count; i++) {
-        for (size_t j = 0; j < nn.weights[i].rows; j++) {
-            for (size_t k = 0; k < nn.weights[i].cols; k++) {
-                saved = MATRIX_AT(nn.weights[i], j, k);
-                MATRIX_AT(nn.weights[i], j, k) += eps;
-                MATRIX_AT(g -> weights[i], j, k) = (nn_cost(nn, ti, to) - c) / eps;
-                MATRIX_AT(nn.weights[i], j, k) = saved;
-            }
+void matrix_stream_close(Matrix_Stream* s) {
+    NN_ASSERT(s != NULL);
+    atomic_store(&s -> quit, true);
+    if (s -> started) pthread_join(s -> reader, NULL);
+    s -> started = false;
+    s -> pending = false;
+    if (s -> fd >= 0) {
+        close(s -> fd);
+        matrix_free(&s -> buffers[0]);
+        matrix_free(&s -> buffers[1]);
+    }
+    s -> fd = -1;
+}
+// --------------------------------------------
+
+
+// ----- packed matrix methods definition -----
+static size_t nn__segment_bytes(Matrix_Packed_Segment segment) {
+    return segment.kind == MATRIX_PACKED_BITS ? (segment.count + 7) / 8 : segment.count * sizeof(float);
+}
+
+matrix_packed matrix_pack(matrix m) {
+    NN_ASSERT(m.elements != NULL);
+    matrix_packed p = {0};
+    p.rows = m.rows;
+    p.cols = m.cols;
+    p.segments = NN_MALLOC(m.cols * sizeof(*p.segments));
+    NN_ASSERT(p.segments != NULL);
+    for (size_t j = 0; j < m.cols; j++) {
+        uint32_t kind = MATRIX_PACKED_BITS;
+        for (size_t i = 0; i < m.rows && kind == MATRIX_PACKED_BITS; i++) {
+            float v = MATRIX_AT(m, i, j);
+            if (v != 0 && v != 1) kind = MATRIX_PACKED_FLOATS;
         }
-        for (size_t j = 0; j < nn.biases[i].rows; j++) {
-            for (size_t k = 0; k < nn.biases[i].cols; k++) {
-                saved = MATRIX_AT(nn.biases[i], j, k);
-                MATRIX_AT(nn.biases[i], j, k) += eps;
-                MATRIX_AT(g -> biases[i], j, k) = (nn_cost(nn, ti, to) - c) / eps;
-                MATRIX_AT(nn.biases[i], j, k) = saved;
-            }
+        if (p.segment_count > 0 && p.segments[p.segment_count - 1].kind == kind) {
+            p.segments[p.segment_count - 1].count += 1;
+        } else {
+            p.segments[p.segment_count++] = (Matrix_Packed_Segment) { .kind = kind, .count = 1 };
         }
     }
-}
+    for (size_t s = 0; s < p.segment_count; s++) p.row_bytes += nn__segment_bytes(p.segments[s]);
 
-void nn_learn(NN nn, NN g, float rate) {
-    NN_ASSERT(nn.weights != NULL && nn.biases != NULL && g.weights != NULL && g.biases != NULL);
+    p.data = calloc(p.rows, p.row_bytes);
+    NN_ASSERT(p.data != NULL);
+    for (size_t i = 0; i < m.rows; i++) {
+        uint8_t* out = p.data + i * p.row_bytes;
+        size_t j = 0;
+        for (size_t s = 0; s < p.segment_count; s++) {
+            Matrix_Packed_Segment segment = p.segments[s];
+            if (segment.kind == MATRIX_PACKED_BITS) {
+                for (size_t k = 0; k < segment.count; k++) {
+                    out[k / 8] |= (MATRIX_AT(m, i, j + k) != 0) << (k % 8);
+                }
+            } else {
+                for (size_t k = 0; k < segment.count; k++) {
+                    memcpy(out + k * sizeof(float), &MATRIX_AT(m, i, j + k), sizeof(float));
+                }
+            }
+            out += nn__segment_bytes(segment);
+            j += segment.count;
+        }
+    }
+    return p;
+}
+
+static void nn__unpack_bits(float* destination, const uint8_t* bits, size_t count) {
+    size_t k = 0;
+#if defined(__AVX2__)
+    const __m256i mask = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256 one = _mm256_set1_ps(1.f);
+    for (; k + 8 <= count; k += 8) {
+        __m256i b = _mm256_and_si256(_mm256_set1_epi32(bits[k / 8]), mask);
+        __m256 set = _mm256_castsi256_ps(_mm256_cmpeq_epi32(b, mask));
+        _mm256_storeu_ps(destination + k, _mm256_and_ps(set, one));
+    }
+#endif
+    for (; k < count; k++) destination[k] = (bits[k / 8] >> (k % 8)) & 1;
+}
+
+// Unpacks destination.rows rows starting at first_row, e.g. straight into a batch buffer
+void matrix_unpack(matrix destination, matrix_packed p, size_t first_row) {
+    NN_ASSERT(destination.elements != NULL && p.data != NULL);
+    NN_ASSERT(destination.cols == p.cols);
+    NN_ASSERT(first_row + destination.rows <= p.rows);
+    for (size_t i = 0; i < destination.rows; i++) {
+        const uint8_t* in = p.data + (first_row + i) * p.row_bytes;
+        float* out = &MATRIX_AT(destination, i, 0);
+        for (size_t s = 0; s < p.segment_count; s++) {
+            Matrix_Packed_Segment segment = p.segments[s];
+            if (segment.kind == MATRIX_PACKED_BITS) {
+                nn__unpack_bits(out, in, segment.count);
+            } else {
+                memcpy(out, in, segment.count * sizeof(float));
+            }
+            in += nn__segment_bytes(segment);
+            out += segment.count;
+        }
+    }
+}
+
+void matrix_packed_save(FILE* out, matrix_packed p) {
+    const char* mm = "nn.h.bit";
+    fwrite(mm, strlen(mm), 1, out);
+    fwrite(&p.rows, sizeof(p.rows), 1, out);
+    fwrite(&p.cols, sizeof(p.cols), 1, out);
+    fwrite(&p.segment_count, sizeof(p.segment_count), 1, out);
+    fwrite(p.segments, sizeof(*p.segments), p.segment_count, out);
+    fwrite(p.data, p.row_bytes, p.rows, out);
+}
+
+matrix_packed matrix_packed_load(FILE* in) {
+    char mm[8];
+    fread(mm, sizeof(mm), 1, in);
+    NN_ASSERT(memcmp(mm, "nn.h.bit", sizeof(mm)) == 0);
+    matrix_packed p = {0};
+    fread(&p.rows, sizeof(p.rows), 1, in);
+    fread(&p.cols, sizeof(p.cols), 1, in);
+    fread(&p.segment_count, sizeof(p.segment_count), 1, in);
+    NN_ASSERT(p.rows > 0 && p.cols > 0 && p.segment_count > 0 && p.segment_count <= p.cols);
+    p.segments = NN_MALLOC(p.segment_count * sizeof(*p.segments));
+    NN_ASSERT(p.segments != NULL);
+    fread(p.segments, sizeof(*p.segments), p.segment_count, in);
+    size_t cols = 0;
+    for (size_t s = 0; s < p.segment_count; s++) {
+        cols += p.segments[s].count;
+        p.row_bytes += nn__segment_bytes(p.segments[s]);
+    }
+    NN_ASSERT(cols == p.cols);
+    p.data = NN_MALLOC(p.rows * p.row_bytes);
+    NN_ASSERT(p.data != NULL);
+    size_t n = fread(p.data, p.row_bytes, p.rows, in);
+    NN_ASSERT(n == p.rows);
+    return p;
+}
+
+void matrix_packed_free(matrix_packed* p) {
+    NN_ASSERT(p != NULL);
+    free(p -> segments);
+    free(p -> data);
+    *p = (matrix_packed) {0};
+}
+// ---------------------------------------------
+
+
+// ----- compression methods definition -----
+// Byte shuffle: byte b of every w byte element goes to plane b, so the sign/exponent bytes
+// of neighbouring floats line up into long runs the LZ stage can match
+static void nn__shuffle(uint8_t* destination, const uint8_t* source, size_t size, size_t w) {
+    size_t count = size / w;
+    size_t first = 0;
+#if defined(__AVX2__)
+    // 16 floats at a time: gather each float's bytes into dwords, then transpose the 4x4 dwords
+    if (w == sizeof(float)) {
+        const __m128i gather = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        for (; first + 16 <= count; first += 16) {
+            const uint8_t* in = source + first * 4;
+            __m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 0)), gather);
+            __m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 16)), gather);
+            __m128i v2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 32)), gather);
+            __m128i v3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 48)), gather);
+            __m128i t0 = _mm_unpacklo_epi32(v0, v1);
+            __m128i t1 = _mm_unpacklo_epi32(v2, v3);
+            __m128i t2 = _mm_unpackhi_epi32(v0, v1);
+            __m128i t3 = _mm_unpackhi_epi32(v2, v3);
+            _mm_storeu_si128((__m128i*) (destination + 0 * count + first), _mm_unpacklo_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*) (destination + 1 * count + first), _mm_unpackhi_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*) (destination + 2 * count + first), _mm_unpacklo_epi64(t2, t3));
+            _mm_storeu_si128((__m128i*) (destination + 3 * count + first), _mm_unpackhi_epi64(t2, t3));
+        }
+    }
+#endif
+    for (size_t b = 0; b < w; b++) {
+        uint8_t* plane = destination + b * count;
+        for (size_t i = first; i < count; i++) plane[i] = source[i * w + b];
+    }
+    memcpy(destination + count * w, source + count * w, size - count * w);
+}
+
+static void nn__unshuffle(uint8_t* destination, const uint8_t* source, size_t size, size_t w) {
+    size_t count = size / w;
+    size_t first = 0;
+#if defined(__AVX2__)
+    if (w == sizeof(float)) {
+        for (; first + 16 <= count; first += 16) {
+            __m128i b0 = _mm_loadu_si128((const __m128i*) (source + 0 * count + first));
+            __m128i b1 = _mm_loadu_si128((const __m128i*) (source + 1 * count + first));
+            __m128i b2 = _mm_loadu_si128((const __m128i*) (source + 2 * count + first));
+            __m128i b3 = _mm_loadu_si128((const __m128i*) (source + 3 * count + first));
+            __m128i lo01 = _mm_unpacklo_epi8(b0, b1);
+            __m128i hi01 = _mm_unpackhi_epi8(b0, b1);
+            __m128i lo23 = _mm_unpacklo_epi8(b2, b3);
+            __m128i hi23 = _mm_unpackhi_epi8(b2, b3);
+            uint8_t* out = destination + first * 4;
+            _mm_storeu_si128((__m128i*) (out + 0), _mm_unpacklo_epi16(lo01, lo23));
+            _mm_storeu_si128((__m128i*) (out + 16), _mm_unpackhi_epi16(lo01, lo23));
+            _mm_storeu_si128((__m128i*) (out + 32), _mm_unpacklo_epi16(hi01, hi23));
+            _mm_storeu_si128((__m128i*) (out + 48), _mm_unpackhi_epi16(hi01, hi23));
+        }
+    }
+#endif
+    for (size_t b = 0; b < w; b++) {
+        const uint8_t* plane = source + b * count;
+        for (size_t i = first; i < count; i++) destination[i * w + b] = plane[i];
+    }
+    memcpy(destination + count * w, source + count * w, size - count * w);
+}
+
+// LZ stage, the LZ4 block layout: a token with 4 bit literal and match lengths, extra length
+// bytes of 255, the literals, a 16 bit offset. The last sequence only carries literals
+#define NN_LZ_HASH_BITS 14
+#define NN_LZ_MIN_MATCH 4
+#define NN_LZ_LAST_LITERALS 5
+#define NN_LZ_MATCH_LIMIT 12
+
+static uint32_t nn__load32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint8_t* nn__lz_put_length(uint8_t* op, size_t length) {
+    for (; length >= 255; length -= 255) *op++ = 255;
+    *op++ = (uint8_t) length;
+    return op;
+}
+
+// Worst case size of one sequence, checked before it is written
+static size_t nn__lz_sequence_bound(size_t literals, size_t match) {
+    return 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1;
+}
+
+static uint8_t* nn__lz_put_sequence(uint8_t* op, const uint8_t* literals, size_t literal_count, size_t offset, size_t match) {
+    uint8_t* token = op++;
+    *token = (uint8_t) ((literal_count >= 15 ? 15 : literal_count) << 4);
+    if (literal_count >= 15) op = nn__lz_put_length(op, literal_count - 15);
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+    if (match == 0) return op;
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+    size_t m = match - NN_LZ_MIN_MATCH;
+    *token |= (uint8_t) (m >= 15 ? 15 : m);
+    if (m >= 15) op = nn__lz_put_length(op, m - 15);
+    return op;
+}
+
+// Returns the compressed size, or 0 when it would not fit in capacity
+static size_t nn__lz_compress(uint8_t* destination, size_t capacity, const uint8_t* source, size_t size, uint32_t* table) {
+    memset(table, 0, sizeof(*table) << NN_LZ_HASH_BITS);
+    uint8_t* op = destination;
+    uint8_t* oend = destination + capacity;
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t misses = 0;
+    if (size > NN_LZ_MATCH_LIMIT + 1) {
+        size_t limit = size - NN_LZ_MATCH_LIMIT;
+        size_t match_limit = size - NN_LZ_LAST_LITERALS;
+        while (ip < limit) {
+            uint32_t sequence = nn__load32(source + ip);
+            uint32_t h = (sequence * 2654435761u) >> (32 - NN_LZ_HASH_BITS);
+            size_t ref = table[h];
+            table[h] = (uint32_t) ip;
+            if (ref >= ip || ip - ref > 0xFFFF || nn__load32(source + ref) != sequence) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            size_t match = NN_LZ_MIN_MATCH;
+            while (ip + match + 8 <= match_limit) {
+                uint64_t a, b;
+                memcpy(&a, source + ip + match, 8);
+                memcpy(&b, source + ref + match, 8);
+                if (a != b) {
+                    match += __builtin_ctzll(a ^ b) >> 3;
+                    goto extended;
+                }
+                match += 8;
+            }
+            while (ip + match < match_limit && source[ip + match] == source[ref + match]) match++;
+        extended:
+            while (ip > anchor && ref > 0 && source[ip - 1] == source[ref - 1]) {
+                ip--;
+                ref--;
+                match++;
+            }
+
+            if ((size_t) (oend - op) < nn__lz_sequence_bound(ip - anchor, match)) return 0;
+            op = nn__lz_put_sequence(op, source + anchor, ip - anchor, ip - ref, match);
+            ip += match;
+            anchor = ip;
+            if (ip < limit) table[(nn__load32(source + ip - 2) * 2654435761u) >> (32 - NN_LZ_HASH_BITS)] = (uint32_t) (ip - 2);
+        }
+    }
+    if ((size_t) (oend - op) < nn__lz_sequence_bound(size - anchor, 0)) return 0;
+    op = nn__lz_put_sequence(op, source + anchor, size - anchor, 0, 0);
+    return op - destination;
+}
+
+// Checks every length and offset against both buffers, so corrupt input fails instead of overrunning
+static bool nn__lz_decompress(uint8_t* destination, size_t size, const uint8_t* source, size_t source_size) {
+    const uint8_t* ip = source;
+    const uint8_t* iend = source + source_size;
+    uint8_t* op = destination;
+    uint8_t* oend = destination + size;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if ((size_t) (iend - ip) < literals || (size_t) (oend - op) < literals) return false;
+        if (literals <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, literals);
+        }
+        op += literals;
+        ip += literals;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | ((size_t) ip[1] << 8);
+        ip += 2;
+        size_t match = (token & 15) + NN_LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > (size_t) (op - destination) || (size_t) (oend - op) < match) return false;
+        const uint8_t* m = op - offset;
+        if (offset >= 8 && (size_t) (oend - op) >= match + 8) {
+            uint8_t* end = op + match;
+            do {
+                memcpy(op, m, 8);
+                op += 8;
+                m += 8;
+            } while (op < end);
+            op = end;
+        } else if ((size_t) (oend - op) >= match + 8) {
+            // short period: lay down one 8 byte stretch, after that any multiple of the
+            // period that is at least 8 repeats the same pattern without overlapping copies
+            for (size_t k = 0; k < 8; k++) op[k] = m[k];
+            size_t step = offset * ((8 + offset - 1) / offset);
+            uint8_t* end = op + match;
+            for (op += 8; op < end; op += 8) memcpy(op, op - step, 8);
+            op = end;
+        } else {
+            for (size_t k = 0; k < match; k++) op[k] = m[k];
+            op += match;
+        }
+    }
+    return op == oend;
+}
+
+typedef struct {
+    const uint8_t* source;
+    uint8_t* destination;
+    size_t size;                // raw size
+    size_t elem_size;
+    size_t block_count;
+    uint32_t* block_sizes;
+    const size_t* offsets;      // decoding: where each block starts in source
+    _Atomic size_t next;
+    atomic_bool failed;
+} NN__Z_Job;
+
+static size_t nn__z_block_raw_size(const NN__Z_Job* job, size_t k) {
+    size_t first = k * NN_Z_BLOCK;
+    return job -> size - first < NN_Z_BLOCK ? job -> size - first : NN_Z_BLOCK;
+}
+
+// Compresses into NN_Z_BLOCK sized slots of destination, nn_compress packs them afterwards
+static void* nn__z_encode_worker(void* arg) {
+    NN__Z_Job* job = arg;
+    uint8_t* shuffled = NN_MALLOC(NN_Z_BLOCK);
+    uint32_t* table = NN_MALLOC(sizeof(*table) << NN_LZ_HASH_BITS);
+    NN_ASSERT(shuffled != NULL && table != NULL);
+    for (;;) {
+        size_t k = atomic_fetch_add(&job -> next, 1);
+        if (k >= job -> block_count) break;
+        size_t n = nn__z_block_raw_size(job, k);
+        const uint8_t* raw = job -> source + k * NN_Z_BLOCK;
+        uint8_t* out = job -> destination + k * NN_Z_BLOCK;
+        const uint8_t* input = raw;
+        if (job -> elem_size > 1) {
+            nn__shuffle(shuffled, raw, n, job -> elem_size);
+            input = shuffled;
+        }
+        size_t z = nn__lz_compress(out, n - 1, input, n, table);
+        if (z == 0) {
+            memcpy(out, input, n);
+            job -> block_sizes[k] = (uint32_t) n | NN_Z_RAW_BLOCK;
+        } else {
+            job -> block_sizes[k] = (uint32_t) z;
+        }
+    }
+    free(shuffled);
+    free(table);
+    return NULL;
+}
+
+static void* nn__z_decode_worker(void* arg) {
+    NN__Z_Job* job = arg;
+    uint8_t* shuffled = job -> elem_size > 1 ? NN_MALLOC(NN_Z_BLOCK) : NULL;
+    NN_ASSERT(job -> elem_size == 1 || shuffled != NULL);
+    for (;;) {
+        size_t k = atomic_fetch_add(&job -> next, 1);
+        if (k >= job -> block_count || atomic_load(&job -> failed)) break;
+        size_t n = nn__z_block_raw_size(job, k);
+        uint8_t* out = job -> destination + k * NN_Z_BLOCK;
+        uint8_t* target = job -> elem_size > 1 ? shuffled : out;
+        const uint8_t* in = job -> source + job -> offsets[k];
+        uint32_t z = job -> block_sizes[k];
+        bool ok;
+        if (z & NN_Z_RAW_BLOCK) {
+            ok = (z & ~NN_Z_RAW_BLOCK) == n;
+            if (ok) memcpy(target, in, n);
+        } else {
+            ok = nn__lz_decompress(target, n, in, z);
+        }
+        if (!ok) {
+            atomic_store(&job -> failed, true);
+            break;
+        }
+        if (job -> elem_size > 1) nn__unshuffle(out, shuffled, n, job -> elem_size);
+    }
+    free(shuffled);
+    return NULL;
+}
+
+// Runs worker on thread_count threads (0: every online core), the calling thread included
+static void nn__z_run(NN__Z_Job* job, void* (*worker)(void*), size_t thread_count) {
+    if (thread_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cores > 0 ? (size_t) cores : 1;
+    }
+    if (thread_count > job -> block_count) thread_count = job -> block_count;
+    pthread_t* threads = NN_MALLOC((thread_count > 0 ? thread_count : 1) * sizeof(*threads));
+    NN_ASSERT(threads != NULL);
+    for (size_t t = 1; t < thread_count; t++) {
+        if (pthread_create(&threads[t], NULL, worker, job) != 0) threads[t] = pthread_self();
+    }
+    worker(job);
+    for (size_t t = 1; t < thread_count; t++) {
+        if (!pthread_equal(threads[t], pthread_self())) pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+size_t nn_compress_bound(size_t size) {
+    size_t blocks = (size + NN_Z_BLOCK - 1) / NN_Z_BLOCK;
+    return sizeof(NN_Z_Header) + blocks * sizeof(uint32_t) + size;
+}
+
+// Byte shuffles source by elem_size (e.g. sizeof(float)) and LZ compresses it block by block
+// on thread_count threads. Returns the frame size, or 0 when capacity is below nn_compress_bound
+size_t nn_compress(void* destination, size_t capacity, const void* source, size_t size, size_t elem_size, size_t thread_count) {
+    NN_ASSERT(elem_size > 0 && elem_size <= NN_Z_BLOCK);
+    if (capacity < nn_compress_bound(size)) return 0;
+    NN_Z_Header header = {
+        .magic = NN_Z_MAGIC,
+        .elem_size = (uint32_t) elem_size,
+        .raw_size = size,
+        .block_size = NN_Z_BLOCK,
+        .block_count = (uint32_t) ((size + NN_Z_BLOCK - 1) / NN_Z_BLOCK),
+    };
+    NN__Z_Job job = {
+        .source = source,
+        .size = size,
+        .elem_size = elem_size,
+        .block_count = header.block_count,
+    };
+    job.block_sizes = NN_MALLOC((header.block_count > 0 ? header.block_count : 1) * sizeof(uint32_t));
+    job.destination = NN_MALLOC(size > 0 ? size : 1);
+    NN_ASSERT(job.block_sizes != NULL && job.destination != NULL);
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, false);
+    nn__z_run(&job, nn__z_encode_worker, thread_count);
+
+    uint8_t* out = destination;
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), job.block_sizes, header.block_count * sizeof(uint32_t));
+    size_t at = sizeof(header) + header.block_count * sizeof(uint32_t);
+    for (size_t k = 0; k < header.block_count; k++) {
+        size_t z = job.block_sizes[k] & ~NN_Z_RAW_BLOCK;
+        memcpy(out + at, job.destination + k * NN_Z_BLOCK, z);
+        at += z;
+    }
+    free(job.block_sizes);
+    free(job.destination);
+    return at;
+}
+
+// Raw size stored in a frame, 0 when source does not start with one
+size_t nn_decompressed_size(const void* source, size_t source_size) {
+    NN_Z_Header header;
+    if (source_size < sizeof(header)) return 0;
+    memcpy(&header, source, sizeof(header));
+    if (header.magic != NN_Z_MAGIC || header.block_size != NN_Z_BLOCK) return 0;
+    return header.raw_size;
+}
+
+bool nn_decompress(void* destination, size_t size, const void* source, size_t source_size, size_t thread_count) {
+    NN_Z_Header header;
+    if (source_size < sizeof(header)) return false;
+    memcpy(&header, source, sizeof(header));
+    if (header.magic != NN_Z_MAGIC || header.block_size != NN_Z_BLOCK || header.raw_size != size || header.elem_size == 0) return false;
+    if (header.block_count != (size + NN_Z_BLOCK - 1) / NN_Z_BLOCK) return false;
+    size_t table_end = sizeof(header) + (size_t) header.block_count * sizeof(uint32_t);
+    if (source_size < table_end) return false;
+
+    NN__Z_Job job = {
+        .source = source,
+        .destination = destination,
+        .size = size,
+        .elem_size = header.elem_size,
+        .block_count = header.block_count,
+    };
+    size_t* offsets = NN_MALLOC((header.block_count > 0 ? header.block_count : 1) * sizeof(*offsets));
+    job.block_sizes = NN_MALLOC((header.block_count > 0 ? header.block_count : 1) * sizeof(uint32_t));
+    NN_ASSERT(offsets != NULL && job.block_sizes != NULL);
+    memcpy(job.block_sizes, (const uint8_t*) source + sizeof(header), header.block_count * sizeof(uint32_t));
+    size_t at = table_end;
+    for (size_t k = 0; k < header.block_count; k++) {
+        offsets[k] = at;
+        at += job.block_sizes[k] & ~NN_Z_RAW_BLOCK;
+    }
+    job.offsets = offsets;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, at != source_size);
+    if (!atomic_load(&job.failed)) nn__z_run(&job, nn__z_decode_worker, thread_count);
+    bool ok = !atomic_load(&job.failed);
+    free(offsets);
+    free(job.block_sizes);
+    return ok;
+}
+// --------------------------------------------
+
+
+// ----- dataset generator methods definition -----
+static void dataset__adder_row(const Dataset_Gen* gen, uint64_t index, float* in, float* out) {
+    size_t bits = gen -> param;
+    uint64_t n = (uint64_t)1 << bits;
+    uint64_t x = index / n;
+    uint64_t y = index % n;
+    uint64_t z = x + y;
+    for (size_t j = 0; j < bits; j++) {
+        in[j] = (float)((x >> j) & 1);
+        in[j + bits] = (float)((y >> j) & 1);
+        out[j] = (float)((z >> j) & 1);
+    }
+    out[bits] = (float)(z >= n);
+}
+
+static void dataset__gate_row(const Dataset_Gen* gen, uint64_t index, float* in, float* out) {
+    in[0] = (float)(index / 2);
+    in[1] = (float)(index % 2);
+    out[0] = (float)((gen -> param >> index) & 1);
+}
+
+// Every (x, y) pair of two bits-wide numbers, inputs are x then y least significant bit first,
+// outputs are the sum bits followed by the carry
+Dataset_Gen dataset_gen_adder(size_t bits) {
+    NN_ASSERT(bits > 0 && bits < 32);
+    return (Dataset_Gen) {
+        .count = (uint64_t)1 << (2 * bits),
+        .in_cols = 2 * bits,
+        .out_cols = bits + 1,
+        .param = bits,
+        .row = dataset__adder_row,
+    };
+}
+
+Dataset_Gen dataset_gen_gate(uint8_t truth_table) {
+    NN_ASSERT(truth_table < 16);
+    return (Dataset_Gen) {
+        .count = 4,
+        .in_cols = 2,
+        .out_cols = 1,
+        .param = truth_table,
+        .row = dataset__gate_row,
+    };
+}
+
+Dataset_Gen dataset_gen_xor(void) {
+    return dataset_gen_gate(DATASET_GATE_XOR);
+}
+
+// Writes rows first, first + 1, ... wrapping around at gen.count
+void dataset_gen_fill(Dataset_Gen gen, uint64_t first, matrix ti, matrix to) {
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(ti.cols == gen.in_cols && to.cols == gen.out_cols);
+    for (size_t i = 0; i < ti.rows; i++) {
+        gen.row(&gen, (first + i) % gen.count, &MATRIX_AT(ti, i, 0), &MATRIX_AT(to, i, 0));
+    }
+}
+
+static uint64_t dataset__mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Writes uniformly drawn rows. Row i of the batch only depends on (seed, i),
+// so any slice of a batch can be synthesized independently
+void dataset_gen_sample(Dataset_Gen gen, uint64_t seed, matrix ti, matrix to) {
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(ti.cols == gen.in_cols && to.cols == gen.out_cols);
+    for (size_t i = 0; i < ti.rows; i++) {
+        uint64_t index = dataset__mix(seed ^ dataset__mix(i)) % gen.count;
+        gen.row(&gen, index, &MATRIX_AT(ti, i, 0), &MATRIX_AT(to, i, 0));
+    }
+}
+
+static matrix dataset__rows(matrix m, size_t first, size_t count) {
+    return (matrix) {
+        .rows = count,
+        .cols = m.cols,
+        .stride = m.stride,
+        .elements = &MATRIX_AT(m, first, 0),
+    };
+}
+// -------------------------------------------------
+
+
+// ----- prefetch pipeline methods definition -----
+// Returns false when the pipeline is shutting down
+static bool nn__prefetch_wait(NN_Prefetch* p, NN_Prefetch_Slot* slot, uint64_t want) {
+    return nn__seq_wait(&slot -> seq, want, &p -> quit);
+}
+
+static void* nn__prefetch_produce(void* arg) {
+    NN_Prefetch* p = arg;
+    while (!atomic_load_explicit(&p -> quit, memory_order_relaxed)) {
+        uint64_t b = atomic_fetch_add_explicit(&p -> next_batch, 1, memory_order_relaxed);
+        NN_Prefetch_Slot* slot = &p -> slots[b % p -> depth];
+        if (!nn__prefetch_wait(p, slot, 2 * b)) break;
+        p -> fill(p -> user, b, slot -> ti, slot -> to);
+        atomic_store_explicit(&slot -> seq, 2 * b + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static double nn__now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+NN_Prefetch nn_prefetch_alloc(size_t depth, size_t producer_count, size_t batch_rows, size_t in_cols, size_t out_cols,
+                              NN_Prefetch_Fill fill, void* user) {
+    NN_ASSERT(depth > 0 && producer_count > 0 && batch_rows > 0 && fill != NULL);
+    NN_Prefetch p = {
+        .depth = depth,
+        .producer_count = producer_count,
+        .fill = fill,
+        .user = user,
+    };
+    p.slots = aligned_alloc(_Alignof(NN_Prefetch_Slot), depth * sizeof(*p.slots));
+    p.producers = NN_MALLOC(producer_count * sizeof(*p.producers));
+    NN_ASSERT(p.slots != NULL && p.producers != NULL);
+    for (size_t k = 0; k < depth; k++) {
+        atomic_init(&p.slots[k].seq, 2 * k);
+        p.slots[k].t = matrix_alloc(batch_rows, in_cols + out_cols, in_cols + out_cols);
+        p.slots[k].ti = matrix_cols(p.slots[k].t, 0, in_cols);
+        p.slots[k].to = matrix_cols(p.slots[k].t, in_cols, out_cols);
+    }
+    atomic_init(&p.next_batch, 0);
+    atomic_init(&p.quit, false);
+    return p;
+}
+
+// Returns the previous batch to the producers and hands out the next one, in batch order.
+// Producers start on the first call, so p must not be copied after that.
+void nn_prefetch_next(NN_Prefetch* p, matrix* ti, matrix* to) {
+    NN_ASSERT(p != NULL && ti != NULL && to != NULL);
+    if (!p -> started) {
+        for (size_t t = 0; t < p -> producer_count; t++) {
+            int err = pthread_create(&p -> producers[t], NULL, nn__prefetch_produce, p);
+            NN_ASSERT(err == 0);
+            (void)err;
+        }
+        p -> started = true;
+    } else {
+        uint64_t done = p -> consumed - 1;
+        atomic_store_explicit(&p -> slots[done % p -> depth].seq, 2 * (done + p -> depth), memory_order_release);
+    }
+
+    uint64_t b = p -> consumed++;
+    NN_Prefetch_Slot* slot = &p -> slots[b % p -> depth];
+    if (atomic_load_explicit(&slot -> seq, memory_order_acquire) != 2 * b + 1) {
+        double start = nn__now_secs();
+        nn__prefetch_wait(p, slot, 2 * b + 1);
+        double waited = nn__now_secs() - start;
+        p -> stalls += 1;
+        p -> stall_secs += waited;
+        if (waited > p -> max_stall_secs) p -> max_stall_secs = waited;
+    }
+    *ti = slot -> ti;
+    *to = slot -> to;
+}
+
+void nn_prefetch_free(NN_Prefetch* p) {
+    NN_ASSERT(p != NULL);
+    atomic_store(&p -> quit, true);
+    if (p -> started) {
+        for (size_t t = 0; t < p -> producer_count; t++) pthread_join(p -> producers[t], NULL);
+    }
+    for (size_t k = 0; k < p -> depth; k++) {
+        matrix_free(&p -> slots[k].t);
+    }
+    free(p -> slots);
+    free(p -> producers);
+    *p = (NN_Prefetch) {0};
+}
+
+// Fill callbacks for the built in data sources
+
+// user is a Dataset_Gen*, every batch is an independent random draw
+void nn_prefetch_gen_fill(void* gen, uint64_t batch, matrix ti, matrix to) {
+    dataset_gen_sample(*(Dataset_Gen*)gen, dataset__mix(batch), ti, to);
+}
+
+// user is a matrix_packed* whose leading columns are the inputs, batches walk the rows in order and wrap around.
+// Relies on ti and to being the column views of one slot buffer
+void nn_prefetch_packed_fill(void* packed, uint64_t batch, matrix ti, matrix to) {
+    matrix_packed* p = packed;
+    NN_ASSERT(ti.rows == to.rows && ti.cols + to.cols == p -> cols);
+    NN_ASSERT(ti.elements + ti.cols == to.elements && ti.stride == to.stride);
+    matrix rows = { .rows = ti.rows, .cols = p -> cols, .stride = ti.stride, .elements = ti.elements };
+    size_t first = (size_t)((batch * ti.rows) % p -> rows);
+    for (size_t done = 0; done < rows.rows; ) {
+        size_t count = p -> rows - first < rows.rows - done ? p -> rows - first : rows.rows - done;
+        matrix_unpack(dataset__rows(rows, done, count), *p, first);
+        done += count;
+        first = 0;
+    }
+}
+// -------------------------------------------------
+
+
+// ----- bf16 methods definition -----
+uint16_t float_to_bf16(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) return (bits >> 16) | 0x0040;
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+float bf16_to_float(uint16_t x) {
+    uint32_t bits = (uint32_t) x << 16;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+// The vector paths round to nearest even like float_to_bf16 but do not quieten NaNs
+void floats_to_bf16(uint16_t* destination, const float* source, size_t n) {
+    size_t i = 0;
+#if defined(__AVX512BF16__) && defined(__AVX512F__)
+    for (; i + 16 <= n; i += 16) {
+        __m256bh h = _mm512_cvtneps_pbh(_mm512_loadu_ps(source + i));
+        _mm256_storeu_si256((__m256i*) (destination + i), (__m256i) h);
+    }
+#elif defined(__AVX2__)
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i bias = _mm256_set1_epi32(0x7FFF);
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_castps_si256(_mm256_loadu_ps(source + i));
+        __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(v, 16), one);
+        v = _mm256_srli_epi32(_mm256_add_epi32(v, _mm256_add_epi32(lsb, bias)), 16);
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+        _mm_storeu_si128((__m128i*) (destination + i), _mm256_castsi256_si128(v));
+    }
+#endif
+    for (; i < n; i++) destination[i] = float_to_bf16(source[i]);
+}
+
+void bf16_to_floats(float* destination, const uint16_t* source, size_t n) {
+    size_t i = 0;
+#if defined(__AVX512F__)
+    for (; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*) (source + i)));
+        _mm512_storeu_si512((void*) (destination + i), _mm512_slli_epi32(v, 16));
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (source + i)));
+        _mm256_storeu_si256((__m256i*) (destination + i), _mm256_slli_epi32(v, 16));
+    }
+#endif
+    for (; i < n; i++) destination[i] = bf16_to_float(source[i]);
+}
+
+matrix_bf16 matrix_bf16_alloc(size_t rows, size_t cols, size_t stride) {
+    matrix_bf16 m;
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = stride;
+    m.elements = NN_MALLOC(sizeof(*m.elements) * rows * stride);
+    NN_ASSERT(m.elements != NULL);
+    NN_ASSERT(rows > 0 && cols > 0 && stride >= cols);
+    return m;
+}
+
+void matrix_to_bf16(matrix_bf16 destination, matrix source) {
+    NN_ASSERT(destination.elements != NULL && source.elements != NULL);
+    NN_ASSERT(destination.rows == source.rows && destination.cols == source.cols);
+    for (size_t i = 0; i < source.rows; i++) {
+        floats_to_bf16(&MATRIX_AT(destination, i, 0), &MATRIX_AT(source, i, 0), source.cols);
+    }
+}
+
+void matrix_from_bf16(matrix destination, matrix_bf16 source) {
+    NN_ASSERT(destination.elements != NULL && source.elements != NULL);
+    NN_ASSERT(destination.rows == source.rows && destination.cols == source.cols);
+    for (size_t i = 0; i < source.rows; i++) {
+        bf16_to_floats(&MATRIX_AT(destination, i, 0), &MATRIX_AT(source, i, 0), source.cols);
+    }
+}
+
+void matrix_bf16_free(matrix_bf16* m) {
+    NN_ASSERT(m != NULL);
+    NN_ASSERT(m -> elements != NULL);
+    free(m -> elements);
+    m -> elements = NULL;
+}
+// -----------------------------------
+
+
+// ----- CSR methods definition -----
+matrix_csr matrix_csr_from_dense(matrix m) {
+    NN_ASSERT(m.elements != NULL);
+    matrix_csr csr = {0};
+    csr.rows = m.rows;
+    csr.cols = m.cols;
+    for (size_t i = 0; i < m.rows; i++) {
+        for (size_t j = 0; j < m.cols; j++) {
+            csr.nnz += MATRIX_AT(m, i, j) != 0;
+        }
+    }
+    csr.row_ptr = NN_MALLOC((m.rows + 1) * sizeof(*csr.row_ptr));
+    csr.col_idx = NN_MALLOC((csr.nnz > 0 ? csr.nnz : 1) * sizeof(*csr.col_idx));
+    csr.values = NN_MALLOC((csr.nnz > 0 ? csr.nnz : 1) * sizeof(*csr.values));
+    NN_ASSERT(csr.row_ptr != NULL && csr.col_idx != NULL && csr.values != NULL);
+    size_t p = 0;
+    for (size_t i = 0; i < m.rows; i++) {
+        csr.row_ptr[i] = p;
+        for (size_t j = 0; j < m.cols; j++) {
+            float v = MATRIX_AT(m, i, j);
+            if (v != 0) {
+                csr.col_idx[p] = (uint32_t) j;
+                csr.values[p] = v;
+                p++;
+            }
+        }
+    }
+    csr.row_ptr[m.rows] = p;
+    return csr;
+}
+
+// destination = m1 * m2 with m2 sparse. Rows of m1 go in blocks of NN_CSR_ROW_BLOCK copied
+// into a column major panel, so each stored entry of m2 is one contiguous multiply-add over
+// the whole block instead of a scattered one per row; rows left over go one at a time. Every
+// output still sums its terms in ascending k, so the result matches matrix_multiplication on
+// the dense copy
+void matrix_csr_multiplication(matrix destination, matrix m1, matrix_csr m2) {
+    NN_ASSERT(destination.elements != NULL && m1.elements != NULL && m2.row_ptr != NULL);
+    NN_ASSERT(m1.cols == m2.rows);
+    NN_ASSERT(destination.rows == m1.rows);
+    NN_ASSERT(destination.cols == m2.cols);
+    size_t i0 = 0;
+    if (destination.rows >= NN_CSR_ROW_BLOCK) {
+        float* in = NN_MALLOC(m1.cols * NN_CSR_ROW_BLOCK * sizeof(float));
+        float* out = NN_MALLOC(destination.cols * NN_CSR_ROW_BLOCK * sizeof(float));
+        NN_ASSERT(in != NULL && out != NULL);
+        for (; i0 + NN_CSR_ROW_BLOCK <= destination.rows; i0 += NN_CSR_ROW_BLOCK) {
+            for (size_t r = 0; r < NN_CSR_ROW_BLOCK; r++) {
+                size_t i = i0 + r;
+                for (size_t k = 0; k < m1.cols; k++) in[k * NN_CSR_ROW_BLOCK + r] = MATRIX_AT(m1, i, k);
+            }
+            for (size_t j = 0; j < destination.cols * NN_CSR_ROW_BLOCK; j++) out[j] = 0;
+            for (size_t k = 0; k < m1.cols; k++) {
+                const float* a = &in[k * NN_CSR_ROW_BLOCK];
+                for (size_t p = m2.row_ptr[k]; p < m2.row_ptr[k + 1]; p++) {
+                    float* o = &out[m2.col_idx[p] * NN_CSR_ROW_BLOCK];
+                    float v = m2.values[p];
+                    for (size_t r = 0; r < NN_CSR_ROW_BLOCK; r++) o[r] = NN_MADD(a[r], v, o[r]);
+                }
+            }
+            for (size_t r = 0; r < NN_CSR_ROW_BLOCK; r++) {
+                size_t i = i0 + r;
+                for (size_t j = 0; j < destination.cols; j++) MATRIX_AT(destination, i, j) = out[j * NN_CSR_ROW_BLOCK + r];
+            }
+        }
+        free(in);
+        free(out);
+    }
+    for (size_t i = i0; i < destination.rows; i++) {
+        float* out = &MATRIX_AT(destination, i, 0);
+        for (size_t j = 0; j < destination.cols; j++) out[j] = 0;
+        for (size_t k = 0; k < m1.cols; k++) {
+            float a = MATRIX_AT(m1, i, k);
+            if (a == 0) continue;
+            for (size_t p = m2.row_ptr[k]; p < m2.row_ptr[k + 1]; p++) out[m2.col_idx[p]] = NN_MADD(a, m2.values[p], out[m2.col_idx[p]]);
+        }
+    }
+}
+
+float matrix_density(matrix m) {
+    NN_ASSERT(m.elements != NULL);
+    size_t nnz = 0;
+    for (size_t i = 0; i < m.rows; i++) {
+        for (size_t j = 0; j < m.cols; j++) {
+            nnz += MATRIX_AT(m, i, j) != 0;
+        }
+    }
+    return (float) nnz / (m.rows * m.cols);
+}
+
+void matrix_csr_free(matrix_csr* m) {
+    NN_ASSERT(m != NULL);
+    free(m -> row_ptr);
+    free(m -> col_idx);
+    free(m -> values);
+    *m = (matrix_csr) {0};
+}
+
+// Frees the CSR copies once the dense weights they were built from change
+static void nn__sparse_drop(NN nn) {
+    if (nn.sparse == NULL) return;
+    for (size_t i = 0; i < nn.count; i++) {
+        if (nn.sparse[i].row_ptr != NULL) matrix_csr_free(&nn.sparse[i]);
+    }
+}
+// ----------------------------------
+
+
+// ------- nn methods definition -------
+NN nn_alloc(size_t* architecture, size_t layer_count) {
+    NN nn; 
+    nn.count = layer_count - 1;
+
+    nn.inputs = NN_MALLOC(layer_count * sizeof(matrix));
+    NN_ASSERT(nn.inputs != NULL);
+    nn.weights = NN_MALLOC((layer_count - 1) * sizeof(matrix));
+    NN_ASSERT(nn.weights != NULL);
+    nn.biases = NN_MALLOC((layer_count - 1) * sizeof(matrix));
+    NN_ASSERT(nn.biases != NULL);
+    nn.sparse = NULL;
+    nn.mapping = NULL;
+    nn.mapping_size = 0;
+
+    nn.inputs[0] = matrix_alloc(1, architecture[0], architecture[0]);
+    for (size_t i = 1; i < layer_count; i++) {
+        nn.inputs[i] = matrix_alloc(nn.inputs[i - 1].rows, architecture[i], architecture[i]);
+        nn.weights[i - 1] = matrix_alloc(nn.inputs[i - 1].cols, architecture[i], architecture[i]);
+        nn.biases[i - 1] = matrix_alloc(nn.inputs[i - 1].rows, architecture[i], architecture[i]);
+    }
+    return nn;
+}
+
+void nn_display(NN nn, const char* name) {
+    printf("%s = [\n", name);
+    char wname[32], bname[32];
+    for (size_t i = 0; i < nn.count; i++) {
+        snprintf(wname, sizeof(wname), "wei->weights%zu", i);
+        snprintf(bname, sizeof(bname), "bs%zu", i);
+        matrix_display(nn.weights[i], wname, 4);
+        matrix_display(nn.biases[i], bname, 4);
+    }
+    printf("]\n");
+}
+
+void nn_randomise(NN nn, float low, float high) {
+    nn__sparse_drop(nn);
+    for (size_t i = 0; i < nn.count; i++) {
+        matrix_randomise(nn.weights[i], low, high);
+        matrix_randomise(nn.biases[i], low, high);
+    }
+} 
+
+void nn_free(NN* nn) {
+    NN_ASSERT(nn != NULL);
+    for (size_t i = 0; i < nn -> count; i++) {
+        matrix_free(&nn -> weights[i]);
+        matrix_free(&nn -> biases[i]);
+        matrix_free(&nn -> inputs[i]);
+    }
+    matrix_free(&nn -> inputs[nn -> count]);
+    if (nn -> sparse != NULL) {
+        for (size_t i = 0; i < nn -> count; i++) matrix_csr_free(&nn -> sparse[i]);
+        free(nn -> sparse);
+        nn -> sparse = NULL;
+    }
+    free(nn -> inputs);
+    free(nn -> weights);
+    free(nn -> biases);
+    nn -> inputs = NULL;
+    nn -> weights = NULL;
+    nn -> biases = NULL;
+    nn -> count = 0;
+}
+
+void nn_forward(NN nn) {
+    NN_ASSERT(nn.inputs != NULL && nn.weights != NULL && nn.biases != NULL);
+    for (size_t i = 0; i < nn.count; i++) {
+        if (nn.sparse != NULL && nn.sparse[i].row_ptr != NULL) {
+            matrix_csr_multiplication(nn.inputs[i + 1], nn.inputs[i], nn.sparse[i]);
+        } else {
+            matrix_multiplication(nn.inputs[i + 1], nn.inputs[i], nn.weights[i]);
+        }
+        matrix_addition(nn.inputs[i + 1], nn.biases[i]);
+        matrix_sigmoid(nn.inputs[i + 1]);
+    }
+}
+
+// Squared error of NN_OUTPUT against the target row y, after nn_forward
+static float nn__row_cost(NN nn, matrix y) {
+    float result = 0;
+    for (size_t j = 0; j < y.cols; j++) {
+        float d = MATRIX_AT(NN_OUTPUT(nn), 0, j) - MATRIX_AT(y, 0, j);
+        result = NN_MADD(d, d, result);
+    }
+    return result;
+}
+
+float nn_cost(NN nn, matrix ti, matrix to) {
+    NN_ASSERT(ti.elements != NULL && to.elements != NULL);
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(to.cols == NN_OUTPUT(nn).cols);
+    float result = 0;
+    size_t n = ti.rows;
+    for (size_t i = 0; i < n; i++) {
+        matrix x = matrix_row(ti, i);
+        matrix y = matrix_row(to, i);
+        matrix_copy(NN_INPUT(nn), x);
+        nn_forward(nn);
+        result += nn__row_cost(nn, y);
+    }
+    return result / n;
+}
+
+void nn_finite_difference(NN nn, NN* g, float eps, matrix ti, matrix to) {
+    NN_ASSERT(g -> weights != NULL && g -> biases != NULL);
+    NN_ASSERT(nn.weights != NULL && nn.biases != NULL);
+    float c = nn_cost(nn, ti, to);
+    float saved;
+    for (size_t i = 0; i < nn.count; i++) {
+        for (size_t j = 0; j < nn.weights[i].rows; j++) {
+            for (size_t k = 0; k < nn.weights[i].cols; k++) {
+                saved = MATRIX_AT(nn.weights[i], j, k);
+                MATRIX_AT(nn.weights[i], j, k) += eps;
+                MATRIX_AT(g -> weights[i], j, k) = (nn_cost(nn, ti, to) - c) / eps;
+                MATRIX_AT(nn.weights[i], j, k) = saved;
+            }
+        }
+        for (size_t j = 0; j < nn.biases[i].rows; j++) {
+            for (size_t k = 0; k < nn.biases[i].cols; k++) {
+                saved = MATRIX_AT(nn.biases[i], j, k);
+                MATRIX_AT(nn.biases[i], j, k) += eps;
+                MATRIX_AT(g -> biases[i], j, k) = (nn_cost(nn, ti, to) - c) / eps;
+                MATRIX_AT(nn.biases[i], j, k) = saved;
+            }
+        }
+    }
+}
+
+void nn_learn(NN nn, NN g, float rate) {
+    NN_ASSERT(nn.weights != NULL && nn.biases != NULL && g.weights != NULL && g.biases != NULL);
+    nn__sparse_drop(nn);
+    for (size_t i = 0; i < nn.count; i++) {
+        for (size_t j = 0; j < nn.weights[i].rows; j++) {
+            for (size_t k = 0; k < nn.weights[i].cols; k++) {
+                MATRIX_AT(nn.weights[i], j, k) = NN_MADD(-rate, MATRIX_AT(g.weights[i], j, k), MATRIX_AT(nn.weights[i], j, k));
+            }
+        }
+        for (size_t j = 0; j < nn.biases[i].rows; j++) {
+            for (size_t k = 0; k < nn.biases[i].cols; k++) {
+                MATRIX_AT(nn.biases[i], j, k) = NN_MADD(-rate, MATRIX_AT(g.biases[i], j, k), MATRIX_AT(nn.biases[i], j, k));
+            }
+        }
+    }
+}
+
+void nn_zero(NN* nn) {
+    for (size_t i = 0; i < nn -> count; ++i) {
+        matrix_fill(nn -> weights[i], 0);
+        matrix_fill(nn -> biases[i], 0);
+        matrix_fill(nn -> inputs[i], 0);
+    }
+    matrix_fill(nn -> inputs[nn -> count], 0);
+}
+
+// Accumulates the gradient of one sample into g, after nn_forward on that sample
+static void nn__backprop_row(NN nn, NN* g, matrix y) {
+    for (size_t j = 0; j <= nn.count; j++) {
+        NN_ASSERT(g->inputs[j].elements != NULL);
+        matrix_fill(g->inputs[j], 0);
+    }
+
+    for (size_t j = 0; j < y.cols; ++j) {
+        NN_ASSERT(j < NN_OUTPUT(*g).cols && j < NN_OUTPUT(nn).cols);
+        MATRIX_AT(NN_OUTPUT(*g), 0, j) = 2 * (MATRIX_AT(NN_OUTPUT(nn), 0, j) - MATRIX_AT(y, 0, j));
+    }
+
+    for (size_t l = nn.count; l > 0; --l) {
+        NN_ASSERT(l < nn.count + 1);
+        for (size_t j = 0; j < nn.inputs[l].cols; j++) {
+            float a = MATRIX_AT(nn.inputs[l], 0, j);
+            float da = MATRIX_AT(g->inputs[l], 0, j);
+            float d = da * a * (1 - a);
+            NN_ASSERT(j < g->biases[l - 1].cols);
+            MATRIX_AT(g->biases[l - 1], 0, j) += d;
+            for (size_t k = 0; k < nn.inputs[l - 1].cols; k++) {
+                float pa = MATRIX_AT(nn.inputs[l - 1], 0, k);
+                float w = MATRIX_AT(nn.weights[l - 1], k, j);
+                NN_ASSERT(k < g->weights[l - 1].rows && j < g->weights[l - 1].cols);
+                MATRIX_AT(g->weights[l - 1], k, j) = NN_MADD(d, pa, MATRIX_AT(g->weights[l - 1], k, j));
+                NN_ASSERT(k < g->inputs[l - 1].cols);
+                MATRIX_AT(g->inputs[l - 1], 0, k) = NN_MADD(d, w, MATRIX_AT(g->inputs[l - 1], 0, k));
+            }
+        }
+    }
+}
+
+static void nn__gradient_average(NN* g, size_t n) {
+    for (size_t i = 0; i < g->count; i++) {
+        for (size_t j = 0; j < g->weights[i].rows; j++) {
+            for (size_t k = 0; k < g->weights[i].cols; k++) {
+                MATRIX_AT(g->weights[i], j, k) /= n;
+            }
+        }
+        for (size_t j = 0; j < g->biases[i].rows; j++) {
+            for (size_t k = 0; k < g->biases[i].cols; k++) {
+                MATRIX_AT(g->biases[i], j, k) /= n;
+            }
+        }
+    }
+}
+
+void nn_backprop(NN nn, NN* g, matrix ti, matrix to) {
+    NN_ASSERT(ti.rows == to.rows);
+    size_t n = ti.rows;
+    NN_ASSERT(NN_OUTPUT(nn).cols == to.cols);
+    NN_ASSERT(g != NULL);
+    NN_ASSERT(g->inputs != NULL && g->weights != NULL && g->biases != NULL);
+    NN_ASSERT(nn.inputs != NULL && nn.weights != NULL && nn.biases != NULL);
+    NN_ASSERT(n > 0);
+    nn_zero(g);
+    for (size_t i = 0; i < n; ++i) {
+        matrix x = matrix_row(ti, i);
+        matrix y = matrix_row(to, i);
+        matrix_copy(NN_INPUT(nn), x);
+        nn_forward(nn);
+        nn__backprop_row(nn, g, y);
+    }
+    nn__gradient_average(g, n);
+}
+
+// The bf16 variants stream the dataset at half the width and widen each row
+// into NN_INPUT; weights, activations and gradient accumulation stay float32
+float nn_cost_bf16(NN nn, matrix_bf16 ti, matrix_bf16 to) {
+    NN_ASSERT(ti.elements != NULL && to.elements != NULL);
+    NN_ASSERT(ti.rows == to.rows);
+    NN_ASSERT(ti.cols == NN_INPUT(nn).cols);
+    NN_ASSERT(to.cols == NN_OUTPUT(nn).cols);
+    matrix y = matrix_alloc(1, to.cols, to.cols);
+    float result = 0;
+    size_t n = ti.rows;
+    for (size_t i = 0; i < n; i++) {
+        bf16_to_floats(NN_INPUT(nn).elements, &MATRIX_AT(ti, i, 0), ti.cols);
+        bf16_to_floats(y.elements, &MATRIX_AT(to, i, 0), to.cols);
+        nn_forward(nn);
+        result += nn__row_cost(nn, y);
+    }
+    matrix_free(&y);
+    return result / n;
+}
+
+void nn_backprop_bf16(NN nn, NN* g, matrix_bf16 ti, matrix_bf16 to) {
+    NN_ASSERT(ti.rows == to.rows);
+    size_t n = ti.rows;
+    NN_ASSERT(ti.cols == NN_INPUT(nn).cols);
+    NN_ASSERT(NN_OUTPUT(nn).cols == to.cols);
+    NN_ASSERT(g != NULL);
+    NN_ASSERT(n > 0);
+    matrix y = matrix_alloc(1, to.cols, to.cols);
+    nn_zero(g);
+    for (size_t i = 0; i < n; ++i) {
+        bf16_to_floats(NN_INPUT(nn).elements, &MATRIX_AT(ti, i, 0), ti.cols);
+        bf16_to_floats(y.elements, &MATRIX_AT(to, i, 0), to.cols);
+        nn_forward(nn);
+        nn__backprop_row(nn, g, y);
+    }
+    nn__gradient_average(g, n);
+    matrix_free(&y);
+}
+
+size_t nn_param_count(NN nn) {
+    size_t n = 0;
+    for (size_t i = 0; i < nn.count; i++) {
+        n += nn.weights[i].rows * nn.weights[i].cols;
+        n += nn.biases[i].rows * nn.biases[i].cols;
+    }
+    return n;
+}
+
+void nn_params_get(NN nn, float* x) {
+    NN_ASSERT(x != NULL);
+    for (size_t i = 0; i < nn.count; i++) {
+        for (size_t j = 0; j < nn.weights[i].rows; j++) {
+            for (size_t k = 0; k < nn.weights[i].cols; k++) {
+                *x++ = MATRIX_AT(nn.weights[i], j, k);
+            }
+        }
+        for (size_t j = 0; j < nn.biases[i].rows; j++) {
+            for (size_t k = 0; k < nn.biases[i].cols; k++) {
+                *x++ = MATRIX_AT(nn.biases[i], j, k);
+            }
+        }
+    }
+}
+
+void nn_params_set(NN nn, const float* x) {
+    NN_ASSERT(x != NULL);
+    nn__sparse_drop(nn);
+    for (size_t i = 0; i < nn.count; i++) {
+        for (size_t j = 0; j < nn.weights[i].rows; j++) {
+            for (size_t k = 0; k < nn.weights[i].cols; k++) {
+                MATRIX_AT(nn.weights[i], j, k) = *x++;
+            }
+        }
+        for (size_t j = 0; j < nn.biases[i].rows; j++) {
+            for (size_t k = 0; k < nn.biases[i].cols; k++) {
+                MATRIX_AT(nn.biases[i], j, k) = *x++;
+            }
+        }
+    }
+}
+// -------------------------------------
+
+
+// ----- L-BFGS methods definition -----
+#define NN_LBFGS_C1 1e-4f
+#define NN_LBFGS_MAX_BACKTRACK 30
+
+static float nn__dot(const float* a, const float* b, size_t n) {
+    float result = 0;
+    for (size_t i = 0; i < n; i++) {
+        result = NN_MADD(a[i], b[i], result);
+    }
+    return result;
+}
+
+NN_LBFGS nn_lbfgs_alloc(NN nn, size_t history) {
+    NN_ASSERT(history > 0);
+    NN_LBFGS opt = {0};
+    opt.n = nn_param_count(nn);
+    opt.history = history;
+    opt.scale = 1;
+    opt.x = NN_MALLOC(opt.n * sizeof(float));
+    opt.g = NN_MALLOC(opt.n * sizeof(float));
+    opt.g_next = NN_MALLOC(opt.n * sizeof(float));
+    opt.d = NN_MALLOC(opt.n * sizeof(float));
+    opt.xt = NN_MALLOC(opt.n * sizeof(float));
+    opt.s = NN_MALLOC(history * opt.n * sizeof(float));
+    opt.y = NN_MALLOC(history * opt.n * sizeof(float));
+    opt.rho = NN_MALLOC(history * sizeof(float));
+    opt.alpha = NN_MALLOC(history * sizeof(float));
+    NN_ASSERT(opt.x != NULL && opt.g != NULL && opt.g_next != NULL && opt.d != NULL && opt.xt != NULL);
+    NN_ASSERT(opt.s != NULL && opt.y != NULL && opt.rho != NULL && opt.alpha != NULL);
+    return opt;
+}
+
+void nn_lbfgs_reset(NN_LBFGS* opt) {
+    NN_ASSERT(opt != NULL);
+    opt -> count = 0;
+    opt -> head = 0;
+    opt -> ready = false;
+    opt -> scale = 1;
+}
+
+// Direction d = -H * g from the stored correction pairs (two-loop recursion)
+static void nn__lbfgs_direction(NN_LBFGS* opt) {
+    size_t n = opt -> n;
+    size_t m = opt -> history;
+    for (size_t i = 0; i < n; i++) opt -> d[i] = -opt -> g[i];
+    for (size_t c = 0; c < opt -> count; c++) {
+        size_t p = (opt -> head + m - 1 - c) % m;
+        opt -> alpha[p] = opt -> rho[p] * nn__dot(&opt -> s[p * n], opt -> d, n);
+        for (size_t i = 0; i < n; i++) opt -> d[i] = NN_MADD(-opt -> alpha[p], opt -> y[p * n + i], opt -> d[i]);
+    }
+    if (opt -> count > 0) {
+        size_t p = (opt -> head + m - 1) % m;
+        float yy = nn__dot(&opt -> y[p * n], &opt -> y[p * n], n);
+        float gamma = 1.f / (opt -> rho[p] * yy);
+        for (size_t i = 0; i < n; i++) opt -> d[i] *= gamma;
+    }
+    for (size_t c = opt -> count; c > 0; c--) {
+        size_t p = (opt -> head + m - c) % m;
+        float beta = opt -> rho[p] * nn__dot(&opt -> y[p * n], opt -> d, n);
+        for (size_t i = 0; i < n; i++) opt -> d[i] = NN_MADD(opt -> alpha[p] - beta, opt -> s[p * n + i], opt -> d[i]);
+    }
+}
+
+float nn_lbfgs_step(NN nn, NN* g, NN_LBFGS* opt, matrix ti, matrix to) {
+    NN_ASSERT(opt != NULL && g != NULL);
+    NN_ASSERT(opt -> n == nn_param_count(nn));
+    size_t n = opt -> n;
+
+    if (!opt -> ready) {
+        nn_params_get(nn, opt -> x);
+        nn_backprop(nn, g, ti, to);
+        nn_params_get(*g, opt -> g);
+        opt -> cost = nn_cost(nn, ti, to);
+        opt -> ready = true;
+    }
+
+    float gg = nn__dot(opt -> g, opt -> g, n);
+    if (gg == 0) return opt -> cost;
+
+    nn__lbfgs_direction(opt);
+    float gd = nn__dot(opt -> g, opt -> d, n);
+    if (!(gd < 0)) {
+        opt -> count = 0;
+        opt -> head = 0;
+        for (size_t i = 0; i < n; i++) opt -> d[i] = -opt -> g[i];
+        gd = -gg;
+    }
+
+    // Without curvature information the first step is scaled to opt -> scale in length
+    float t = opt -> count > 0 ? 1.f : opt -> scale / sqrtf(gg);
+    bool scaled = opt -> count == 0;
+    float cost = opt -> cost;
+    size_t backtrack = 0;
+    for (; backtrack < NN_LBFGS_MAX_BACKTRACK; backtrack++) {
+        for (size_t i = 0; i < n; i++) opt -> xt[i] = NN_MADD(t, opt -> d[i], opt -> x[i]);
+        nn_params_set(nn, opt -> xt);
+        cost = nn_cost(nn, ti, to);
+        if (cost <= NN_MADD(NN_LBFGS_C1 * t, gd, opt -> cost)) break;
+        t *= 0.5f;
+    }
+
+    // A failed quasi-Newton step is retried along -g. A failed step along -g would be retried
+    // exactly, so the next call starts below every length tried here, or over at unit length
+    // once that underflows, and from a fresh cost and gradient in case ti and to changed.
+    // Accepted steps along -g let the length grow back
+    if (backtrack == NN_LBFGS_MAX_BACKTRACK) {
+        nn_params_set(nn, opt -> x);
+        opt -> count = 0;
+        opt -> head = 0;
+        opt -> ready = false;
+        if (scaled) opt -> scale = t * sqrtf(gg);
+        if (!(opt -> scale > 0)) opt -> scale = 1;
+        return opt -> cost;
+    }
+    if (scaled) opt -> scale = fminf(1.f, 2.f * t * sqrtf(gg));
+
+    nn_backprop(nn, g, ti, to);
+    nn_params_get(*g, opt -> g_next);
+
+    float* s = &opt -> s[opt -> head * n];
+    float* y = &opt -> y[opt -> head * n];
+    for (size_t i = 0; i < n; i++) {
+        s[i] = opt -> xt[i] - opt -> x[i];
+        y[i] = opt -> g_next[i] - opt -> g[i];
+    }
+    float ys = nn__dot(y, s, n);
+    if (ys > 1e-10f) {
+        opt -> rho[opt -> head] = 1.f / ys;
+        opt -> head = (opt -> head + 1) % opt -> history;
+        if (opt -> count < opt -> history) opt -> count += 1;
+    }
+
+    float* swap = opt -> x;
+    opt -> x = opt -> xt;
+    opt -> xt = swap;
+    swap = opt -> g;
+    opt -> g = opt -> g_next;
+    opt -> g_next = swap;
+    opt -> cost = cost;
+    return cost;
+}
+
+void nn_lbfgs_free(NN_LBFGS* opt) {
+    NN_ASSERT(opt != NULL);
+    free(opt -> x);
+    free(opt -> g);
+    free(opt -> g_next);
+    free(opt -> d);
+    free(opt -> xt);
+    free(opt -> s);
+    free(opt -> y);
+    free(opt -> rho);
+    free(opt -> alpha);
+    *opt = (NN_LBFGS) {0};
+}
+// -------------------------------------
+
+
+// ----- int8 methods definition -----
+#if defined(__AVX2__)
+// acc += the u8 x s8 products of a and w, summed in groups of four bytes
+static inline __m256i nn__madd_u8s8(__m256i acc, __m256i a, __m256i w) {
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    return _mm256_dpbusd_epi32(acc, a, w);
+#elif defined(__AVXVNNI__)
+    return _mm256_dpbusd_avx_epi32(acc, a, w);
+#else
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(a, w), _mm256_set1_epi16(1)));
+#endif
+}
+#endif
+
+static int32_t nn__dot_u8s8(const uint8_t* a, const int8_t* w, size_t n) {
+    NN_ASSERT(n % NN_Q8_ALIGN == 0);
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+        __m256i vw = _mm256_loadu_si256((const __m256i*) (w + i));
+        acc = nn__madd_u8s8(acc, va, vw);
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return _mm_cvtsi128_si32(s);
+#else
+    int32_t acc = 0;
+    for (size_t i = 0; i < n; i++) acc += (int32_t) a[i] * (int32_t) w[i];
+    return acc;
+#endif
+}
+
+// c[i][j] = a[i] . w[j] for rows of a and cols of w, both k_pad long. Each loaded weight
+// vector is multiplied into NN_Q8_ROW_BLOCK rows, the remaining rows go through the GEMV
+static void nn__gemm_u8s8(const uint8_t* a, size_t rows, const int8_t* w, size_t cols, size_t k_pad,
+                          int32_t* c, size_t c_stride) {
+    NN_ASSERT(k_pad % NN_Q8_ALIGN == 0);
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + NN_Q8_ROW_BLOCK <= rows; i += NN_Q8_ROW_BLOCK) {
+        const uint8_t* a0 = a + (i + 0) * k_pad;
+        const uint8_t* a1 = a + (i + 1) * k_pad;
+        const uint8_t* a2 = a + (i + 2) * k_pad;
+        const uint8_t* a3 = a + (i + 3) * k_pad;
+        for (size_t j = 0; j < cols; j++) {
+            const int8_t* wj = w + j * k_pad;
+            __m256i c0 = _mm256_setzero_si256();
+            __m256i c1 = _mm256_setzero_si256();
+            __m256i c2 = _mm256_setzero_si256();
+            __m256i c3 = _mm256_setzero_si256();
+            for (size_t k = 0; k < k_pad; k += 32) {
+                __m256i vw = _mm256_loadu_si256((const __m256i*) (wj + k));
+                c0 = nn__madd_u8s8(c0, _mm256_loadu_si256((const __m256i*) (a0 + k)), vw);
+                c1 = nn__madd_u8s8(c1, _mm256_loadu_si256((const __m256i*) (a1 + k)), vw);
+                c2 = nn__madd_u8s8(c2, _mm256_loadu_si256((const __m256i*) (a2 + k)), vw);
+                c3 = nn__madd_u8s8(c3, _mm256_loadu_si256((const __m256i*) (a3 + k)), vw);
+            }
+            // Reduce all four rows at once, lane r ends up holding row i + r
+            __m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(c0, c1), _mm256_hadd_epi32(c2, c3));
+            __m128i r = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+            c[(i + 0) * c_stride + j] = _mm_extract_epi32(r, 0);
+            c[(i + 1) * c_stride + j] = _mm_extract_epi32(r, 1);
+            c[(i + 2) * c_stride + j] = _mm_extract_epi32(r, 2);
+            c[(i + 3) * c_stride + j] = _mm_extract_epi32(r, 3);
+        }
+    }
+#endif
+    for (; i < rows; i++) {
+        for (size_t j = 0; j < cols; j++) c[i * c_stride + j] = nn__dot_u8s8(a + i * k_pad, w + j * k_pad, k_pad);
+    }
+}
+
+static uint8_t nn__q8_clamp(long v) {
+    return v < 0 ? 0 : v > NN_Q8_MAX ? NN_Q8_MAX : (uint8_t) v;
+}
+
+NN_Q8 nn_quantize(NN nn, matrix ti) {
+    NN_ASSERT(ti.rows > 0 && ti.cols == NN_INPUT(nn).cols);
+    NN_Q8 q;
+    q.count = nn.count;
+    q.layers = NN_MALLOC(q.count * sizeof(*q.layers));
+    NN_ASSERT(q.layers != NULL);
+
+    float* lo = NN_MALLOC(nn.count * sizeof(float));
+    float* hi = NN_MALLOC(nn.count * sizeof(float));
+    NN_ASSERT(lo != NULL && hi != NULL);
+    for (size_t l = 0; l < nn.count; l++) {
+        lo[l] = 0;
+        hi[l] = 0;
+    }
+    for (size_t i = 0; i < ti.rows; i++) {
+        matrix_copy(NN_INPUT(nn), matrix_row(ti, i));
+        nn_forward(nn);
+        for (size_t l = 0; l < nn.count; l++) {
+            for (size_t k = 0; k < nn.inputs[l].cols; k++) {
+                float v = MATRIX_AT(nn.inputs[l], 0, k);
+                if (v < lo[l]) lo[l] = v;
+                if (v > hi[l]) hi[l] = v;
+            }
+        }
+    }
+
+    for (size_t l = 0; l < nn.count; l++) {
+        NN_Q8_Layer* layer = &q.layers[l];
+        matrix w = nn.weights[l];
+        layer -> rows = w.rows;
+        layer -> cols = w.cols;
+        layer -> k_pad = (w.rows + NN_Q8_ALIGN - 1) / NN_Q8_ALIGN * NN_Q8_ALIGN;
+        layer -> weights = calloc(layer -> cols * layer -> k_pad, sizeof(*layer -> weights));
+        layer -> weight_sums = NN_MALLOC(layer -> cols * sizeof(*layer -> weight_sums));
+        layer -> weight_scales = NN_MALLOC(layer -> cols * sizeof(*layer -> weight_scales));
+        layer -> biases = NN_MALLOC(layer -> cols * sizeof(*layer -> biases));
+        NN_ASSERT(layer -> weights != NULL && layer -> weight_sums != NULL && layer -> weight_scales != NULL);
+        NN_ASSERT(layer -> biases != NULL);
+
+        float range = hi[l] - lo[l];
+        layer -> in_scale = range > 0 ? range / NN_Q8_MAX : 1.f;
+        layer -> in_zero = (int32_t) lrintf(-lo[l] / layer -> in_scale);
+
+        for (size_t j = 0; j < w.cols; j++) {
+            float max = 0;
+            for (size_t k = 0; k < w.rows; k++) max = fmaxf(max, fabsf(MATRIX_AT(w, k, j)));
+            float scale = max > 0 ? max / 127.f : 1.f;
+            int32_t sum = 0;
+            for (size_t k = 0; k < w.rows; k++) {
+                int8_t v = (int8_t) lrintf(MATRIX_AT(w, k, j) / scale);
+                layer -> weights[j * layer -> k_pad + k] = v;
+                sum += v;
+            }
+            layer -> weight_sums[j] = sum;
+            layer -> weight_scales[j] = scale;
+            layer -> biases[j] = MATRIX_AT(nn.biases[l], 0, j);
+        }
+    }
+
+    free(lo);
+    free(hi);
+    return q;
+}
+
+NN_Q8_Context nn_q8_context_alloc(NN_Q8 q, size_t max_batch) {
+    NN_ASSERT(q.count > 0 && max_batch > 0);
+    NN_Q8_Context ctx;
+    ctx.max_batch = max_batch;
+    ctx.count = q.count;
+    ctx.in = NN_MALLOC(q.count * sizeof(*ctx.in));
+    NN_ASSERT(ctx.in != NULL);
+    size_t width = 0;
+    for (size_t l = 0; l < q.count; l++) {
+        ctx.in[l] = calloc(max_batch * q.layers[l].k_pad, sizeof(**ctx.in));
+        NN_ASSERT(ctx.in[l] != NULL);
+        if (q.layers[l].cols > width) width = q.layers[l].cols;
+    }
+    ctx.acc = NN_MALLOC(max_batch * width * sizeof(*ctx.acc));
+    NN_ASSERT(ctx.acc != NULL);
+    return ctx;
+}
+
+void nn_q8_context_free(NN_Q8_Context* ctx) {
+    NN_ASSERT(ctx != NULL);
+    for (size_t l = 0; l < ctx -> count; l++) free(ctx -> in[l]);
+    free(ctx -> in);
+    free(ctx -> acc);
+    ctx -> in = NULL;
+    ctx -> acc = NULL;
+    ctx -> count = 0;
+    ctx -> max_batch = 0;
+}
+
+// Per layer one batched integer GEMM, then one fused dequantize + bias + sigmoid + requantize
+// into the next layer's input rows
+void nn_q8_infer(NN_Q8 q, NN_Q8_Context* ctx, matrix x, matrix y) {
+    NN_ASSERT(q.count > 0 && ctx -> count == q.count);
+    NN_ASSERT(x.rows > 0 && x.rows <= ctx -> max_batch && x.rows == y.rows);
+    NN_ASSERT(x.cols == q.layers[0].rows && y.cols == q.layers[q.count - 1].cols);
+    const NN_Q8_Layer* first = &q.layers[0];
+    float inv = 1.f / first -> in_scale;
+    for (size_t i = 0; i < x.rows; i++) {
+        uint8_t* in = ctx -> in[0] + i * first -> k_pad;
+        for (size_t k = 0; k < first -> rows; k++) in[k] = nn__q8_clamp(lrintf(MATRIX_AT(x, i, k) * inv) + first -> in_zero);
+    }
+    for (size_t l = 0; l < q.count; l++) {
+        const NN_Q8_Layer* layer = &q.layers[l];
+        const NN_Q8_Layer* next = l + 1 < q.count ? &q.layers[l + 1] : NULL;
+        nn__gemm_u8s8(ctx -> in[l], x.rows, layer -> weights, layer -> cols, layer -> k_pad, ctx -> acc, layer -> cols);
+        for (size_t i = 0; i < x.rows; i++) {
+            const int32_t* acc = ctx -> acc + i * layer -> cols;
+            for (size_t j = 0; j < layer -> cols; j++) {
+                int32_t dot = acc[j] - layer -> in_zero * layer -> weight_sums[j];
+                float a = sigmoidf(layer -> in_scale * layer -> weight_scales[j] * dot + layer -> biases[j]);
+                if (next != NULL) {
+                    ctx -> in[l + 1][i * next -> k_pad + j] = nn__q8_clamp(lrintf(a / next -> in_scale) + next -> in_zero);
+                } else {
+                    MATRIX_AT(y, i, j) = a;
+                }
+            }
+        }
+    }
+}
+
+// Any number of rows, run through nn_q8_infer in tiles of NN_Q8_TILE_ROWS
+void nn_q8_forward(NN_Q8 q, matrix x, matrix y) {
+    NN_ASSERT(x.rows > 0 && x.rows == y.rows);
+    size_t tile = x.rows < NN_Q8_TILE_ROWS ? x.rows : NN_Q8_TILE_ROWS;
+    NN_Q8_Context ctx = nn_q8_context_alloc(q, tile);
+    for (size_t r = 0; r < x.rows; r += tile) {
+        size_t n = x.rows - r < tile ? x.rows - r : tile;
+        nn_q8_infer(q, &ctx,
+                    matrix_data_alloc(&MATRIX_AT(x, r, 0), n, x.cols, x.stride),
+                    matrix_data_alloc(&MATRIX_AT(y, r, 0), n, y.cols, y.stride));
+    }
+    nn_q8_context_free(&ctx);
+}
+
+float nn_q8_cost(NN_Q8 q, matrix ti, matrix to) {
+    NN_ASSERT(ti.rows == to.rows && ti.rows > 0);
+    matrix y = matrix_alloc(ti.rows, to.cols, to.cols);
+    nn_q8_forward(q, ti, y);
+    float result = 0;
+    for (size_t i = 0; i < ti.rows; i++) {
+        for (size_t j = 0; j < to.cols; j++) {
+            float d = MATRIX_AT(y, i, j) - MATRIX_AT(to, i, j);
+            result += d * d;
+        }
+    }
+    matrix_free(&y);
+    return result / ti.rows;
+}
+
+size_t nn_q8_bytes(NN_Q8 q) {
+    size_t bytes = 0;
+    for (size_t l = 0; l < q.count; l++) {
+        NN_Q8_Layer layer = q.layers[l];
+        bytes += layer.rows * layer.cols * sizeof(*layer.weights);
+        bytes += layer.cols * (sizeof(*layer.weight_sums) + sizeof(*layer.weight_scales) + sizeof(*layer.biases));
+        bytes += sizeof(layer.in_scale) + sizeof(layer.in_zero);
+    }
+    return bytes;
+}
+
+void nn_q8_free(NN_Q8* q) {
+    NN_ASSERT(q != NULL);
+    for (size_t l = 0; l < q -> count; l++) {
+        free(q -> layers[l].weights);
+        free(q -> layers[l].weight_sums);
+        free(q -> layers[l].weight_scales);
+        free(q -> layers[l].biases);
+    }
+    free(q -> layers);
+    q -> layers = NULL;
+    q -> count = 0;
+}
+// -----------------------------------
+
+
+// ----- pruning methods definition -----
+size_t nn_prune_threshold(NN nn, float threshold) {
+    nn__sparse_drop(nn);
+    size_t pruned = 0;
+    for (size_t i = 0; i < nn.count; i++) {
+        for (size_t j = 0; j < nn.weights[i].rows; j++) {
+            for (size_t k = 0; k < nn.weights[i].cols; k++) {
+                if (fabsf(MATRIX_AT(nn.weights[i], j, k)) < threshold) {
+                    pruned += MATRIX_AT(nn.weights[i], j, k) != 0;
+                    MATRIX_AT(nn.weights[i], j, k) = 0;
+                }
+            }
+        }
+    }
+    return pruned;
+}
+
+static int nn__compare_desc(const void* a, const void* b) {
+    float x = *(const float*) a;
+    float y = *(const float*) b;
+    return (x < y) - (x > y);
+}
+
+// Keeps the ceil(keep * size) largest magnitude weights of every layer
+size_t nn_prune_top_k(NN nn, float keep) {
+    NN_ASSERT(keep >= 0 && keep <= 1);
+    nn__sparse_drop(nn);
+    size_t pruned = 0;
+    for (size_t i = 0; i < nn.count; i++) {
+        matrix w = nn.weights[i];
+        size_t size = w.rows * w.cols;
+        size_t k = (size_t) ceilf(keep * size);
+        float* mags = NN_MALLOC(size * sizeof(float));
+        NN_ASSERT(mags != NULL);
+        for (size_t r = 0; r < w.rows; r++) {
+            for (size_t c = 0; c < w.cols; c++) {
+                mags[r * w.cols + c] = fabsf(MATRIX_AT(w, r, c));
+            }
+        }
+        qsort(mags, size, sizeof(float), nn__compare_desc);
+        float cut = k > 0 ? mags[k - 1] : INFINITY;
+        size_t above = 0;
+        for (size_t p = 0; p < k && mags[p] > cut; p++) above++;
+        size_t ties = k - above;
+        for (size_t r = 0; r < w.rows; r++) {
+            for (size_t c = 0; c < w.cols; c++) {
+                float m = fabsf(MATRIX_AT(w, r, c));
+                if (m > cut) continue;
+                if (m == cut && ties > 0) {
+                    ties--;
+                    continue;
+                }
+                pruned += MATRIX_AT(w, r, c) != 0;
+                MATRIX_AT(w, r, c) = 0;
+            }
+        }
+        free(mags);
+    }
+    return pruned;
+}
+
+// Call between nn_backprop and nn_learn while fine tuning so pruned weights stay zero
+void nn_prune_mask(NN nn, NN g) {
+    NN_ASSERT(nn.count == g.count);
+    for (size_t i = 0; i < nn.count; i++) {
+        for (size_t j = 0; j < nn.weights[i].rows; j++) {
+            for (size_t k = 0; k < nn.weights[i].cols; k++) {
+                if (MATRIX_AT(nn.weights[i], j, k) == 0) MATRIX_AT(g.weights[i], j, k) = 0;
+            }
+        }
+    }
+}
+
+// Rebuilds the CSR copies for layers at or below max_density; call again after the weights change
+void nn_sparsify(NN* nn, float max_density) {
+    NN_ASSERT(nn != NULL);
+    if (nn -> sparse == NULL) {
+        nn -> sparse = calloc(nn -> count, sizeof(*nn -> sparse));
+        NN_ASSERT(nn -> sparse != NULL);
+    }
+    for (size_t i = 0; i < nn -> count; i++) {
+        matrix_csr_free(&nn -> sparse[i]);
+        if (matrix_density(nn -> weights[i]) <= max_density) {
+            nn -> sparse[i] = matrix_csr_from_dense(nn -> weights[i]);
+        }
+    }
+}
+// --------------------------------------
+
+
+// ----- model file methods definition -----
+static uint32_t nn__crc32_table[256];
+static pthread_once_t nn__crc32_once = PTHREAD_ONCE_INIT;
+
+static void nn__crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        nn__crc32_table[i] = c;
+    }
+}
+
+// Models are loaded from several threads at once, e.g. the registry reload thread and the
+// checkpoint writer, so the table is built exactly once
+static uint32_t nn__crc32(uint32_t crc, const void* data, size_t size) {
+    pthread_once(&nn__crc32_once, nn__crc32_init);
+    const uint8_t* bytes = data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = nn__crc32_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static size_t nn__file_align(size_t offset) {
+    return (offset + NN_FILE_ALIGN - 1) / NN_FILE_ALIGN * NN_FILE_ALIGN;
+}
+
+// Size of header, architecture and layer table, i.e. where the first tensor starts
+static size_t nn__file_prefix_size(size_t count) {
+    return nn__file_align(sizeof(NN_File_Header) + (count + 1) * sizeof(uint64_t) + count * sizeof(NN_File_Layer));
+}
+
+static uint32_t nn__matrix_crc32(matrix m) {
+    uint32_t crc = 0;
+    for (size_t i = 0; i < m.rows; i++) {
+        crc = nn__crc32(crc, &MATRIX_AT(m, i, 0), m.cols * sizeof(*m.elements));
+    }
+    return crc;
+}
+
+static uint32_t nn__file_prefix_crc32(NN_File_Header header, const uint64_t* arch, const NN_File_Layer* layers) {
+    header.checksum = 0;
+    uint32_t crc = nn__crc32(0, &header, sizeof(header));
+    crc = nn__crc32(crc, arch, header.layer_count * sizeof(*arch));
+    return nn__crc32(crc, layers, (header.layer_count - 1) * sizeof(*layers));
+}
+
+// A CSR copy is stored as such when it exists and its offsets fit the file's uint32s
+static bool nn__file_layer_csr(NN nn, size_t i) {
+    return nn.sparse != NULL && nn.sparse[i].row_ptr != NULL && nn.sparse[i].nnz <= UINT32_MAX;
+}
+
+static size_t nn__csr_file_size(size_t rows, size_t nnz) {
+    return sizeof(uint64_t) + (rows + 1) * sizeof(uint32_t) + nnz * (sizeof(uint32_t) + sizeof(float));
+}
+
+static uint32_t nn__csr_crc32(matrix_csr m) {
+    uint64_t nnz = m.nnz;
+    uint32_t crc = nn__crc32(0, &nnz, sizeof(nnz));
+    for (size_t i = 0; i <= m.rows; i++) {
+        uint32_t p = (uint32_t) m.row_ptr[i];
+        crc = nn__crc32(crc, &p, sizeof(p));
+    }
+    crc = nn__crc32(crc, m.col_idx, m.nnz * sizeof(*m.col_idx));
+    return nn__crc32(crc, m.values, m.nnz * sizeof(*m.values));
+}
+
+// Fills header, arch (count + 1) and layers (count) for nn, returns the file size. With csr
+// the layers that have a CSR copy store that instead of their dense weights
+static size_t nn__file_layout(NN nn, bool csr, NN_File_Header* header, uint64_t* arch, NN_File_Layer* layers) {
+    size_t offset = nn__file_prefix_size(nn.count);
+    bool any_csr = false;
+    arch[0] = nn.weights[0].rows;
     for (size_t i = 0; i < nn.count; i++) {
-        for (size_t j = 0; j < nn.weights[i].rows; j++) {
-            for (size_t k = 0; k < nn.weights[i].cols; k++) {
-                MATRIX_AT(nn.weights[i], j, k) -= rate * MATRIX_AT(g.weights[i], j, k);
-            }
+        arch[i + 1] = nn.weights[i].cols;
+        layers[i].activation = NN_ACT_SIGMOID;
+        layers[i].biases_checksum = nn__matrix_crc32(nn.biases[i]);
+        layers[i].weights_offset = offset;
+        if (csr && nn__file_layer_csr(nn, i)) {
+            any_csr = true;
+            layers[i].flags = NN_FILE_LAYER_CSR;
+            layers[i].weights_checksum = nn__csr_crc32(nn.sparse[i]);
+            offset = nn__file_align(offset + nn__csr_file_size(nn.sparse[i].rows, nn.sparse[i].nnz));
+        } else {
+            layers[i].flags = 0;
+            layers[i].weights_checksum = nn__matrix_crc32(nn.weights[i]);
+            offset = nn__file_align(offset + nn.weights[i].rows * nn.weights[i].cols * sizeof(float));
         }
-        for (size_t j = 0; j < nn.biases[i].rows; j++) {
-            for (size_t k = 0; k < nn.biases[i].cols; k++) {
-                MATRIX_AT(nn.biases[i], j, k) -= rate * MATRIX_AT(g.biases[i], j, k);
+        layers[i].biases_offset = offset;
+        offset = nn__file_align(offset + nn.biases[i].cols * sizeof(float));
+    }
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header -> magic, NN_FILE_MAGIC, sizeof(header -> magic));
+    header -> version = any_csr ? NN_FILE_VERSION_CSR : NN_FILE_VERSION;
+    header -> layer_count = nn.count + 1;
+    header -> file_size = offset;
+    header -> checksum = nn__file_prefix_crc32(*header, arch, layers);
+    return offset;
+}
+
+bool nn_save(const char* path, NN nn) {
+    NN_ASSERT(nn.count > 0);
+    uint64_t* arch = NN_MALLOC((nn.count + 1) * sizeof(*arch));
+    NN_File_Layer* layers = calloc(nn.count, sizeof(*layers));
+    NN_ASSERT(arch != NULL && layers != NULL);
+    NN_File_Header header;
+    size_t offset = nn__file_layout(nn, true, &header, arch, layers);
+
+    bool ok = false;
+    FILE* out = fopen(path, "wb");
+    if (out != NULL) {
+        static const char zeros[NN_FILE_ALIGN] = {0};
+        setvbuf(out, NULL, _IOFBF, 1 << 20);
+        fwrite(&header, sizeof(header), 1, out);
+        fwrite(arch, sizeof(*arch), nn.count + 1, out);
+        fwrite(layers, sizeof(*layers), nn.count, out);
+        size_t written = sizeof(header) + (nn.count + 1) * sizeof(*arch) + nn.count * sizeof(*layers);
+        for (size_t i = 0; i < nn.count; i++) {
+            matrix tensors[] = { nn.weights[i], matrix_row(nn.biases[i], 0) };
+            uint64_t offsets[] = { layers[i].weights_offset, layers[i].biases_offset };
+            for (size_t t = 0; t < ARRAY_SIZE(tensors); t++) {
+                fwrite(zeros, 1, offsets[t] - written, out);
+                if (t == 0 && layers[i].flags & NN_FILE_LAYER_CSR) {
+                    matrix_csr m = nn.sparse[i];
+                    uint64_t nnz = m.nnz;
+                    fwrite(&nnz, sizeof(nnz), 1, out);
+                    for (size_t r = 0; r <= m.rows; r++) {
+                        uint32_t p = (uint32_t) m.row_ptr[r];
+                        fwrite(&p, sizeof(p), 1, out);
+                    }
+                    fwrite(m.col_idx, sizeof(*m.col_idx), m.nnz, out);
+                    fwrite(m.values, sizeof(*m.values), m.nnz, out);
+                    written = offsets[t] + nn__csr_file_size(m.rows, m.nnz);
+                    continue;
+                }
+                for (size_t r = 0; r < tensors[t].rows; r++) {
+                    fwrite(&MATRIX_AT(tensors[t], r, 0), sizeof(float), tensors[t].cols, out);
+                }
+                written = offsets[t] + tensors[t].rows * tensors[t].cols * sizeof(float);
             }
         }
+        fwrite(zeros, 1, offset - written, out);
+        ok = !ferror(out);
+        ok = fclose(out) == 0 && ok;
     }
+
+    free(arch);
+    free(layers);
+    return ok;
 }
 
-void nn_zero(NN* nn) {
-    for (size_t i = 0; i < nn -> count; ++i) {
-        matrix_fill(nn -> weights[i], 0);
-        matrix_fill(nn -> biases[i], 0);
-        matrix_fill(nn -> inputs[i], 0);
+// A tensor starts aligned past the prefix and ends within the file
+static bool nn__file_range_ok(uint64_t offset, uint64_t size, uint64_t prefix_size, uint64_t file_size) {
+    return offset % NN_FILE_ALIGN == 0 && offset >= prefix_size && size <= file_size && offset <= file_size - size;
+}
+
+// Validates magic, version, the prefix checksum and every layer's shape and tensor ranges;
+// arch and layers point into prefix
+static bool nn__file_parse_prefix(const void* prefix, size_t size, NN_File_Header* header,
+                                  const uint64_t** arch, const NN_File_Layer** layers) {
+    if (size < sizeof(*header)) return false;
+    memcpy(header, prefix, sizeof(*header));
+    if (memcmp(header -> magic, NN_FILE_MAGIC, sizeof(header -> magic)) != 0) return false;
+    if (header -> version != NN_FILE_VERSION && header -> version != NN_FILE_VERSION_CSR) return false;
+    if (header -> layer_count < 2) return false;
+    uint64_t prefix_size = nn__file_prefix_size(header -> layer_count - 1);
+    if (size < prefix_size) return false;
+    *arch = (const uint64_t*) ((const char*) prefix + sizeof(*header));
+    *layers = (const NN_File_Layer*) (*arch + header -> layer_count);
+    if (nn__file_prefix_crc32(*header, *arch, *layers) != header -> checksum) return false;
+    uint64_t expanded = 0;
+    for (size_t i = 0; i + 1 < header -> layer_count; i++) {
+        const NN_File_Layer* layer = &(*layers)[i];
+        if (layer -> activation != NN_ACT_SIGMOID) return false;
+        uint32_t allowed = header -> version == NN_FILE_VERSION_CSR ? NN_FILE_LAYER_CSR : 0;
+        if (layer -> flags & ~allowed) return false;
+        uint64_t rows = (*arch)[i];
+        uint64_t cols = (*arch)[i + 1];
+        if (rows == 0 || cols == 0 || cols > UINT64_MAX / sizeof(float) / rows) return false;
+        uint64_t wsize = rows * cols * sizeof(float);
+        if (layer -> flags & NN_FILE_LAYER_CSR) {
+            // A CSR image is at least its nnz and row offsets, nn_load checks the rest once it has read nnz.
+            // Its dense size is not backed by the file, so a tiny file could ask for any allocation
+            if (rows >= header -> file_size / sizeof(uint32_t)) return false;
+            if (wsize > NN_FILE_MAX_EXPANDED - expanded) return false;
+            expanded += wsize;
+            wsize = nn__csr_file_size(rows, 0);
+        }
+        if (!nn__file_range_ok(layer -> weights_offset, wsize, prefix_size, header -> file_size)) return false;
+        if (!nn__file_range_ok(layer -> biases_offset, cols * sizeof(float), prefix_size, header -> file_size)) return false;
     }
-    matrix_fill(nn -> inputs[nn -> count], 0);
+    return true;
 }
 
-void nn_backprop(NN nn, NN* g, matrix ti, matrix to) {
-    NN_ASSERT(ti.rows == to.rows);
-    size_t n = ti.rows;
-    NN_ASSERT(NN_OUTPUT(nn).cols == to.cols);
-    NN_ASSERT(g != NULL);
-    NN_ASSERT(g->inputs != NULL && g->weights != NULL && g->biases != NULL);
+// Reads a CSR image of at most limit bytes into csr and expands it into the dense w. Rejects
+// images whose checksum, offsets or columns do not hold up, columns must ascend within a row
+static bool nn__csr_read(FILE* in, matrix w, uint64_t limit, uint32_t checksum, matrix_csr* csr) {
+    uint64_t nnz;
+    if (fread(&nnz, sizeof(nnz), 1, in) != 1) return false;
+    if (nnz > (uint64_t) w.rows * w.cols || nn__csr_file_size(w.rows, nnz) > limit) return false;
+    uint32_t* row_ptr = NN_MALLOC((w.rows + 1) * sizeof(*row_ptr));
+    *csr = (matrix_csr) {
+        .rows = w.rows,
+        .cols = w.cols,
+        .nnz = nnz,
+        .row_ptr = NN_MALLOC((w.rows + 1) * sizeof(*csr -> row_ptr)),
+        .col_idx = NN_MALLOC((nnz > 0 ? nnz : 1) * sizeof(*csr -> col_idx)),
+        .values = NN_MALLOC((nnz > 0 ? nnz : 1) * sizeof(*csr -> values)),
+    };
+    NN_ASSERT(row_ptr != NULL && csr -> row_ptr != NULL && csr -> col_idx != NULL && csr -> values != NULL);
+    bool ok = fread(row_ptr, sizeof(*row_ptr), w.rows + 1, in) == w.rows + 1
+           && fread(csr -> col_idx, sizeof(*csr -> col_idx), nnz, in) == nnz
+           && fread(csr -> values, sizeof(*csr -> values), nnz, in) == nnz
+           && row_ptr[0] == 0 && row_ptr[w.rows] == nnz;
+    if (ok) {
+        uint32_t crc = nn__crc32(0, &nnz, sizeof(nnz));
+        crc = nn__crc32(crc, row_ptr, (w.rows + 1) * sizeof(*row_ptr));
+        crc = nn__crc32(crc, csr -> col_idx, nnz * sizeof(*csr -> col_idx));
+        ok = nn__crc32(crc, csr -> values, nnz * sizeof(*csr -> values)) == checksum;
+    }
+    // Every offset is checked before any of them indexes col_idx, the checksum alone proves nothing
+    // about a file anyone can rewrite
+    for (size_t r = 0; ok && r < w.rows; r++) ok = row_ptr[r] <= row_ptr[r + 1] && row_ptr[r + 1] <= nnz;
+    matrix_fill(w, 0);
+    for (size_t r = 0; ok && r < w.rows; r++) {
+        for (size_t p = row_ptr[r]; ok && p < row_ptr[r + 1]; p++) {
+            ok = csr -> col_idx[p] < w.cols && (p == row_ptr[r] || csr -> col_idx[p] > csr -> col_idx[p - 1]);
+            if (ok) MATRIX_AT(w, r, csr -> col_idx[p]) = csr -> values[p];
+        }
+    }
+    for (size_t r = 0; r <= w.rows; r++) csr -> row_ptr[r] = row_ptr[r];
+    free(row_ptr);
+    if (!ok) matrix_csr_free(csr);
+    return ok;
+}
+
+// Reads through a buffered stream and verifies every tensor checksum. CSR layers are expanded
+// into the dense weights and also kept as the NN's CSR copies.
+// On failure the returned NN has count 0.
+NN nn_load(const char* path) {
+    NN nn = {0};
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) return nn;
+    setvbuf(in, NULL, _IOFBF, 1 << 20);
+
+    NN_File_Header header;
+    const uint64_t* arch;
+    const NN_File_Layer* layers;
+    char* prefix = NULL;
+    struct stat st;
+    // The header must describe this very file, so nothing it claims can size an allocation
+    // past what the file holds
+    bool sized = fstat(fileno(in), &st) == 0 && fread(&header, sizeof(header), 1, in) == 1
+              && header.file_size == (uint64_t) st.st_size;
+    if (sized && header.layer_count >= 2 && header.layer_count < (1u << 20)
+        && nn__file_prefix_size(header.layer_count - 1) <= header.file_size) {
+        size_t prefix_size = nn__file_prefix_size(header.layer_count - 1);
+        prefix = NN_MALLOC(prefix_size);
+        NN_ASSERT(prefix != NULL);
+        memcpy(prefix, &header, sizeof(header));
+        bool ok = fread(prefix + sizeof(header), prefix_size - sizeof(header), 1, in) == 1;
+        if (ok && nn__file_parse_prefix(prefix, prefix_size, &header, &arch, &layers)) {
+            size_t* sizes = NN_MALLOC(header.layer_count * sizeof(*sizes));
+            NN_ASSERT(sizes != NULL);
+            for (size_t i = 0; i < header.layer_count; i++) sizes[i] = arch[i];
+            nn = nn_alloc(sizes, header.layer_count);
+            free(sizes);
+            for (size_t i = 0; ok && i < nn.count; i++) {
+                matrix w = nn.weights[i];
+                matrix b = nn.biases[i];
+                if (layers[i].flags & NN_FILE_LAYER_CSR) {
+                    if (nn.sparse == NULL) {
+                        nn.sparse = calloc(nn.count, sizeof(*nn.sparse));
+                        NN_ASSERT(nn.sparse != NULL);
+                    }
+                    ok = fseek(in, layers[i].weights_offset, SEEK_SET) == 0
+                      && nn__csr_read(in, w, header.file_size - layers[i].weights_offset,
+                                      layers[i].weights_checksum, &nn.sparse[i]);
+                } else {
+                    ok = fseek(in, layers[i].weights_offset, SEEK_SET) == 0
+                      && fread(w.elements, sizeof(float), w.rows * w.cols, in) == w.rows * w.cols
+                      && nn__matrix_crc32(w) == layers[i].weights_checksum;
+                }
+                ok = ok
+                  && fseek(in, layers[i].biases_offset, SEEK_SET) == 0
+                  && fread(b.elements, sizeof(float), b.cols, in) == b.cols
+                  && nn__matrix_crc32(b) == layers[i].biases_checksum;
+            }
+            if (!ok) nn_free(&nn);
+        }
+    }
+    free(prefix);
+    fclose(in);
+    return nn;
+}
+
+// An NN whose weights and biases point into a complete file image at base, only the
+// activations are allocated. Count 0 when the image does not validate
+static NN nn__file_view(void* base, size_t size) {
+    NN nn = {0};
+    NN_File_Header header;
+    const uint64_t* arch;
+    const NN_File_Layer* layers;
+    if (!nn__file_parse_prefix(base, size, &header, &arch, &layers) || header.file_size != size) return nn;
+    // CSR weights cannot be used in place, such files go through nn_load
+    for (size_t i = 0; i + 1 < header.layer_count; i++) {
+        if (layers[i].flags != 0) return nn;
+    }
+
+    nn.count = header.layer_count - 1;
+    nn.inputs = NN_MALLOC(header.layer_count * sizeof(matrix));
+    nn.weights = NN_MALLOC(nn.count * sizeof(matrix));
+    nn.biases = NN_MALLOC(nn.count * sizeof(matrix));
     NN_ASSERT(nn.inputs != NULL && nn.weights != NULL && nn.biases != NULL);
-    NN_ASSERT(n > 0);
-    nn_zero(g);
-    for (size_t i = 0; i < n; ++i) {
-        matrix x = matrix_row(ti, i);
-        matrix y = matrix_row(to, i);
-        matrix_copy(NN_INPUT(nn), x);
-        nn_forward(nn);
+    nn.sparse = NULL;
+    nn.mapping = base;
+    nn.mapping_size = size;
+    nn.inputs[0] = matrix_alloc(1, arch[0], arch[0]);
+    for (size_t i = 0; i < nn.count; i++) {
+        nn.inputs[i + 1] = matrix_alloc(1, arch[i + 1], arch[i + 1]);
+        nn.weights[i] = matrix_data_alloc((float*) ((char*) base + layers[i].weights_offset), arch[i], arch[i + 1], arch[i + 1]);
+        nn.biases[i] = matrix_data_alloc((float*) ((char*) base + layers[i].biases_offset), 1, arch[i + 1], arch[i + 1]);
+    }
+    return nn;
+}
+
+// Weights and biases point into a private mapping of the file, so opening
+// costs the same for any model size and untouched pages stay shared with
+// the page cache. Only the header checksum is verified; nn_load checks the
+// tensors. Release with nn_unmap. On failure the returned NN has count 0.
+NN nn_map(const char* path) {
+    NN nn = {0};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return nn;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(NN_File_Header)) {
+        close(fd);
+        return nn;
+    }
+    size_t size = st.st_size;
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return nn;
+    nn = nn__file_view(base, size);
+    if (nn.count == 0) munmap(base, size);
+    return nn;
+}
+
+void nn_unmap(NN* nn) {
+    NN_ASSERT(nn != NULL && nn -> count > 0 && nn -> mapping != NULL);
+    for (size_t i = 0; i <= nn -> count; i++) matrix_free(&nn -> inputs[i]);
+    if (nn -> sparse != NULL) {
+        for (size_t i = 0; i < nn -> count; i++) matrix_csr_free(&nn -> sparse[i]);
+        free(nn -> sparse);
+    }
+    free(nn -> inputs);
+    free(nn -> weights);
+    free(nn -> biases);
+    munmap(nn -> mapping, nn -> mapping_size);
+    *nn = (NN) {0};
+}
+
+// POSIX shared memory names start with a slash, callers may leave it out
+static void nn__shm_name(char* buffer, size_t size, const char* name) {
+    snprintf(buffer, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
 
-        for (size_t j = 0; j <= nn.count; j++) {
-            NN_ASSERT(g->inputs[j].elements != NULL);
-            matrix_fill(g->inputs[j], 0);
-        }
-
-        for (size_t j = 0; j < to.cols; ++j) {
-            NN_ASSERT(j < NN_OUTPUT(*g).cols && j < NN_OUTPUT(nn).cols && j < y.cols);
-            MATRIX_AT(NN_OUTPUT(*g), 0, j) = MATRIX_AT(NN_OUTPUT(nn), 0, j) - MATRIX_AT(y, 0, j);
-        }
-
-        for (size_t l = nn.count; l > 0; --l) {
-            NN_ASSERT(l < nn.count + 1);
-            for (size_t j = 0; j < nn.inputs[l].cols; j++) {
-                float a = MATRIX_AT(nn.inputs[l], 0, j);
-                float da = MATRIX_AT(g->inputs[l], 0, j);
-                NN_ASSERT(j < g->biases[l - 1].cols);
-                MATRIX_AT(g->biases[l - 1], 0, j) += 2 * da * a * (1 - a);
-                for (size_t k = 0; k < nn.inputs[l - 1].cols; k++) {
-                    float pa = MATRIX_AT(nn.inputs[l - 1], 0, k);
-                    float w = MATRIX_AT(nn.weights[l - 1], k, j);
-                    NN_ASSERT(k < g->weights[l - 1].rows && j < g->weights[l - 1].cols);
-                    MATRIX_AT(g->weights[l - 1], k, j) += 2 * da * a * (1 - a) * pa;
-                    NN_ASSERT(k < g->inputs[l - 1].cols);
-                    MATRIX_AT(g->inputs[l - 1], 0, k) += 2 * da * a * (1 - a) * w;
+// Writes the nn_save file image of nn into a new segment. Processes attached to a previous
+// segment of that name keep it until they unmap, new attachers see the new one. The magic
+// goes in last and the modification time is bumped after it. The bump may fall in the same
+// timestamp tick as ftruncate, so nn_registry_changed also retries a segment it caught early
+bool nn_shm_publish(const char* name, NN nn) {
+    NN_ASSERT(nn.count > 0);
+    char shm_name[256];
+    nn__shm_name(shm_name, sizeof(shm_name), name);
+    uint64_t* arch = NN_MALLOC((nn.count + 1) * sizeof(*arch));
+    NN_File_Layer* layers = calloc(nn.count, sizeof(*layers));
+    NN_ASSERT(arch != NULL && layers != NULL);
+    NN_File_Header header;
+    size_t size = nn__file_layout(nn, false, &header, arch, layers);
+
+    bool ok = false;
+    shm_unlink(shm_name);
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0 && ftruncate(fd, size) == 0) {
+        char* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base != MAP_FAILED) {
+            char* at = base + sizeof(header);
+            memcpy(at, arch, (nn.count + 1) * sizeof(*arch));
+            at += (nn.count + 1) * sizeof(*arch);
+            memcpy(at, layers, nn.count * sizeof(*layers));
+            for (size_t i = 0; i < nn.count; i++) {
+                float* w = (float*) (base + layers[i].weights_offset);
+                for (size_t r = 0; r < nn.weights[i].rows; r++) {
+                    memcpy(w + r * nn.weights[i].cols, &MATRIX_AT(nn.weights[i], r, 0), nn.weights[i].cols * sizeof(float));
                 }
+                memcpy(base + layers[i].biases_offset, &MATRIX_AT(nn.biases[i], 0, 0), nn.biases[i].cols * sizeof(float));
             }
+            memcpy(base + sizeof(header.magic), (char*) &header + sizeof(header.magic), sizeof(header) - sizeof(header.magic));
+            atomic_thread_fence(memory_order_release);
+            memcpy(base, header.magic, sizeof(header.magic));
+            munmap(base, size);
+            ok = futimens(fd, NULL) == 0;
         }
     }
+    if (fd >= 0) close(fd);
+    if (!ok) shm_unlink(shm_name);
+    free(arch);
+    free(layers);
+    return ok;
+}
 
-    for (size_t i = 0; i < g->count; i++) {
-        for (size_t j = 0; j < g->weights[i].rows; j++) {
-            for (size_t k = 0; k < g->weights[i].cols; k++) {
-                MATRIX_AT(g->weights[i], j, k) /= n;
+// incomplete is set when the segment exists but nn_shm_publish has not written its magic yet
+static NN nn__shm_attach(const char* name, bool* incomplete) {
+    NN nn = {0};
+    *incomplete = false;
+    char shm_name[256];
+    nn__shm_name(shm_name, sizeof(shm_name), name);
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0) return nn;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(NN_File_Header)) {
+        close(fd);
+        return nn;
+    }
+    size_t size = st.st_size;
+    void* base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return nn;
+    // The magic is written last, once it is there the rest of the image is too
+    bool complete = memcmp(base, NN_FILE_MAGIC, sizeof(NN_FILE_MAGIC) - 1) == 0;
+    atomic_thread_fence(memory_order_acquire);
+    *incomplete = !complete;
+    if (complete) nn = nn__file_view(base, size);
+    if (nn.count == 0) munmap(base, size);
+    return nn;
+}
+
+// Maps a published segment read only, weights are shared by every attached process and
+// only the activations are private. Release with nn_unmap. Count 0 when missing or incomplete
+NN nn_shm_attach(const char* name) {
+    bool incomplete;
+    return nn__shm_attach(name, &incomplete);
+}
+
+bool nn_shm_unlink(const char* name) {
+    char shm_name[256];
+    nn__shm_name(shm_name, sizeof(shm_name), name);
+    return shm_unlink(shm_name) == 0;
+}
+// -----------------------------------------
+
+
+// ----- checkpoint methods definition -----
+NN_Checkpoint nn_checkpoint_alloc(const char* path) {
+    NN_Checkpoint c = {0};
+    c.path = strdup(path);
+    NN_ASSERT(c.path != NULL);
+    atomic_init(&c.busy, false);
+    c.last_ok = true;
+    return c;
+}
+
+static bool nn__write_all(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Writes the snapshot next to the checkpoint, flushes it to disk and renames it over the old one,
+// so a crash at any point leaves either the previous or the new checkpoint intact
+static void* nn__checkpoint_write(void* arg) {
+    NN_Checkpoint* c = arg;
+    size_t tmp_len = strlen(c -> path) + sizeof(".tmp");
+    char* tmp = NN_MALLOC(tmp_len);
+    NN_ASSERT(tmp != NULL);
+    snprintf(tmp, tmp_len, "%s.tmp", c -> path);
+
+    // Checksummed here rather than in nn_checkpoint_save, the cost history keeps growing
+    uint32_t crc = nn__crc32(0, c -> buffer, c -> size);
+    memcpy(c -> buffer + c -> size, &crc, sizeof(crc));
+    c -> size += sizeof(crc);
+
+    const uint8_t* data = c -> buffer;
+    size_t size = c -> size;
+    if (c -> compress) {
+        if (c -> packed_capacity < nn_compress_bound(size)) {
+            c -> packed_capacity = nn_compress_bound(size);
+            c -> packed = realloc(c -> packed, c -> packed_capacity);
+            NN_ASSERT(c -> packed != NULL);
+        }
+        size = nn_compress(c -> packed, c -> packed_capacity, data, size, sizeof(float), 1);
+        data = c -> packed;
+    }
+
+    bool ok = false;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        ok = nn__write_all(fd, data, size) && fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        ok = ok && rename(tmp, c -> path) == 0;
+        if (!ok) unlink(tmp);
+    }
+    if (ok) {
+        // the rename itself only survives a crash once the directory is flushed
+        char* dir = strdup(c -> path);
+        NN_ASSERT(dir != NULL);
+        char* slash = strrchr(dir, '/');
+        if (slash == NULL) {
+            strcpy(dir, ".");
+        } else {
+            slash[slash == dir] = '\0';
+        }
+        int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(dir);
+    }
+    free(tmp);
+
+    c -> last_ok = ok;
+    c -> written += ok;
+    atomic_store_explicit(&c -> busy, false, memory_order_release);
+    return NULL;
+}
+
+static uint8_t* nn__put(uint8_t* out, const void* data, size_t size) {
+    memcpy(out, data, size);
+    return out + size;
+}
+
+// Only copies the state into the spare buffer and hands it to the writer thread, which checksums,
+// compresses when asked and writes it. When the previous write is still running the snapshot
+// is skipped rather than stalling training
+bool nn_checkpoint_save(NN_Checkpoint* c, NN nn, const NN_LBFGS* opt, NN_Train_State state) {
+    NN_ASSERT(c != NULL && c -> path != NULL);
+    if (atomic_load_explicit(&c -> busy, memory_order_acquire)) {
+        c -> skipped += 1;
+        return false;
+    }
+    if (c -> launched) {
+        pthread_join(c -> writer, NULL);
+        c -> launched = false;
+    }
+
+    size_t n = nn_param_count(nn);
+    size_t history = opt != NULL ? opt -> history : 0;
+    NN_ASSERT(opt == NULL || opt -> n == n);
+    size_t size = sizeof(NN_Checkpoint_Header) + (nn.count + 1) * sizeof(uint64_t) + n * sizeof(float);
+    size += (2 * n + 2 * history * n + history) * sizeof(float);
+    size += state.cost_count * sizeof(float) + sizeof(uint32_t);
+    if (size > c -> capacity) {
+        c -> capacity = size + size / 2;
+        c -> buffer = realloc(c -> buffer, c -> capacity);
+        NN_ASSERT(c -> buffer != NULL);
+    }
+
+    NN_Checkpoint_Header header = {
+        .version = NN_CKPT_VERSION,
+        .flags = state.flags,
+        .epoch = state.epoch,
+        .rng_state = nn_rng_state,
+        .rate = state.rate,
+        .layer_count = nn.count,
+        .param_count = n,
+        .cost_count = state.cost_count,
+        .opt_history = history,
+    };
+    memcpy(header.magic, NN_CKPT_MAGIC, sizeof(header.magic));
+    if (opt != NULL) {
+        header.opt_count = opt -> count;
+        header.opt_head = opt -> head;
+        header.opt_ready = opt -> ready;
+        header.opt_cost = opt -> cost;
+    }
+
+    uint8_t* out = nn__put(c -> buffer, &header, sizeof(header));
+    uint64_t layer_size = nn.weights[0].rows;
+    out = nn__put(out, &layer_size, sizeof(layer_size));
+    for (size_t i = 0; i < nn.count; i++) {
+        layer_size = nn.weights[i].cols;
+        out = nn__put(out, &layer_size, sizeof(layer_size));
+    }
+    nn_params_get(nn, (float*) out);
+    out += n * sizeof(float);
+    if (opt != NULL) {
+        out = nn__put(out, opt -> x, n * sizeof(float));
+        out = nn__put(out, opt -> g, n * sizeof(float));
+        out = nn__put(out, opt -> s, history * n * sizeof(float));
+        out = nn__put(out, opt -> y, history * n * sizeof(float));
+        out = nn__put(out, opt -> rho, history * sizeof(float));
+    }
+    if (state.cost_count > 0) out = nn__put(out, state.costs, state.cost_count * sizeof(float));
+    // room for the CRC32 was reserved above, the writer thread computes and appends it
+    c -> size = out - c -> buffer;
+
+    atomic_store_explicit(&c -> busy, true, memory_order_relaxed);
+    if (pthread_create(&c -> writer, NULL, nn__checkpoint_write, c) == 0) {
+        c -> launched = true;
+    } else {
+        nn__checkpoint_write(c);
+    }
+    return true;
+}
+
+// Blocks until the last started write is on disk and reports whether it succeeded
+bool nn_checkpoint_wait(NN_Checkpoint* c) {
+    NN_ASSERT(c != NULL);
+    if (c -> launched) {
+        pthread_join(c -> writer, NULL);
+        c -> launched = false;
+    }
+    return c -> last_ok;
+}
+
+void nn_checkpoint_free(NN_Checkpoint* c) {
+    NN_ASSERT(c != NULL);
+    nn_checkpoint_wait(c);
+    free(c -> path);
+    free(c -> buffer);
+    free(c -> packed);
+    *c = (NN_Checkpoint) {0};
+}
+
+// Restores the parameters, the L-BFGS state (when opt is not NULL), the RNG and state, from plain or compressed files.
+// state -> costs is allocated with malloc and owned by the caller. Returns false and leaves
+// everything untouched when the file is missing, corrupt or made for another architecture
+bool nn_checkpoint_load(const char* path, NN nn, NN_LBFGS* opt, NN_Train_State* state) {
+    NN_ASSERT(state != NULL);
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) return false;
+    uint8_t* data = NULL;
+    long size = -1;
+    if (fseek(in, 0, SEEK_END) == 0) size = ftell(in);
+    if (size >= (long) (sizeof(NN_Checkpoint_Header) + sizeof(uint32_t)) && fseek(in, 0, SEEK_SET) == 0) {
+        data = NN_MALLOC(size);
+        NN_ASSERT(data != NULL);
+        if (fread(data, 1, size, in) != (size_t) size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(in);
+    if (data == NULL) return false;
+
+    size_t raw_size = nn_decompressed_size(data, size);
+    if (raw_size > 0) {
+        uint8_t* raw = NN_MALLOC(raw_size);
+        NN_ASSERT(raw != NULL);
+        bool unpacked = nn_decompress(raw, raw_size, data, size, 0);
+        free(data);
+        if (!unpacked || raw_size < sizeof(NN_Checkpoint_Header) + sizeof(uint32_t)) {
+            free(raw);
+            return false;
+        }
+        data = raw;
+        size = (long) raw_size;
+    }
+
+    NN_Checkpoint_Header header;
+    memcpy(&header, data, sizeof(header));
+    size_t n = nn_param_count(nn);
+    uint32_t crc;
+    memcpy(&crc, data + size - sizeof(crc), sizeof(crc));
+    bool ok = memcmp(header.magic, NN_CKPT_MAGIC, sizeof(header.magic)) == 0;
+    ok = ok && header.version == NN_CKPT_VERSION && header.layer_count == nn.count && header.param_count == n;
+    ok = ok && header.cost_count < (uint64_t) size && header.opt_history < (uint64_t) size;
+    // The ring indices are used as is by nn_lbfgs_step, they have to lie within the stored history
+    ok = ok && (header.opt_history == 0 || (header.opt_count <= header.opt_history && header.opt_head < header.opt_history));
+    size_t history = ok ? header.opt_history : 0;
+    size_t expected = sizeof(header) + (nn.count + 1) * sizeof(uint64_t) + n * sizeof(float);
+    if (history > 0) expected += (2 * n + 2 * history * n + history) * sizeof(float);
+    expected += (ok ? header.cost_count : 0) * sizeof(float) + sizeof(uint32_t);
+    ok = ok && expected == (size_t) size && nn__crc32(0, data, size - sizeof(crc)) == crc;
+
+    const uint8_t* at = data + sizeof(header);
+    for (size_t i = 0; ok && i <= nn.count; i++) {
+        uint64_t layer_size;
+        memcpy(&layer_size, at + i * sizeof(layer_size), sizeof(layer_size));
+        ok = layer_size == (i == 0 ? nn.weights[0].rows : nn.weights[i - 1].cols);
+    }
+    if (!ok) {
+        free(data);
+        return false;
+    }
+    at += (nn.count + 1) * sizeof(uint64_t);
+
+    float* params = NN_MALLOC(n * sizeof(float));
+    NN_ASSERT(params != NULL);
+    memcpy(params, at, n * sizeof(float));
+    nn_params_set(nn, params);
+    free(params);
+    at += n * sizeof(float);
+
+    if (opt != NULL) nn_lbfgs_reset(opt);
+    if (history > 0 && opt != NULL && opt -> n == n && opt -> history == history) {
+        memcpy(opt -> x, at, n * sizeof(float));
+        memcpy(opt -> g, at + n * sizeof(float), n * sizeof(float));
+        memcpy(opt -> s, at + 2 * n * sizeof(float), history * n * sizeof(float));
+        memcpy(opt -> y, at + (2 + history) * n * sizeof(float), history * n * sizeof(float));
+        memcpy(opt -> rho, at + (2 + 2 * history) * n * sizeof(float), history * sizeof(float));
+        opt -> count = header.opt_count;
+        opt -> head = header.opt_head;
+        opt -> ready = header.opt_ready;
+        opt -> cost = header.opt_cost;
+    }
+    if (history > 0) at += (2 * n + 2 * history * n + history) * sizeof(float);
+
+    state -> epoch = header.epoch;
+    state -> rate = header.rate;
+    state -> flags = header.flags;
+    state -> cost_count = header.cost_count;
+    state -> costs = NULL;
+    if (header.cost_count > 0) {
+        state -> costs = NN_MALLOC(header.cost_count * sizeof(float));
+        NN_ASSERT(state -> costs != NULL);
+        memcpy(state -> costs, at, header.cost_count * sizeof(float));
+    }
+    nn_rng_state = header.rng_state;
+    free(data);
+    return true;
+}
+// ------------------------------------------
+
+
+// ----- inference methods definition -----
+NN_Model nn_model(NN nn) {
+    NN_ASSERT(nn.count > 0 && nn.weights != NULL && nn.biases != NULL);
+    NN_Model model;
+    model.count = nn.count;
+    model.weights = nn.weights;
+    model.biases = nn.biases;
+    model.sparse = nn.sparse;
+    model.width = 0;
+    for (size_t l = 0; l + 1 < nn.count; l++) {
+        if (nn.weights[l].cols > model.width) model.width = nn.weights[l].cols;
+    }
+    return model;
+}
+
+NN_Context nn_context_alloc(NN_Model model, size_t max_batch) {
+    NN_ASSERT(max_batch > 0);
+    NN_Context ctx;
+    ctx.max_batch = max_batch;
+    ctx.width = model.width;
+    ctx.buffers[0] = NULL;
+    ctx.buffers[1] = NULL;
+    if (model.width > 0) {
+        for (size_t b = 0; b < 2; b++) {
+            ctx.buffers[b] = NN_MALLOC(max_batch * model.width * sizeof(float));
+            NN_ASSERT(ctx.buffers[b] != NULL);
+        }
+    }
+    return ctx;
+}
+
+void nn_context_free(NN_Context* ctx) {
+    free(ctx -> buffers[0]);
+    free(ctx -> buffers[1]);
+    ctx -> buffers[0] = NULL;
+    ctx -> buffers[1] = NULL;
+    ctx -> max_batch = 0;
+}
+
+// out = sigmoid(in * w + b). CSR layers take the whole tile through matrix_csr_multiplication,
+// dense ones go in blocks of rows. Every output still sums its products in ascending k
+// starting from zero, so each row matches nn_forward bit for bit
+static void nn__infer_layer(matrix out, matrix in, matrix w, const matrix_csr* csr, matrix b) {
+    if (csr != NULL) {
+        matrix_csr_multiplication(out, in, *csr);
+        for (size_t r = 0; r < out.rows; r++) {
+            float* o = &MATRIX_AT(out, r, 0);
+            for (size_t j = 0; j < out.cols; j++) o[j] = sigmoidf(o[j] + MATRIX_AT(b, 0, j));
+        }
+        return;
+    }
+    for (size_t r0 = 0; r0 < in.rows; r0 += NN_INFER_ROW_BLOCK) {
+        size_t n = in.rows - r0 < NN_INFER_ROW_BLOCK ? in.rows - r0 : NN_INFER_ROW_BLOCK;
+        for (size_t r = r0; r < r0 + n; r++) {
+            float* o = &MATRIX_AT(out, r, 0);
+            for (size_t j = 0; j < out.cols; j++) o[j] = 0;
+        }
+        for (size_t k = 0; k < in.cols; k++) {
+            const float* wk = &MATRIX_AT(w, k, 0);
+            for (size_t r = r0; r < r0 + n; r++) {
+                float a = MATRIX_AT(in, r, k);
+                float* o = &MATRIX_AT(out, r, 0);
+                for (size_t j = 0; j < out.cols; j++) o[j] = NN_MADD(a, wk[j], o[j]);
             }
         }
-        for (size_t j = 0; j < g->biases[i].rows; j++) {
-            for (size_t k = 0; k < g->biases[i].cols; k++) {
-                MATRIX_AT(g->biases[i], j, k) /= n;
+        for (size_t r = r0; r < r0 + n; r++) {
+            float* o = &MATRIX_AT(out, r, 0);
+            for (size_t j = 0; j < out.cols; j++) o[j] = sigmoidf(o[j] + MATRIX_AT(b, 0, j));
+        }
+    }
+}
+
+void nn_infer(NN_Model model, NN_Context* ctx, matrix x, matrix y) {
+    NN_ASSERT(x.elements != NULL && y.elements != NULL);
+    NN_ASSERT(x.rows > 0 && x.rows <= ctx -> max_batch && x.rows == y.rows);
+    NN_ASSERT(ctx -> width >= model.width);
+    NN_ASSERT(x.cols == model.weights[0].rows);
+    NN_ASSERT(y.cols == model.weights[model.count - 1].cols);
+    matrix in = x;
+    for (size_t l = 0; l < model.count; l++) {
+        matrix w = model.weights[l];
+        matrix out = y;
+        if (l + 1 < model.count) {
+            out = matrix_data_alloc(ctx -> buffers[l % 2], x.rows, w.cols, w.cols);
+        }
+        const matrix_csr* csr = NULL;
+        if (model.sparse != NULL && model.sparse[l].row_ptr != NULL) csr = &model.sparse[l];
+        nn__infer_layer(out, in, w, csr, model.biases[l]);
+        in = out;
+    }
+}
+
+// Any number of rows, run through nn_infer in tiles whose activations stay in cache
+void nn_predict(NN_Model model, matrix x, matrix y) {
+    NN_ASSERT(x.rows > 0 && x.rows == y.rows);
+    size_t width = model.width > 0 ? model.width : 1;
+    size_t tile = NN_PREDICT_TILE_BYTES / (2 * width * sizeof(float));
+    tile = tile / NN_INFER_ROW_BLOCK * NN_INFER_ROW_BLOCK;
+    if (tile < NN_INFER_ROW_BLOCK) tile = NN_INFER_ROW_BLOCK;
+    if (tile > x.rows) tile = x.rows;
+    NN_Context ctx = nn_context_alloc(model, tile);
+    for (size_t r = 0; r < x.rows; r += tile) {
+        size_t n = x.rows - r < tile ? x.rows - r : tile;
+        nn_infer(model, &ctx,
+                 matrix_data_alloc(&MATRIX_AT(x, r, 0), n, x.cols, x.stride),
+                 matrix_data_alloc(&MATRIX_AT(y, r, 0), n, y.cols, y.stride));
+    }
+    nn_context_free(&ctx);
+}
+// -----------------------------------------
+
+
+// ----- truth table methods definition -----
+typedef struct {
+    NN_Model model;
+    const Dataset_Gen* gen;
+    NN_LUT* lut;
+    uint64_t block_count;
+    double* block_costs;        // summed in block order afterwards, the same for any thread count
+    _Atomic uint64_t next;
+    _Atomic uint64_t wrong_rows;
+    _Atomic uint64_t wrong_bits;
+} NN__LUT_Job;
+
+static void* nn__lut_worker(void* arg) {
+    NN__LUT_Job* job = arg;
+    NN_LUT* lut = job -> lut;
+    size_t in_cols = lut -> in_cols;
+    size_t out_cols = lut -> out_cols;
+    float* x = NN_MALLOC(NN_LUT_BLOCK * in_cols * sizeof(float));
+    float* y = NN_MALLOC(NN_LUT_BLOCK * out_cols * sizeof(float));
+    float* want = NN_MALLOC(NN_LUT_BLOCK * out_cols * sizeof(float));
+    NN_ASSERT(x != NULL && y != NULL && want != NULL);
+
+    for (;;) {
+        uint64_t block = atomic_fetch_add(&job -> next, 1);
+        if (block >= job -> block_count) break;
+        uint64_t first = block * NN_LUT_BLOCK;
+        size_t rows = lut -> count - first < NN_LUT_BLOCK ? lut -> count - first : NN_LUT_BLOCK;
+        for (size_t r = 0; r < rows; r++) {
+            if (job -> gen != NULL) {
+                job -> gen -> row(job -> gen, first + r, x + r * in_cols, want + r * out_cols);
+            } else {
+                for (size_t c = 0; c < in_cols; c++) x[r * in_cols + c] = (float) (((first + r) >> c) & 1);
+            }
+        }
+        nn_predict(job -> model, matrix_data_alloc(x, rows, in_cols, in_cols), matrix_data_alloc(y, rows, out_cols, out_cols));
+
+        // A generator may enumerate inputs in any order, so every row goes where its inputs say
+        double cost = 0;
+        uint64_t wrong_rows = 0, wrong_bits = 0;
+        for (size_t r = 0; r < rows; r++) {
+            const float* out = y + r * out_cols;
+            size_t index = nn_lut_index(*lut, x + r * in_cols);
+            memcpy(lut -> outputs + index * out_cols, out, out_cols * sizeof(float));
+            if (lut -> packed != NULL) {
+                uint64_t bits = 0;
+                for (size_t j = 0; j < out_cols; j++) bits |= (uint64_t) (out[j] > 0.5f) << j;
+                lut -> packed[index] = bits;
+            }
+            if (job -> gen == NULL) continue;
+            size_t wrong = 0;
+            for (size_t j = 0; j < out_cols; j++) {
+                float d = out[j] - want[r * out_cols + j];
+                cost += d * d;
+                wrong += (out[j] > 0.5f) != (want[r * out_cols + j] > 0.5f);
             }
+            wrong_rows += wrong > 0;
+            wrong_bits += wrong;
         }
+        job -> block_costs[block] = cost;
+        atomic_fetch_add(&job -> wrong_rows, wrong_rows);
+        atomic_fetch_add(&job -> wrong_bits, wrong_bits);
     }
+
+    free(x);
+    free(y);
+    free(want);
+    return NULL;
 }
 
-// -------------------------------------
+// Scores all 1 << in_cols inputs on thread_count threads (0: every online core), the calling
+// thread included. With a generator, its rows are the inputs, so it must enumerate exactly
+// the 0 or 1 inputs once each, like dataset_gen_adder and dataset_gen_gate do, and its
+// outputs are the reference for the accuracy fields. outputs is NULL when in_cols is over
+// NN_LUT_MAX_INPUTS
+NN_LUT nn_lut_compile(NN_Model model, const Dataset_Gen* gen, size_t thread_count) {
+    NN_LUT lut = {0};
+    lut.in_cols = model.weights[0].rows;
+    lut.out_cols = model.weights[model.count - 1].cols;
+    if (lut.in_cols > NN_LUT_MAX_INPUTS) return lut;
+    lut.count = (uint64_t) 1 << lut.in_cols;
+    NN_ASSERT(gen == NULL || (gen -> in_cols == lut.in_cols && gen -> out_cols == lut.out_cols && gen -> count == lut.count));
+    lut.outputs = NN_MALLOC(lut.count * lut.out_cols * sizeof(float));
+    NN_ASSERT(lut.outputs != NULL);
+    if (lut.out_cols <= 64) {
+        lut.packed = NN_MALLOC(lut.count * sizeof(uint64_t));
+        NN_ASSERT(lut.packed != NULL);
+    }
+
+    NN__LUT_Job job = {
+        .model = model,
+        .gen = gen,
+        .lut = &lut,
+        .block_count = (lut.count + NN_LUT_BLOCK - 1) / NN_LUT_BLOCK,
+    };
+    job.block_costs = NN_MALLOC(job.block_count * sizeof(double));
+    NN_ASSERT(job.block_costs != NULL);
+    if (thread_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cores > 0 ? (size_t) cores : 1;
+    }
+    if (thread_count > job.block_count) thread_count = job.block_count;
+    pthread_t* threads = NN_MALLOC(thread_count * sizeof(*threads));
+    NN_ASSERT(threads != NULL);
+    for (size_t t = 1; t < thread_count; t++) {
+        if (pthread_create(&threads[t], NULL, nn__lut_worker, &job) != 0) threads[t] = pthread_self();
+    }
+    nn__lut_worker(&job);
+    for (size_t t = 1; t < thread_count; t++) {
+        if (!pthread_equal(threads[t], pthread_self())) pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    if (gen != NULL) {
+        for (uint64_t b = 0; b < job.block_count; b++) lut.cost += job.block_costs[b];
+        lut.cost /= lut.count;
+        lut.wrong_rows = atomic_load(&job.wrong_rows);
+        lut.wrong_bits = atomic_load(&job.wrong_bits);
+    }
+    free(job.block_costs);
+    return lut;
+}
+
+// Bit j of the row index is set when input j is above 0.5
+size_t nn_lut_index(NN_LUT lut, const float* in) {
+    size_t index = 0;
+    for (size_t j = 0; j < lut.in_cols; j++) index |= (size_t) (in[j] > 0.5f) << j;
+    return index;
+}
+
+const float* nn_lut_lookup(NN_LUT lut, const float* in) {
+    NN_ASSERT(lut.outputs != NULL);
+    return lut.outputs + nn_lut_index(lut, in) * lut.out_cols;
+}
+
+void nn_lut_free(NN_LUT* lut) {
+    NN_ASSERT(lut != NULL);
+    free(lut -> outputs);
+    free(lut -> packed);
+    *lut = (NN_LUT) {0};
+}
+// -------------------------------------------
+
+
+// ----- model registry methods definition -----
+NN_Registry nn_registry_alloc(const char* path) {
+    NN_Registry reg = {0};
+    reg.path = strdup(path);
+    NN_ASSERT(reg.path != NULL);
+    atomic_init(&reg.current, NULL);
+    atomic_init(&reg.epoch, 1);
+    for (size_t i = 0; i < NN_REGISTRY_READERS; i++) atomic_init(&reg.readers[i].epoch, 0);
+    atomic_init(&reg.reader_count, 0);
+    atomic_init(&reg.publishing, false);
+    return reg;
+}
+
+// Claims a reader slot, once per inference thread
+size_t nn_registry_reader(NN_Registry* reg) {
+    size_t reader = atomic_fetch_add(&reg -> reader_count, 1);
+    NN_ASSERT(reader < NN_REGISTRY_READERS);
+    return reader;
+}
+
+// The returned entry stays valid until the matching nn_registry_exit
+const NN_Registry_Entry* nn_registry_enter(NN_Registry* reg, size_t reader) {
+    atomic_store(&reg -> readers[reader].epoch, atomic_load(&reg -> epoch));
+    return atomic_load(&reg -> current);
+}
+
+void nn_registry_exit(NN_Registry* reg, size_t reader) {
+    atomic_store_explicit(&reg -> readers[reader].epoch, 0, memory_order_release);
+}
+
+static void nn__registry_entry_free(NN_Registry_Entry* entry) {
+    if (entry == NULL) return;
+    if (entry -> mapped) {
+        nn_unmap(&entry -> nn);
+    } else {
+        nn_free(&entry -> nn);
+    }
+    free(entry);
+}
+
+static bool nn__registry_publish(NN_Registry* reg, NN nn, bool mapped) {
+    NN_ASSERT(nn.count > 0);
+    bool idle = false;
+    if (!atomic_compare_exchange_strong(&reg -> publishing, &idle, true)) return false;
+    NN_Registry_Entry* old = atomic_load(&reg -> current);
+    if (old != NULL && (NN_INPUT(old -> nn).cols != NN_INPUT(nn).cols || NN_OUTPUT(old -> nn).cols != NN_OUTPUT(nn).cols)) {
+        atomic_store(&reg -> publishing, false);
+        return false;
+    }
+
+    NN_Registry_Entry* entry = NN_MALLOC(sizeof(*entry));
+    NN_ASSERT(entry != NULL);
+    entry -> nn = nn;
+    entry -> model = nn_model(nn);
+    entry -> version = old != NULL ? old -> version + 1 : 1;
+    entry -> mapped = mapped;
+    atomic_store(&reg -> current, entry);
+    uint64_t epoch = atomic_fetch_add(&reg -> epoch, 1) + 1;
+
+    // A reader that entered before the bump may still hold old, anyone later sees entry
+    size_t count = atomic_load(&reg -> reader_count);
+    if (count > NN_REGISTRY_READERS) count = NN_REGISTRY_READERS;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t spins = 0;; spins++) {
+            uint64_t e = atomic_load(&reg -> readers[i].epoch);
+            if (e == 0 || e >= epoch) break;
+            if (spins < 64) {
+                sched_yield();
+            } else {
+                nanosleep(&(struct timespec) { .tv_nsec = 50000 }, NULL);
+            }
+        }
+    }
+    nn__registry_entry_free(old);
+    atomic_store(&reg -> publishing, false);
+    return true;
+}
+
+// Takes ownership of nn on success. A model whose input or output width differs from the
+// current one is refused, callers size their requests and answers from the first model
+bool nn_registry_publish(NN_Registry* reg, NN nn) {
+    return nn__registry_publish(reg, nn, false);
+}
+
+static const char* nn__registry_shm_name(const NN_Registry* reg) {
+    size_t n = strlen(NN_SHM_PREFIX);
+    return strncmp(reg -> path, NN_SHM_PREFIX, n) == 0 ? reg -> path + n : NULL;
+}
+
+static bool nn__registry_stat(const NN_Registry* reg, struct stat* st) {
+    const char* shm = nn__registry_shm_name(reg);
+    if (shm == NULL) return stat(reg -> path, st) == 0;
+    char shm_name[256];
+    nn__shm_name(shm_name, sizeof(shm_name), shm);
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0) return false;
+    bool ok = fstat(fd, st) == 0;
+    close(fd);
+    return ok;
+}
+
+// True when the file changed since the last reload attempt, a file that failed to load
+// is not tried again until it is written again. A segment caught before nn_shm_publish
+// wrote its magic is tried again regardless, since finishing it may not change its mtime
+bool nn_registry_changed(const NN_Registry* reg) {
+    struct stat st;
+    if (!nn__registry_stat(reg, &st)) return false;
+    return reg -> incomplete || st.st_ino != reg -> seen.st_ino || st.st_size != reg -> seen.st_size
+        || st.st_mtim.tv_sec != reg -> seen.st_mtim.tv_sec || st.st_mtim.tv_nsec != reg -> seen.st_mtim.tv_nsec;
+}
+
+// Loads a private copy of a file, so a model being rewritten in place never reaches the
+// readers: a torn write fails the checksums and the current entry stays published.
+// Shared memory segments are attached instead, nn_shm_publish never rewrites one in place
+bool nn_registry_reload(NN_Registry* reg) {
+    struct stat st;
+    if (!nn__registry_stat(reg, &st)) {
+        reg -> failed_reloads += 1;
+        return false;
+    }
+    reg -> seen = st;
+    reg -> incomplete = false;
+    const char* shm = nn__registry_shm_name(reg);
+    NN nn = shm != NULL ? nn__shm_attach(shm, &reg -> incomplete) : nn_load(reg -> path);
+    if (nn.count == 0) {
+        reg -> failed_reloads += 1;
+        return false;
+    }
+    if (!nn__registry_publish(reg, nn, shm != NULL)) {
+        if (shm != NULL) {
+            nn_unmap(&nn);
+        } else {
+            nn_free(&nn);
+        }
+        reg -> failed_reloads += 1;
+        return false;
+    }
+    reg -> reloads += 1;
+    return true;
+}
+
+// No reader may be inside when the registry is freed
+void nn_registry_free(NN_Registry* reg) {
+    nn__registry_entry_free(atomic_load(&reg -> current));
+    atomic_store(&reg -> current, NULL);
+    free(reg -> path);
+    reg -> path = NULL;
+}
+// ----------------------------------------------
 
 
 #ifdef NN_ENABLE_GUI
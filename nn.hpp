@@ -0,0 +1,500 @@
+#ifndef NN_HPP
+#define NN_HPP
+
+// Compile time sized networks for C++17. Network<2, 4, 1> keeps its weights, biases and
+// activations in std::arrays sized by the template arguments, so shapes are checked by the
+// compiler, the layer loops have constant trip counts and are unrolled up to 64 wide, and
+// a tiny net can stay in registers.
+// forward, cost, backprop and learn compute what nn_forward, nn_cost, nn_backprop and
+// nn_learn do, bit for bit when both are built for the same target (nn_hpp_check verifies
+// this), and save and load use the nn.h.mdl model file and nn.h.mat matrix file of nn.h,
+// so a model trained on one side loads on the other. nn.h itself is C11 and not
+// valid C++, which is why the file layouts are repeated here rather than included.
+
+// ----- libraries ------
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <tuple>
+#include <utility>
+#include <vector>
+// ----------------------
+
+// ----- standard macros -----
+#ifndef NN_ASSERT
+#include <cassert>
+#define NN_ASSERT assert
+#endif // NN_ASSERT
+// ---------------------------
+
+namespace nn {
+
+// ----- file formats -----
+// Same layout as NN_File_Header, NN_File_Layer and matrix_save in nn.h
+inline constexpr char file_magic[] = "nn.h.mdl";
+inline constexpr std::uint32_t file_version = 1;
+inline constexpr std::size_t file_align = 64;
+inline constexpr char mat_magic[] = "nn.h.mat";
+
+struct File_Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t layer_count;      // architecture entries, layers + 1
+    std::uint64_t file_size;
+    std::uint32_t checksum;         // CRC32 of header, architecture and layer table with this field zeroed
+    std::uint32_t reserved;
+};
+
+struct File_Layer {
+    std::uint32_t activation;       // 0, sigmoid, the only activation nn.h has
+    std::uint32_t weights_checksum;
+    std::uint32_t biases_checksum;
+    std::uint32_t reserved;
+    std::uint64_t weights_offset;   // file_align aligned, rows * cols floats
+    std::uint64_t biases_offset;    // file_align aligned, cols floats
+};
+
+static_assert(sizeof(File_Header) == 32 && sizeof(File_Layer) == 32, "must match the nn.h model file");
+// ------------------------
+
+namespace detail {
+
+inline std::uint32_t crc32(std::uint32_t crc, const void* data, std::size_t size) {
+    static const auto table = [] {
+        std::array<std::uint32_t, 256> t{};
+        for (std::uint32_t i = 0; i < 256; i++) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    const auto* bytes = static_cast<const std::uint8_t*>(data);
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; i++) crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+constexpr std::size_t file_align_up(std::size_t offset) {
+    return (offset + file_align - 1) / file_align * file_align;
+}
+
+constexpr std::size_t file_prefix_size(std::size_t count) {
+    return file_align_up(sizeof(File_Header) + (count + 1) * sizeof(std::uint64_t) + count * sizeof(File_Layer));
+}
+
+inline std::uint32_t file_prefix_crc32(File_Header header, const std::uint64_t* arch, const File_Layer* layers) {
+    header.checksum = 0;
+    std::uint32_t crc = crc32(0, &header, sizeof(header));
+    crc = crc32(crc, arch, header.layer_count * sizeof(*arch));
+    return crc32(crc, layers, (header.layer_count - 1) * sizeof(*layers));
+}
+
+// Same expression as sigmoidf in nn.h
+inline float sigmoidf(float x) {
+    return 1.f / (1.f + std::exp(-x));
+}
+
+// acc + x * w under the rule of NN_MADD in nn.h: one rounding where the target has fma,
+// two elsewhere, whatever -ffp-contract says. Every multiply-add nn.h spells with NN_MADD
+// goes through here, so nn.hpp rounds like nn.h
+inline float madd(float x, float w, float acc) {
+#if defined(__FMA__) || defined(__ARM_FEATURE_FMA)
+    return std::fma(x, w, acc);
+#else
+    return acc + x * w;
+#endif
+}
+
+} // namespace detail
+
+
+// ----- rows -----
+// count rows of Cols floats, stride floats apart, like the ti and to matrices of nn.h.
+// The column count is part of the type, so handing a network rows of the wrong width
+// does not compile
+template <std::size_t Cols>
+struct Rows {
+    const float* data = nullptr;
+    std::size_t count = 0;
+    std::size_t stride = Cols;
+
+    const float* operator[](std::size_t i) const { return data + i * stride; }
+};
+// ----------------
+
+
+// ----- mat -----
+// A matrix file as written by matrix_save. The compressed nn.h.mtz variant needs the
+// codec in nn.h and is not read here
+struct Mat {
+    std::size_t rows = 0;
+    std::size_t cols = 0;
+    std::vector<float> elements;
+
+    // Cols columns starting at first, e.g. mat.columns<2>(0) and mat.columns<1>(2)
+    // split an xor.mat into inputs and outputs
+    template <std::size_t Cols>
+    Rows<Cols> columns(std::size_t first) const {
+        NN_ASSERT(first + Cols <= cols);
+        return Rows<Cols>{elements.data() + first, rows, cols};
+    }
+
+    bool save(const char* path) const {
+        std::FILE* out = std::fopen(path, "wb");
+        if (out == nullptr) return false;
+        std::uint64_t shape[] = {rows, cols};
+        std::fwrite(mat_magic, 1, sizeof(mat_magic) - 1, out);
+        std::fwrite(shape, sizeof(shape), 1, out);
+        std::fwrite(elements.data(), sizeof(float), elements.size(), out);
+        bool ok = !std::ferror(out);
+        return std::fclose(out) == 0 && ok;
+    }
+
+    // rows is 0 on failure
+    static Mat load(const char* path) {
+        Mat m;
+        std::FILE* in = std::fopen(path, "rb");
+        if (in == nullptr) return m;
+        char magic[8];
+        std::uint64_t shape[2];
+        bool ok = std::fread(magic, sizeof(magic), 1, in) == 1 && std::memcmp(magic, mat_magic, sizeof(magic)) == 0
+               && std::fread(shape, sizeof(shape), 1, in) == 1 && shape[1] > 0 && shape[0] < (SIZE_MAX / sizeof(float)) / shape[1];
+        if (ok) {
+            m.elements.resize(shape[0] * shape[1]);
+            ok = std::fread(m.elements.data(), sizeof(float), m.elements.size(), in) == m.elements.size();
+        }
+        std::fclose(in);
+        if (!ok) return Mat{};
+        m.rows = shape[0];
+        m.cols = shape[1];
+        return m;
+    }
+};
+// ---------------
+
+
+// ----- layer -----
+template <std::size_t In, std::size_t Out>
+struct Layer {
+    static_assert(In > 0 && Out > 0, "every layer needs at least one neuron");
+    static constexpr std::size_t in_cols = In;
+    static constexpr std::size_t out_cols = Out;
+
+    std::array<float, In * Out> weights{};  // In rows by Out cols, row major like nn.h
+    std::array<float, Out> biases{};
+
+    float& w(std::size_t k, std::size_t j) { return weights[k * Out + j]; }
+    float w(std::size_t k, std::size_t j) const { return weights[k * Out + j]; }
+};
+// -----------------
+
+
+// ----- network -----
+template <std::size_t... Sizes>
+struct Network {
+    static_assert(sizeof...(Sizes) >= 2, "a network needs at least an input and an output size");
+    static_assert(((Sizes > 0) && ...), "every layer needs at least one neuron");
+
+    static constexpr std::size_t count = sizeof...(Sizes) - 1;
+    static constexpr std::array<std::size_t, count + 1> arch = {Sizes...};
+    static constexpr std::size_t in_cols = arch[0];
+    static constexpr std::size_t out_cols = arch[count];
+    static constexpr std::size_t param_count = [] {
+        std::size_t n = 0;
+        for (std::size_t l = 0; l < count; l++) n += arch[l] * arch[l + 1] + arch[l + 1];
+        return n;
+    }();
+
+    using Input = std::array<float, in_cols>;
+    using Output = std::array<float, out_cols>;
+
+private:
+    template <std::size_t... L>
+    static auto layers_type(std::index_sequence<L...>) -> std::tuple<Layer<arch[L], arch[L + 1]>...>;
+    using Layers = decltype(layers_type(std::make_index_sequence<count>{}));
+
+public:
+    Layers layers;
+    std::tuple<std::array<float, Sizes>...> inputs{};  // activations, inputs[0] is the input
+
+    template <std::size_t L> auto& layer() { return std::get<L>(layers); }
+    template <std::size_t L> const auto& layer() const { return std::get<L>(layers); }
+    Input& input() { return std::get<0>(inputs); }
+    const Output& output() const { return std::get<count>(inputs); }
+
+    // nn_forward on input()
+    const Output& forward() {
+        forward_layers(std::make_index_sequence<count>{});
+        return output();
+    }
+
+    const Output& forward(const Input& x) {
+        input() = x;
+        return forward();
+    }
+
+    const Output& forward(const float* x) {
+        for (std::size_t i = 0; i < in_cols; i++) input()[i] = x[i];
+        return forward();
+    }
+
+    float cost(Rows<in_cols> ti, Rows<out_cols> to) {
+        NN_ASSERT(ti.count == to.count && ti.count > 0);
+        float result = 0;
+        for (std::size_t i = 0; i < ti.count; i++) {
+            forward(ti[i]);
+            result += row_cost(to[i]);
+        }
+        return result / ti.count;
+    }
+
+    // Gradient of cost averaged over the rows, into g. g's activations are used as scratch
+    void backprop(Network& g, Rows<in_cols> ti, Rows<out_cols> to) {
+        NN_ASSERT(ti.count == to.count && ti.count > 0);
+        g.zero();
+        for (std::size_t i = 0; i < ti.count; i++) {
+            forward(ti[i]);
+            backprop_row(g, to[i]);
+        }
+        g.average(ti.count, std::make_index_sequence<count>{});
+    }
+
+    void learn(const Network& g, float rate) {
+        learn_layers(g, rate, std::make_index_sequence<count>{});
+    }
+
+    void zero() {
+        for_each_layer([](std::size_t, auto& layer) {
+            layer.weights.fill(0);
+            layer.biases.fill(0);
+        });
+        std::apply([](auto&... a) { (a.fill(0), ...); }, inputs);
+    }
+
+    // Uniform in [low, high), drawn in the order nn_randomise draws them with the splitmix64
+    // generator behind rand_float, so the same seed gives nn.h's starting point
+    void randomise(float low, float high, std::uint64_t& state) {
+        randomise_layers(low, high, state, std::make_index_sequence<count>{});
+    }
+
+    // Writes the file nn_save writes for the same weights
+    bool save(const char* path) const {
+        std::array<std::uint64_t, count + 1> file_arch;
+        std::array<File_Layer, count> file_layers{};
+        std::size_t offset = detail::file_prefix_size(count);
+        for (std::size_t l = 0; l <= count; l++) file_arch[l] = arch[l];
+        for_each_layer([&](std::size_t l, const auto& layer) {
+            file_layers[l].weights_checksum = detail::crc32(0, layer.weights.data(), sizeof(layer.weights));
+            file_layers[l].biases_checksum = detail::crc32(0, layer.biases.data(), sizeof(layer.biases));
+            file_layers[l].weights_offset = offset;
+            offset = detail::file_align_up(offset + sizeof(layer.weights));
+            file_layers[l].biases_offset = offset;
+            offset = detail::file_align_up(offset + sizeof(layer.biases));
+        });
+        File_Header header{};
+        std::memcpy(header.magic, file_magic, sizeof(header.magic));
+        header.version = file_version;
+        header.layer_count = count + 1;
+        header.file_size = offset;
+        header.checksum = detail::file_prefix_crc32(header, file_arch.data(), file_layers.data());
+
+        std::FILE* out = std::fopen(path, "wb");
+        if (out == nullptr) return false;
+        static const char zeros[file_align] = {0};
+        std::fwrite(&header, sizeof(header), 1, out);
+        std::fwrite(file_arch.data(), sizeof(file_arch), 1, out);
+        std::fwrite(file_layers.data(), sizeof(file_layers), 1, out);
+        std::size_t written = sizeof(header) + sizeof(file_arch) + sizeof(file_layers);
+        for_each_layer([&](std::size_t l, const auto& layer) {
+            std::fwrite(zeros, 1, file_layers[l].weights_offset - written, out);
+            std::fwrite(layer.weights.data(), sizeof(layer.weights), 1, out);
+            written = file_layers[l].weights_offset + sizeof(layer.weights);
+            std::fwrite(zeros, 1, file_layers[l].biases_offset - written, out);
+            std::fwrite(layer.biases.data(), sizeof(layer.biases), 1, out);
+            written = file_layers[l].biases_offset + sizeof(layer.biases);
+        });
+        std::fwrite(zeros, 1, offset - written, out);
+        bool ok = !std::ferror(out);
+        return std::fclose(out) == 0 && ok;
+    }
+
+    // Reads a file written by nn_save or save, verifying every checksum like nn_load. Fails,
+    // leaving the network untouched, when the file's architecture is not exactly Sizes...
+    bool load(const char* path) {
+        std::FILE* in = std::fopen(path, "rb");
+        if (in == nullptr) return false;
+        constexpr std::size_t prefix_size = detail::file_prefix_size(count);
+        std::array<char, prefix_size> prefix;
+        File_Header header;
+        std::array<std::uint64_t, count + 1> file_arch;
+        std::array<File_Layer, count> file_layers;
+        bool ok = std::fread(prefix.data(), prefix.size(), 1, in) == 1;
+        if (ok) {
+            std::memcpy(&header, prefix.data(), sizeof(header));
+            std::memcpy(file_arch.data(), prefix.data() + sizeof(header), sizeof(file_arch));
+            std::memcpy(file_layers.data(), prefix.data() + sizeof(header) + sizeof(file_arch), sizeof(file_layers));
+            ok = std::memcmp(header.magic, file_magic, sizeof(header.magic)) == 0
+              && header.version == file_version
+              && header.layer_count == count + 1
+              && detail::file_prefix_crc32(header, file_arch.data(), file_layers.data()) == header.checksum;
+            for (std::size_t l = 0; ok && l <= count; l++) ok = file_arch[l] == arch[l];
+        }
+
+        std::vector<float> params(param_count);
+        float* p = params.data();
+        for (std::size_t l = 0; ok && l < count; l++) {
+            std::size_t wn = arch[l] * arch[l + 1];
+            std::size_t bn = arch[l + 1];
+            ok = file_layers[l].activation == 0
+              && std::fseek(in, file_layers[l].weights_offset, SEEK_SET) == 0
+              && std::fread(p, sizeof(float), wn, in) == wn
+              && detail::crc32(0, p, wn * sizeof(float)) == file_layers[l].weights_checksum
+              && std::fseek(in, file_layers[l].biases_offset, SEEK_SET) == 0
+              && std::fread(p + wn, sizeof(float), bn, in) == bn
+              && detail::crc32(0, p + wn, bn * sizeof(float)) == file_layers[l].biases_checksum;
+            p += wn + bn;
+        }
+        std::fclose(in);
+        if (!ok) return false;
+
+        p = params.data();
+        for_each_layer([&](std::size_t, auto& layer) {
+            std::memcpy(layer.weights.data(), p, sizeof(layer.weights));
+            p += layer.weights.size();
+            std::memcpy(layer.biases.data(), p, sizeof(layer.biases));
+            p += layer.biases.size();
+        });
+        return true;
+    }
+
+private:
+    // out[j] = sigmoid(sum_k in[k] * w[k][j] + b[j]), summed in ascending k like matrix_multiplication
+    template <std::size_t L>
+    void forward_layer() {
+        constexpr std::size_t In = arch[L];
+        constexpr std::size_t Out = arch[L + 1];
+        const auto& x = std::get<L>(inputs);
+        auto& y = std::get<L + 1>(inputs);
+        const auto& layer = std::get<L>(layers);
+        for (std::size_t j = 0; j < Out; j++) y[j] = 0;
+#pragma GCC unroll 64
+        for (std::size_t k = 0; k < In; k++) {
+#pragma GCC unroll 64
+            for (std::size_t j = 0; j < Out; j++) y[j] = detail::madd(x[k], layer.weights[k * Out + j], y[j]);
+        }
+        for (std::size_t j = 0; j < Out; j++) y[j] = detail::sigmoidf(y[j] + layer.biases[j]);
+    }
+
+    template <std::size_t... L>
+    void forward_layers(std::index_sequence<L...>) {
+        (forward_layer<L>(), ...);
+    }
+
+    float row_cost(const float* y) const {
+        float result = 0;
+        for (std::size_t j = 0; j < out_cols; j++) {
+            float d = output()[j] - y[j];
+            result = detail::madd(d, d, result);
+        }
+        return result;
+    }
+
+    // nn__backprop_row for layer L, walking from the output back to the input
+    template <std::size_t L>
+    void backprop_layer(Network& g) const {
+        constexpr std::size_t In = arch[L];
+        constexpr std::size_t Out = arch[L + 1];
+        const auto& a_in = std::get<L>(inputs);
+        const auto& a_out = std::get<L + 1>(inputs);
+        const auto& layer = std::get<L>(layers);
+        const auto& da_out = std::get<L + 1>(g.inputs);
+        auto& da_in = std::get<L>(g.inputs);
+        auto& gl = std::get<L>(g.layers);
+#pragma GCC unroll 64
+        for (std::size_t j = 0; j < Out; j++) {
+            float a = a_out[j];
+            float da = da_out[j];
+            float d = da * a * (1 - a);
+            gl.biases[j] += d;
+#pragma GCC unroll 64
+            for (std::size_t k = 0; k < In; k++) {
+                gl.weights[k * Out + j] = detail::madd(d, a_in[k], gl.weights[k * Out + j]);
+                da_in[k] = detail::madd(d, layer.weights[k * Out + j], da_in[k]);
+            }
+        }
+    }
+
+    template <std::size_t... L>
+    void backprop_layers(Network& g, std::index_sequence<L...>) const {
+        // Comma fold over the reversed indices runs the last layer first
+        (backprop_layer<count - 1 - L>(g), ...);
+    }
+
+    void backprop_row(Network& g, const float* y) const {
+        std::apply([](auto&... a) { (a.fill(0), ...); }, g.inputs);
+        auto& d_out = std::get<count>(g.inputs);
+        for (std::size_t j = 0; j < out_cols; j++) d_out[j] = 2 * (output()[j] - y[j]);
+        backprop_layers(g, std::make_index_sequence<count>{});
+    }
+
+    // nn__gradient_average
+    template <std::size_t... L>
+    void average(std::size_t n, std::index_sequence<L...>) {
+        auto divide = [n](auto& layer) {
+            for (auto& w : layer.weights) w /= n;
+            for (auto& b : layer.biases) b /= n;
+        };
+        (divide(std::get<L>(layers)), ...);
+    }
+
+    template <std::size_t... L>
+    void learn_layers(const Network& g, float rate, std::index_sequence<L...>) {
+        auto step = [rate](auto& layer, const auto& grad) {
+            // nn_learn steps with NN_MADD(-rate, g, w), negating rate is exact
+            for (std::size_t i = 0; i < layer.weights.size(); i++) layer.weights[i] = detail::madd(-rate, grad.weights[i], layer.weights[i]);
+            for (std::size_t i = 0; i < layer.biases.size(); i++) layer.biases[i] = detail::madd(-rate, grad.biases[i], layer.biases[i]);
+        };
+        (step(std::get<L>(layers), std::get<L>(g.layers)), ...);
+    }
+
+    static float rand_float(std::uint64_t& state) {
+        std::uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        return (float) (z >> 40) / (float) ((1u << 24) - 1);
+    }
+
+    template <std::size_t... L>
+    void randomise_layers(float low, float high, std::uint64_t& state, std::index_sequence<L...>) {
+        auto fill = [&](auto& layer) {
+            for (auto& w : layer.weights) w = detail::madd(rand_float(state), high - low, low);
+            for (auto& b : layer.biases) b = detail::madd(rand_float(state), high - low, low);
+        };
+        (fill(std::get<L>(layers)), ...);
+    }
+
+    template <typename F>
+    void for_each_layer(F&& f) const {
+        for_each_layer_impl(*this, f, std::make_index_sequence<count>{});
+    }
+
+    template <typename F>
+    void for_each_layer(F&& f) {
+        for_each_layer_impl(*this, f, std::make_index_sequence<count>{});
+    }
+
+    template <typename Self, typename F, std::size_t... L>
+    static void for_each_layer_impl(Self& self, F& f, std::index_sequence<L...>) {
+        (f(L, std::get<L>(self.layers)), ...);
+    }
+};
+// -------------------
+
+} // namespace nn
+
+#endif // NN_HPP
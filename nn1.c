@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <time.h>
 #include "raylib.h"
 
@@ -52,26 +53,14 @@ void nn_render_raylib(NN nn) {
 }
 
 int main(void) {
-    srand((unsigned)time(NULL));
+    nn_seed((uint64_t)time(NULL));
 
     size_t n = (1 << BITS);
-    size_t rows = n * n;
-    matrix ti = matrix_alloc(rows, 2 * BITS, 2 * BITS);
-    matrix to = matrix_alloc(rows, BITS + 1, BITS + 1);
-
-    for (size_t i = 0; i < rows; i++) {
-        size_t x = i / n;
-        size_t y = i % n;
-        size_t z = x + y;
-        for (size_t j = 0; j < BITS; j++) {
-            MATRIX_AT(ti, i, j) = (float)((x >> j) & 1);
-            MATRIX_AT(ti, i, j + BITS) = (float)((y >> j) & 1);
-        }
-        for (size_t j = 0; j < BITS; j++) {
-            MATRIX_AT(to, i, j) = (float)((z >> j) & 1);
-        }
-        MATRIX_AT(to, i, BITS) = (float)(z >= n);
-    }
+    Dataset_Gen gen = dataset_gen_adder(BITS);
+    size_t rows = gen.count;
+    matrix ti = matrix_alloc(rows, gen.in_cols, gen.in_cols);
+    matrix to = matrix_alloc(rows, gen.out_cols, gen.out_cols);
+    dataset_gen_fill(gen, 0, ti, to);
 
     size_t architecture[] = { 2 * BITS, 4 * BITS, BITS + 1 };
     NN nn = nn_alloc(architecture, ARRAY_SIZE(architecture));
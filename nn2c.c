@@ -0,0 +1,237 @@
+// Compiles a model saved with nn_save into a standalone C file: the weights become static
+// const arrays, every loop gets constant bounds and inference is a single
+//
+//     void predict(const float* in, float* out);
+//
+// with no allocation and no loading. Building the generated file with -DNN2C_HARNESS and
+// nn.h on the include path gives a program that checks predict against nn_forward bit for bit.
+// With --lut, for models whose inputs are all 0 or 1, every output is computed here with
+// nn_lut_compile and predict becomes a single lookup in the resulting table.
+#define _GNU_SOURCE
+#include <assert.h>
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+char* args_shift(int* argc, char*** argv) {
+    assert(*argc > 0);
+    char* result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+// Hex float literals round trip exactly
+static void emit_float(FILE* out, float x) {
+    if (isnan(x)) {
+        fprintf(out, "NAN");
+    } else if (isinf(x)) {
+        fprintf(out, x < 0 ? "-INFINITY" : "INFINITY");
+    } else {
+        fprintf(out, "%af", x);
+    }
+}
+
+static void emit_array(FILE* out, const char* name, size_t layer, matrix m) {
+    fprintf(out, "static _Alignas(64) const float %s%zu[%zu] = {", name, layer, m.rows * m.cols);
+    size_t n = 0;
+    for (size_t i = 0; i < m.rows; i++) {
+        for (size_t j = 0; j < m.cols; j++, n++) {
+            fprintf(out, n % 6 == 0 ? "\n    " : " ");
+            emit_float(out, MATRIX_AT(m, i, j));
+            fprintf(out, ",");
+        }
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+// out[j] = sigmoid(sum_k in[k] * w[k][j] + b[j]), summed in ascending k like nn_forward
+static void emit_layer(FILE* out, size_t layer, size_t rows, size_t cols, const char* in, const char* dst) {
+    fprintf(out, "    // layer %zu: %zu -> %zu\n", layer, rows, cols);
+    fprintf(out, "    for (int j = 0; j < %zu; j++) %s[j] = 0;\n", cols, dst);
+    fprintf(out, "#pragma GCC unroll %zu\n", rows <= 32 ? rows : (size_t) 8);
+    fprintf(out, "    for (int k = 0; k < %zu; k++) {\n", rows);
+    fprintf(out, "        const float x = %s[k];\n", in);
+    fprintf(out, "        for (int j = 0; j < %zu; j++) %s[j] = NN2C_MADD(x, nn2c_w%zu[k * %zu + j], %s[j]);\n", cols, dst, layer, cols, dst);
+    fprintf(out, "    }\n");
+    fprintf(out, "    for (int j = 0; j < %zu; j++) %s[j] = nn2c_sigmoidf(%s[j] + nn2c_b%zu[j]);\n", cols, dst, dst, layer);
+}
+
+// The table row of an input has bit j set when input j is above 0.5, like nn_lut_index
+static void emit_lut(FILE* out, const char* name, NN_LUT lut) {
+    fprintf(out, "static _Alignas(64) const float nn2c_table[%llu] = {", (unsigned long long) (lut.count * lut.out_cols));
+    for (size_t i = 0; i < lut.count * lut.out_cols; i++) {
+        fprintf(out, i % 6 == 0 ? "\n    " : " ");
+        emit_float(out, lut.outputs[i]);
+        fprintf(out, ",");
+    }
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "void %s(const float* in, float* out) {\n", name);
+    fprintf(out, "    unsigned long index = 0;\n");
+    fprintf(out, "    for (int j = 0; j < %zu; j++) index |= (unsigned long) (in[j] > 0.5f) << j;\n", lut.in_cols);
+    fprintf(out, "    for (int j = 0; j < %zu; j++) out[j] = nn2c_table[index * %zu + j];\n", lut.out_cols, lut.out_cols);
+    fprintf(out, "}\n\n");
+}
+
+static void emit_harness(FILE* out, const char* model_path, const char* name, size_t in_cols, size_t out_cols, bool binary) {
+    fprintf(out,
+        "#ifdef NN2C_HARNESS\n"
+        "#define NN_IMPLEMENTATION\n"
+        "#include \"nn.h\"\n"
+        "\n"
+        "static double nn2c_now_secs(void) {\n"
+        "    struct timespec ts;\n"
+        "    clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+        "    return ts.tv_sec + ts.tv_nsec * 1e-9;\n"
+        "}\n"
+        "\n"
+        "int main(int argc, char** argv) {\n"
+        "    const char* path = argc > 1 ? argv[1] : \"%s\";\n"
+        "    size_t rows = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;\n"
+        "    NN nn = nn_load(path);\n"
+        "    if (nn.count == 0 || NN_INPUT(nn).cols != %zu || NN_OUTPUT(nn).cols != %zu) {\n"
+        "        fprintf(stderr, \"ERROR: could not load a %zu -> %zu model from %%s\\n\", path);\n"
+        "        return 1;\n"
+        "    }\n"
+        "\n"
+        "    matrix x = matrix_alloc(rows, %zu, %zu);\n"
+        "    matrix y = matrix_alloc(rows, %zu, %zu);\n"
+        "    nn_seed(42);\n"
+        "    for (size_t i = 0; i < rows * %zu; i++) x.elements[i] = %s;\n"
+        "\n"
+        "    double start = nn2c_now_secs();\n"
+        "    for (size_t r = 0; r < rows; r++) %s(&MATRIX_AT(x, r, 0), &MATRIX_AT(y, r, 0));\n"
+        "    double generated = nn2c_now_secs() - start;\n"
+        "\n"
+        "    size_t mismatches = 0;\n"
+        "    start = nn2c_now_secs();\n"
+        "    for (size_t r = 0; r < rows; r++) {\n"
+        "        matrix_copy(NN_INPUT(nn), matrix_row(x, r));\n"
+        "        nn_forward(nn);\n"
+        "        mismatches += memcmp(&MATRIX_AT(NN_OUTPUT(nn), 0, 0), &MATRIX_AT(y, r, 0), %zu * sizeof(float)) != 0;\n"
+        "    }\n"
+        "    double forward = nn2c_now_secs() - start;\n"
+        "\n"
+        "    printf(\"%%zu rows, %%zu mismatches against nn_forward, %s %%.1f ns/row, nn_forward %%.1f ns/row\\n\",\n"
+        "           rows, mismatches, generated / rows * 1e9, forward / rows * 1e9);\n"
+        "    return mismatches != 0;\n"
+        "}\n"
+        "#endif // NN2C_HARNESS\n",
+        model_path, in_cols, out_cols, in_cols, out_cols,
+        in_cols, in_cols, out_cols, out_cols, in_cols, binary ? "rand_float() < 0.5f ? 0.f : 1.f" : "rand_float() * 2 - 1",
+        name, out_cols, name);
+}
+
+int main(int argc, char** argv) {
+    const char* program = args_shift(&argc, &argv);
+    const char* usage = "Usage: %s <model.nn> <output.c> [--name <function>] [--lut]\n";
+    if (argc < 2) {
+        fprintf(stderr, usage, program);
+        return 1;
+    }
+    const char* model_path = args_shift(&argc, &argv);
+    const char* out_path = args_shift(&argc, &argv);
+    const char* name = "predict";
+    bool lut_mode = false;
+    while (argc > 0) {
+        const char* flag = args_shift(&argc, &argv);
+        if (strcmp(flag, "--name") == 0 && argc > 0) {
+            name = args_shift(&argc, &argv);
+        } else if (strcmp(flag, "--lut") == 0) {
+            lut_mode = true;
+        } else {
+            fprintf(stderr, usage, program);
+            return 1;
+        }
+    }
+
+    NN nn = nn_load(model_path);
+    if (nn.count == 0) {
+        fprintf(stderr, "ERROR: could not load model %s\n", model_path);
+        return 1;
+    }
+    NN_LUT lut = {0};
+    if (lut_mode) {
+        lut = nn_lut_compile(nn_model(nn), NULL, 0);
+        if (lut.outputs == NULL) {
+            fprintf(stderr, "ERROR: --lut takes models with at most %d inputs, %s has %zu\n",
+                    NN_LUT_MAX_INPUTS, model_path, NN_INPUT(nn).cols);
+            return 1;
+        }
+    }
+    FILE* out = fopen(out_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: could not open %s for writing\n", out_path);
+        return 1;
+    }
+
+    size_t in_cols = NN_INPUT(nn).cols;
+    size_t out_cols = NN_OUTPUT(nn).cols;
+    fprintf(out, "// Generated by nn2c from %s: %zu", model_path, in_cols);
+    for (size_t l = 0; l < nn.count; l++) fprintf(out, " -> %zu", nn.weights[l].cols);
+    fprintf(out, "\n// %zu parameters. Check against nn_forward with\n", nn_param_count(nn));
+    fprintf(out, "//     cc -O3 -march=native -DNN2C_HARNESS -I<dir of nn.h> %s -lm -lpthread\n", out_path);
+    fprintf(out, "#ifdef NN2C_HARNESS\n");
+    fprintf(out, "#define _GNU_SOURCE // the harness includes nn.h's implementation after the system headers\n");
+    fprintf(out, "#endif\n");
+    if (lut_mode) {
+        fprintf(out, "// A table of all %llu outputs for inputs of 0 or 1, read as input > 0.5. It matches\n", (unsigned long long) lut.count);
+        fprintf(out, "// nn_forward built for the target nn2c was built for\n");
+        fprintf(out, "\nvoid %s(const float* in, float* out);\n\n", name);
+        emit_lut(out, name, lut);
+        nn_lut_free(&lut);
+    } else {
+        fprintf(out, "// predict matches nn_forward built for the same target\n");
+        fprintf(out, "#include <math.h>\n\n");
+        // Spelled out rather than left to contraction, which differs between unrolled copies of a
+        // loop and between -ffp-contract and -std settings
+        fprintf(out, "// The rule of NN_MADD in nn.h, which nn_forward uses: one rounding where the target has fma\n");
+        fprintf(out, "#if defined(__FMA__) || defined(__ARM_FEATURE_FMA)\n");
+        fprintf(out, "#define NN2C_MADD(x, w, acc) fmaf((x), (w), (acc))\n");
+        fprintf(out, "#else\n");
+        fprintf(out, "#define NN2C_MADD(x, w, acc) ((acc) + (x) * (w))\n");
+        fprintf(out, "#endif\n\n");
+        fprintf(out, "void %s(const float* in, float* out);\n\n", name);
+
+        for (size_t l = 0; l < nn.count; l++) {
+            emit_array(out, "nn2c_w", l, nn.weights[l]);
+            emit_array(out, "nn2c_b", l, nn.biases[l]);
+        }
+
+        fprintf(out, "// Same expression as sigmoidf in nn.h\n");
+        fprintf(out, "static inline float nn2c_sigmoidf(float x) {\n    return 1.f / (1.f + expf(-x));\n}\n\n");
+
+        fprintf(out, "void %s(const float* in, float* out) {\n", name);
+        for (size_t l = 0; l + 1 < nn.count; l++) {
+            fprintf(out, "    _Alignas(64) float h%zu[%zu];\n", l + 1, nn.weights[l].cols);
+        }
+        char src[32], dst[32];
+        for (size_t l = 0; l < nn.count; l++) {
+            if (l == 0) {
+                snprintf(src, sizeof(src), "in");
+            } else {
+                snprintf(src, sizeof(src), "h%zu", l);
+            }
+            if (l + 1 == nn.count) {
+                snprintf(dst, sizeof(dst), "out");
+            } else {
+                snprintf(dst, sizeof(dst), "h%zu", l + 1);
+            }
+            if (l > 0) fprintf(out, "\n");
+            emit_layer(out, l, nn.weights[l].rows, nn.weights[l].cols, src, dst);
+        }
+        fprintf(out, "}\n\n");
+    }
+
+    emit_harness(out, model_path, name, in_cols, out_cols, lut_mode);
+
+    bool ok = !ferror(out);
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not write %s\n", out_path);
+        return 1;
+    }
+    printf("wrote %s: %s() for %s, %zu parameters\n", out_path, name, model_path, nn_param_count(nn));
+    nn_free(&nn);
+    return 0;
+}
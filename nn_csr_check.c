@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+// Saves a pruned and sparsified network, which nn_save stores as CSR layers (file version 2),
+// loads it back and compares everything. Then rewrites the CSR image of the first layer in
+// ways a checksum cannot catch, every checksum is recomputed, and expects nn_load to refuse
+// each file. Build it with -fsanitize=address to also catch reads past the CSR arrays
+
+#define KEEP 0.005f             // few enough weights that every one fits in a single row
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); failures++; } } while (0)
+
+static bool same_matrix(matrix a, matrix b) {
+    if (a.rows != b.rows || a.cols != b.cols) return false;
+    for (size_t i = 0; i < a.rows; i++) {
+        if (memcmp(&MATRIX_AT(a, i, 0), &MATRIX_AT(b, i, 0), a.cols * sizeof(float)) != 0) return false;
+    }
+    return true;
+}
+
+static bool same_csr(matrix_csr a, matrix_csr b) {
+    if (a.rows != b.rows || a.cols != b.cols || a.nnz != b.nnz) return false;
+    if (a.row_ptr == NULL || b.row_ptr == NULL) return a.row_ptr == b.row_ptr;
+    return memcmp(a.row_ptr, b.row_ptr, (a.rows + 1) * sizeof(*a.row_ptr)) == 0
+        && memcmp(a.col_idx, b.col_idx, a.nnz * sizeof(*a.col_idx)) == 0
+        && memcmp(a.values, b.values, a.nnz * sizeof(*a.values)) == 0;
+}
+
+static uint8_t* read_file(const char* path, size_t* size) {
+    FILE* in = fopen(path, "rb");
+    NN_ASSERT(in != NULL);
+    fseek(in, 0, SEEK_END);
+    *size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    uint8_t* data = NN_MALLOC(*size);
+    NN_ASSERT(data != NULL && fread(data, 1, *size, in) == *size);
+    fclose(in);
+    return data;
+}
+
+static void write_file(const char* path, const uint8_t* data, size_t size) {
+    FILE* out = fopen(path, "wb");
+    NN_ASSERT(out != NULL && fwrite(data, 1, size, out) == size);
+    fclose(out);
+}
+
+typedef void (*Corrupt)(uint64_t nnz, uint32_t* row_ptr, uint32_t* col_idx, size_t rows);
+
+// Row 0 holds every entry in valid order and the next to last row starts at nnz and ends past it,
+// so expanding row by row would read col_idx out of bounds before any offset looks wrong
+static void corrupt_row_offset(uint64_t nnz, uint32_t* row_ptr, uint32_t* col_idx, size_t rows) {
+    for (size_t p = 0; p < nnz; p++) col_idx[p] = (uint32_t) p;
+    for (size_t r = 1; r + 1 < rows; r++) row_ptr[r] = (uint32_t) nnz;
+    row_ptr[rows - 1] = (uint32_t) nnz + 50;
+}
+
+// Offsets that go backwards
+static void corrupt_row_order(uint64_t nnz, uint32_t* row_ptr, uint32_t* col_idx, size_t rows) {
+    (void) nnz; (void) col_idx;
+    row_ptr[rows / 2] = row_ptr[rows / 2 + 1] + 1;
+}
+
+static void corrupt_column(uint64_t nnz, uint32_t* row_ptr, uint32_t* col_idx, size_t rows) {
+    (void) row_ptr; (void) rows;
+    col_idx[nnz - 1] = 9999;
+}
+
+// Applies corrupt to the first layer's CSR image, fixes up both checksums and tries to load it
+static bool load_corrupted(const char* path, const uint8_t* original, size_t size, Corrupt corrupt) {
+    uint8_t* data = NN_MALLOC(size);
+    NN_ASSERT(data != NULL);
+    memcpy(data, original, size);
+    NN_File_Header header;
+    memcpy(&header, data, sizeof(header));
+    uint64_t* arch = (uint64_t*) (data + sizeof(header));
+    NN_File_Layer* layers = (NN_File_Layer*) (arch + header.layer_count);
+    NN_ASSERT(layers[0].flags & NN_FILE_LAYER_CSR);
+
+    uint8_t* image = data + layers[0].weights_offset;
+    uint64_t nnz;
+    memcpy(&nnz, image, sizeof(nnz));
+    uint32_t* row_ptr = (uint32_t*) (image + sizeof(nnz));
+    uint32_t* col_idx = row_ptr + arch[0] + 1;
+    corrupt(nnz, row_ptr, col_idx, arch[0]);
+    layers[0].weights_checksum = nn__crc32(0, image, nn__csr_file_size(arch[0], nnz));
+    header.checksum = nn__file_prefix_crc32(header, arch, layers);
+    memcpy(data, &header, sizeof(header));
+
+    write_file(path, data, size);
+    free(data);
+    NN nn = nn_load(path);
+    bool loaded = nn.count > 0;
+    if (loaded) nn_free(&nn);
+    return loaded;
+}
+
+int main(void) {
+    nn_seed(69);
+    char path[] = "/tmp/nn_csr_check_XXXXXX";
+    int fd = mkstemp(path);
+    NN_ASSERT(fd >= 0);
+    close(fd);
+
+    size_t architecture[] = { 64, 64, 4 };
+    NN nn = nn_alloc(architecture, ARRAY_SIZE(architecture));
+    nn_randomise(nn, -1, 1);
+    nn_prune_top_k(nn, KEEP);
+    nn_sparsify(&nn, 0.5f);
+    CHECK(nn.sparse != NULL && nn.sparse[0].row_ptr != NULL, "nn_sparsify kept the first layer dense");
+    NN_ASSERT(nn.sparse[0].nnz > 0 && nn.sparse[0].nnz <= nn.weights[0].cols);
+    CHECK(nn_save(path, nn), "nn_save failed");
+
+    NN loaded = nn_load(path);
+    CHECK(loaded.count == nn.count, "nn_load rejected the file nn_save wrote");
+    if (loaded.count == nn.count) {
+        NN_File_Header header;
+        FILE* in = fopen(path, "rb");
+        NN_ASSERT(in != NULL && fread(&header, sizeof(header), 1, in) == 1);
+        fclose(in);
+        CHECK(header.version == NN_FILE_VERSION_CSR, "expected a version %d file, got %u", NN_FILE_VERSION_CSR, header.version);
+        for (size_t i = 0; i < nn.count; i++) {
+            CHECK(same_matrix(nn.weights[i], loaded.weights[i]), "layer %zu weights differ after the round trip", i);
+            CHECK(same_matrix(nn.biases[i], loaded.biases[i]), "layer %zu biases differ after the round trip", i);
+            CHECK(loaded.sparse != NULL && same_csr(nn.sparse[i], loaded.sparse[i]), "layer %zu CSR copy differs after the round trip", i);
+        }
+        nn_free(&loaded);
+    }
+
+    size_t size;
+    uint8_t* original = read_file(path, &size);
+    CHECK(!load_corrupted(path, original, size, corrupt_row_offset), "nn_load accepted a row offset past nnz");
+    CHECK(!load_corrupted(path, original, size, corrupt_row_order), "nn_load accepted decreasing row offsets");
+    CHECK(!load_corrupted(path, original, size, corrupt_column), "nn_load accepted a column past the layer");
+    free(original);
+
+    unlink(path);
+    nn_free(&nn);
+    printf("CSR save/load round trip and corrupt files: %s\n", failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+// The nn.h half of nn_hpp_check. nn.h is C11 and cannot be included from C++,
+// so this is compiled on its own and linked into nn_hpp_check.cpp
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+// Trains a {2, 4, 1} network on the given rows of two inputs and one output, from seed,
+// the way nn_hpp_check.cpp trains nn::Network<2, 4, 1>. Writes the cost after every
+// iteration into costs, the final nn_params_get vector into params and the model to path
+bool nn_hpp_check_reference(const float* rows, size_t count, uint64_t seed, size_t iterations, float rate,
+                            float* costs, float* params, const char* path) {
+    matrix t = matrix_data_alloc((float*) rows, count, 3, 3);
+    matrix ti = matrix_cols(t, 0, 2);
+    matrix to = matrix_cols(t, 2, 1);
+    size_t architecture[] = { 2, 4, 1 };
+    NN nn = nn_alloc(architecture, ARRAY_SIZE(architecture));
+    NN g = nn_alloc(architecture, ARRAY_SIZE(architecture));
+    nn_seed(seed);
+    nn_randomise(nn, 0, 1);
+    for (size_t i = 0; i < iterations; i++) {
+        nn_backprop(nn, &g, ti, to);
+        nn_learn(nn, g, rate);
+        costs[i] = nn_cost(nn, ti, to);
+    }
+    nn_params_get(nn, params);
+    bool ok = nn_save(path, nn);
+    nn_free(&nn);
+    nn_free(&g);
+    return ok;
+}
@@ -0,0 +1,119 @@
+// Checks that nn.hpp computes the same bits as nn.h. Both train xor from the same seed,
+// then every cost, every parameter and the saved model files are compared, and nn.hpp
+// loads the file nn_save wrote. Build both halves for the same target, since whether
+// multiply-adds are fused depends on it
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+#include "nn.hpp"
+
+extern "C" bool nn_hpp_check_reference(const float* rows, std::size_t count, std::uint64_t seed, std::size_t iterations,
+                                       float rate, float* costs, float* params, const char* path);
+
+#define SEED 69
+#define ITERATIONS 5000
+#define RATE 1.0f
+
+static std::vector<char> read_file(const char* path) {
+    std::vector<char> data;
+    std::FILE* in = std::fopen(path, "rb");
+    if (in == nullptr) return data;
+    char buffer[4096];
+    for (std::size_t n; (n = std::fread(buffer, 1, sizeof(buffer), in)) > 0; ) data.insert(data.end(), buffer, buffer + n);
+    std::fclose(in);
+    return data;
+}
+
+// An empty file of a fresh name in /tmp, removed again by main
+static bool temp_path(char* path) {
+    int fd = mkstemp(path);
+    if (fd < 0) return false;
+    close(fd);
+    return true;
+}
+
+static bool same_bits(float a, float b) {
+    return std::memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+int main(void) {
+    using Net = nn::Network<2, 4, 1>;
+    const float rows[] = {
+        0, 0, 0,
+        0, 1, 1,
+        1, 0, 1,
+        1, 1, 0,
+    };
+    const std::size_t count = sizeof(rows) / sizeof(rows[0]) / 3;
+    nn::Rows<2> ti{rows, count, 3};
+    nn::Rows<1> to{rows + 2, count, 3};
+
+    char c_path[] = "/tmp/nn_hpp_check_c_XXXXXX";
+    char cpp_path[] = "/tmp/nn_hpp_check_cpp_XXXXXX";
+    if (!temp_path(c_path) || !temp_path(cpp_path)) {
+        std::fprintf(stderr, "ERROR: could not create temporary files in /tmp\n");
+        return 1;
+    }
+
+    std::vector<float> c_costs(ITERATIONS), c_params(Net::param_count);
+    int failures = 0;
+    if (!nn_hpp_check_reference(rows, count, SEED, ITERATIONS, RATE, c_costs.data(), c_params.data(), c_path)) {
+        std::fprintf(stderr, "ERROR: nn_save could not write %s\n", c_path);
+        failures++;
+    }
+
+    Net net, g;
+    std::uint64_t state = SEED;
+    net.randomise(0, 1, state);
+    for (std::size_t i = 0; i < ITERATIONS; i++) {
+        net.backprop(g, ti, to);
+        net.learn(g, RATE);
+        float cost = net.cost(ti, to);
+        if (!same_bits(cost, c_costs[i])) {
+            std::fprintf(stderr, "cost differs after iteration %zu: nn.hpp %a, nn.h %a\n", i, cost, c_costs[i]);
+            failures++;
+            break;
+        }
+    }
+    if (!net.save(cpp_path)) {
+        std::fprintf(stderr, "ERROR: Network::save could not write %s\n", cpp_path);
+        failures++;
+    }
+
+    Net loaded;
+    if (!loaded.load(c_path)) {
+        std::fprintf(stderr, "nn.hpp could not load the model nn_save wrote\n");
+        failures++;
+    } else {
+        const float* p = c_params.data();
+        std::size_t differing = 0;
+        auto compare = [&](const auto& a, const auto& b) {
+            for (std::size_t i = 0; i < a.size(); i++, p++) {
+                if (!same_bits(a[i], *p) || !same_bits(b[i], *p)) differing++;
+            }
+        };
+        compare(loaded.layer<0>().weights, net.layer<0>().weights);
+        compare(loaded.layer<0>().biases, net.layer<0>().biases);
+        compare(loaded.layer<1>().weights, net.layer<1>().weights);
+        compare(loaded.layer<1>().biases, net.layer<1>().biases);
+        if (differing > 0) {
+            std::fprintf(stderr, "%zu of %zu parameters differ\n", differing, Net::param_count);
+            failures++;
+        }
+    }
+    if (read_file(c_path) != read_file(cpp_path)) {
+        std::fprintf(stderr, "nn_save and Network::save wrote different files\n");
+        failures++;
+    }
+
+    unlink(c_path);
+    unlink(cpp_path);
+
+    std::printf("nn.hpp vs nn.h, xor {2, 4, 1}, %d iterations: %s (cost %f)\n", ITERATIONS, failures == 0 ? "identical" : "DIFFERENT",
+           c_costs[ITERATIONS - 1]);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+// Reader threads enter and leave the registry in a tight loop while the main thread keeps
+// publishing. Every parameter of the model published as version v is v, so a reader that
+// is handed an entry which was freed, reused or only partly written sees the wrong numbers.
+// Versions seen by one reader must never go backwards. Build it with -fsanitize=thread or
+// -fsanitize=address to also catch the race or the use after free itself
+
+#define READERS 4
+#define PUBLISHES 2000
+#define HOLD_EVERY 16           // every so many entries a reader yields while inside, to stretch the grace period
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); failures++; } } while (0)
+
+typedef struct {
+    NN_Registry* registry;
+    size_t slot;
+    atomic_bool* done;
+    _Atomic size_t* running;    // readers that have been inside at least once
+    size_t entries;             // entries checked
+    size_t wrong;               // entries whose parameters were not their version
+    size_t backwards;           // entries older than the one before
+    uint64_t last_version;
+} Reader;
+
+static NN model_of_version(uint64_t version) {
+    size_t architecture[] = { 8, 16, 4 };
+    NN nn = nn_alloc(architecture, ARRAY_SIZE(architecture));
+    for (size_t i = 0; i < nn.count; i++) {
+        matrix_fill(nn.weights[i], (float) version);
+        matrix_fill(nn.biases[i], (float) version);
+    }
+    return nn;
+}
+
+static bool holds_version(NN nn, uint64_t version) {
+    for (size_t i = 0; i < nn.count; i++) {
+        for (size_t r = 0; r < nn.weights[i].rows; r++) {
+            for (size_t c = 0; c < nn.weights[i].cols; c++) {
+                if (MATRIX_AT(nn.weights[i], r, c) != (float) version) return false;
+            }
+        }
+        for (size_t c = 0; c < nn.biases[i].cols; c++) {
+            if (MATRIX_AT(nn.biases[i], 0, c) != (float) version) return false;
+        }
+    }
+    return true;
+}
+
+static void* reader_run(void* arg) {
+    Reader* r = arg;
+    while (!atomic_load(r -> done)) {
+        const NN_Registry_Entry* entry = nn_registry_enter(r -> registry, r -> slot);
+        uint64_t version = entry -> version;
+        if (r -> entries % HOLD_EVERY == 0) sched_yield();
+        if (!holds_version(entry -> nn, version)) r -> wrong++;
+        if (version < r -> last_version) r -> backwards++;
+        r -> last_version = version;
+        nn_registry_exit(r -> registry, r -> slot);
+        if (r -> entries++ == 0) atomic_fetch_add(r -> running, 1);
+    }
+    return NULL;
+}
+
+int main(void) {
+    NN_Registry registry = nn_registry_alloc("nn_registry_check");
+    CHECK(nn_registry_publish(&registry, model_of_version(1)), "the first publish failed");
+
+    atomic_bool done = false;
+    _Atomic size_t running = 0;
+    Reader readers[READERS] = {0};
+    pthread_t threads[READERS];
+    for (size_t i = 0; i < READERS; i++) {
+        readers[i] = (Reader) { .registry = &registry, .slot = nn_registry_reader(&registry), .done = &done, .running = &running };
+        int err = pthread_create(&threads[i], NULL, reader_run, &readers[i]);
+        NN_ASSERT(err == 0);
+        (void) err;
+    }
+
+    // Publishing only starts once every reader is in the loop, and yields in between, so the
+    // readers overlap the publishes even on a single core
+    while (atomic_load(&running) < READERS) sched_yield();
+    size_t refused = 0;
+    for (uint64_t v = 2; v <= PUBLISHES; v++) {
+        NN nn = model_of_version(v);
+        if (!nn_registry_publish(&registry, nn)) {
+            nn_free(&nn);
+            refused++;
+        }
+        sched_yield();
+    }
+    atomic_store(&done, true);
+    for (size_t i = 0; i < READERS; i++) pthread_join(threads[i], NULL);
+
+    CHECK(refused == 0, "%zu publishes were refused", refused);
+    CHECK(atomic_load(&registry.current) -> version == PUBLISHES, "ended at version %llu, expected %d",
+          (unsigned long long) atomic_load(&registry.current) -> version, PUBLISHES);
+    size_t entries = 0;
+    for (size_t i = 0; i < READERS; i++) {
+        entries += readers[i].entries;
+        CHECK(readers[i].wrong == 0, "reader %zu saw %zu entries whose parameters were not their version", i, readers[i].wrong);
+        CHECK(readers[i].backwards == 0, "reader %zu saw the version go backwards %zu times", i, readers[i].backwards);
+    }
+    nn_registry_free(&registry);
+
+    printf("registry, %d readers over %d publishes, %zu entries read: %s\n", READERS, PUBLISHES, entries,
+           failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
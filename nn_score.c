@@ -0,0 +1,340 @@
+// Scores a stream of rows with a model saved by nn_save and streams the outputs to stdout.
+//
+// The input, a file or stdin, is either a .mat written by matrix_save with in_cols columns
+// or bare native float rows of in_cols each; out_cols floats per row are written in input
+// order. The main thread reads batches into a ring of slots, workers score any filled slot
+// and a writer thread drains them in order, so memory is the ring and nothing else and a
+// slow consumer stalls the reader once every slot is waiting to be written.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+typedef enum {
+    SLOT_FREE,                  // owned by the reader
+    SLOT_FILLED,                // waiting for a worker
+    SLOT_DONE,                  // waiting for the writer
+} Slot_State;
+
+typedef struct {
+    Slot_State state;
+    size_t seq;                 // batch number, the slot is reused for seq + slot_count
+    size_t rows;
+    float* in;                  // batch_rows * in_cols
+    float* out;                 // batch_rows * out_cols
+} Slot;
+
+typedef struct {
+    int fd;
+    bool regular;               // a file whose consumed pages can be dropped from the cache
+    bool mat;
+    size_t remaining;           // rows left in a .mat
+    uint8_t head[8];            // bytes read while probing for the .mat magic, not consumed yet
+    size_t head_count;
+    off_t offset;
+    bool failed;
+} Input;
+
+typedef struct {
+    NN_Model model;
+    size_t in_cols;
+    size_t out_cols;
+    size_t batch_rows;
+    Slot* slots;
+    size_t slot_count;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // a slot changed state, the input ended or something failed
+    size_t next_work;           // the next batch a worker claims
+    size_t end_seq;             // batches in the whole input, SIZE_MAX until the reader hits the end
+    bool failed;
+    int write_errno;            // why the writer failed
+    int out_fd;
+    size_t rows_written;
+} Pipeline;
+
+char* args_shift(int* argc, char*** argv) {
+    assert(*argc > 0);
+    char* result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Short only at the end of the input or on an error
+static size_t read_full(Input* in, void* buffer, size_t size) {
+    size_t got = 0;
+    if (in->head_count > 0) {
+        got = in->head_count < size ? in->head_count : size;
+        memcpy(buffer, in->head, got);
+        memmove(in->head, in->head + got, in->head_count - got);
+        in->head_count -= got;
+    }
+    while (got < size) {
+        ssize_t n = read(in->fd, (uint8_t*) buffer + got, size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) in->failed = true;
+        if (n <= 0) break;
+        got += n;
+        in->offset += n;
+    }
+    return got;
+}
+
+static bool write_full(int fd, const void* buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, (const uint8_t*) buffer + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Recognises a .mat by its header, anything else is bare rows starting at the first byte
+static bool input_open(Input* in, const char* path, size_t in_cols) {
+    in->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (in->fd < 0) return false;
+    struct stat st;
+    in->regular = fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (in->regular) posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    in->head_count = read_full(in, in->head, sizeof(in->head));
+    if (in->head_count == sizeof(in->head) && memcmp(in->head, "nn.h.mtz", 8) == 0) {
+        fprintf(stderr, "ERROR: %s is a compressed .mat, convert it with matrix_load and matrix_save first\n", path);
+        return false;
+    }
+    if (in->head_count == sizeof(in->head) && memcmp(in->head, "nn.h.mat", 8) == 0) {
+        in->head_count = 0;
+        size_t shape[2];
+        if (read_full(in, shape, sizeof(shape)) != sizeof(shape)) return false;
+        if (shape[1] != in_cols) {
+            fprintf(stderr, "ERROR: %s has %zu columns, the model takes %zu\n", path, shape[1], in_cols);
+            return false;
+        }
+        in->mat = true;
+        in->remaining = shape[0];
+    }
+    return !in->failed;
+}
+
+// Rows read into buffer, 0 at the end of the input. A trailing partial row is an error
+static size_t input_read(Input* in, float* buffer, size_t max_rows, size_t in_cols) {
+    size_t rows = max_rows;
+    if (in->mat && in->remaining < rows) rows = in->remaining;
+    size_t row_bytes = in_cols * sizeof(float);
+    size_t got = read_full(in, buffer, rows * row_bytes);
+    if (got % row_bytes != 0 || (in->mat && got < rows * row_bytes)) in->failed = true;
+    if (in->mat) in->remaining -= got / row_bytes;
+    // Pages behind the read position are not needed again, so a scan of an input larger
+    // than RAM does not push everything else out of the page cache
+    if (in->regular && in->offset > (off_t) (1 << 24)) {
+        posix_fadvise(in->fd, 0, in->offset - (1 << 24), POSIX_FADV_DONTNEED);
+    }
+    return got / row_bytes;
+}
+
+static void* worker(void* arg) {
+    Pipeline* p = arg;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        size_t seq = p->next_work;
+        Slot* slot = &p->slots[seq % p->slot_count];
+        if (p->failed || seq >= p->end_seq) break;
+        if (slot->state != SLOT_FILLED || slot->seq != seq) {
+            pthread_cond_wait(&p->changed, &p->lock);
+            continue;
+        }
+        p->next_work += 1;
+        pthread_mutex_unlock(&p->lock);
+
+        matrix x = matrix_data_alloc(slot->in, slot->rows, p->in_cols, p->in_cols);
+        matrix y = matrix_data_alloc(slot->out, slot->rows, p->out_cols, p->out_cols);
+        nn_predict(p->model, x, y);
+
+        pthread_mutex_lock(&p->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void* writer(void* arg) {
+    Pipeline* p = arg;
+    for (size_t seq = 0;; seq++) {
+        Slot* slot = &p->slots[seq % p->slot_count];
+        pthread_mutex_lock(&p->lock);
+        while (!p->failed && seq < p->end_seq && !(slot->state == SLOT_DONE && slot->seq == seq)) {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        bool stop = p->failed || seq >= p->end_seq;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) break;
+
+        bool ok = write_full(p->out_fd, slot->out, slot->rows * p->out_cols * sizeof(float));
+        int error = errno;
+
+        pthread_mutex_lock(&p->lock);
+        if (ok) {
+            p->rows_written += slot->rows;
+            slot->state = SLOT_FREE;
+        } else {
+            p->failed = true;
+            p->write_errno = error;
+        }
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    const char* program = args_shift(&argc, &argv);
+    const char* usage = "Usage: %s <model.nn> [input.mat|input.f32|-] [--threads <n>] [--batch <rows>] [--mat]\n";
+    if (argc < 1) {
+        fprintf(stderr, usage, program);
+        return 1;
+    }
+    const char* model_path = args_shift(&argc, &argv);
+    const char* in_path = "-";
+    if (argc > 0 && (argv[0][0] != '-' || argv[0][1] == '\0')) in_path = args_shift(&argc, &argv);
+
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t batch_rows = 1024;
+    bool mat_output = false;
+    while (argc > 0) {
+        const char* flag = args_shift(&argc, &argv);
+        if (strcmp(flag, "--threads") == 0 && argc > 0) {
+            thread_count = strtol(args_shift(&argc, &argv), NULL, 10);
+        } else if (strcmp(flag, "--batch") == 0 && argc > 0) {
+            batch_rows = strtoul(args_shift(&argc, &argv), NULL, 10);
+        } else if (strcmp(flag, "--mat") == 0) {
+            mat_output = true;
+        } else {
+            fprintf(stderr, usage, program);
+            return 1;
+        }
+    }
+    if (thread_count < 1) thread_count = 1;
+    if (batch_rows < 1) batch_rows = 1;
+
+    // Mapped rather than loaded, the workers only read the weights. Models with CSR layers
+    // cannot be mapped and are loaded instead
+    NN nn = nn_map(model_path);
+    bool mapped = nn.count > 0;
+    if (!mapped) nn = nn_load(model_path);
+    if (nn.count == 0) {
+        fprintf(stderr, "ERROR: could not load model %s\n", model_path);
+        return 1;
+    }
+    Pipeline p = {
+        .model = nn_model(nn),
+        .in_cols = NN_INPUT(nn).cols,
+        .out_cols = NN_OUTPUT(nn).cols,
+        .batch_rows = batch_rows,
+        .slot_count = 2 * thread_count + 2,
+        .end_seq = SIZE_MAX,
+        .out_fd = STDOUT_FILENO,
+    };
+
+    Input in = {0};
+    if (!input_open(&in, in_path, p.in_cols)) {
+        fprintf(stderr, "ERROR: could not read %s\n", in_path);
+        return 1;
+    }
+    // The row count goes first in a .mat, so only a .mat input can become a .mat output
+    if (mat_output) {
+        if (!in.mat) {
+            fprintf(stderr, "ERROR: --mat needs a .mat input\n");
+            return 1;
+        }
+        size_t shape[2] = { in.remaining, p.out_cols };
+        if (!write_full(p.out_fd, "nn.h.mat", 8) || !write_full(p.out_fd, shape, sizeof(shape))) {
+            fprintf(stderr, "ERROR: could not write the output\n");
+            return 1;
+        }
+    }
+
+    p.slots = calloc(p.slot_count, sizeof(*p.slots));
+    assert(p.slots != NULL);
+    for (size_t i = 0; i < p.slot_count; i++) {
+        p.slots[i].in = NN_MALLOC(batch_rows * p.in_cols * sizeof(float));
+        p.slots[i].out = NN_MALLOC(batch_rows * p.out_cols * sizeof(float));
+        assert(p.slots[i].in != NULL && p.slots[i].out != NULL);
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.changed, NULL);
+
+    double start = now_secs();
+    pthread_t* workers = malloc(thread_count * sizeof(*workers));
+    pthread_t writer_thread;
+    assert(workers != NULL);
+    for (long i = 0; i < thread_count; i++) pthread_create(&workers[i], NULL, worker, &p);
+    pthread_create(&writer_thread, NULL, writer, &p);
+
+    size_t batches = 0;
+    while (!in.failed) {
+        Slot* slot = &p.slots[batches % p.slot_count];
+        pthread_mutex_lock(&p.lock);
+        while (!p.failed && slot->state != SLOT_FREE) pthread_cond_wait(&p.changed, &p.lock);
+        bool stop = p.failed;
+        pthread_mutex_unlock(&p.lock);
+        if (stop) break;
+
+        size_t rows = input_read(&in, slot->in, batch_rows, p.in_cols);
+        if (rows == 0) break;
+
+        pthread_mutex_lock(&p.lock);
+        slot->seq = batches;
+        slot->rows = rows;
+        slot->state = SLOT_FILLED;
+        pthread_cond_broadcast(&p.changed);
+        pthread_mutex_unlock(&p.lock);
+        batches += 1;
+    }
+    pthread_mutex_lock(&p.lock);
+    p.end_seq = batches;
+    pthread_cond_broadcast(&p.changed);
+    pthread_mutex_unlock(&p.lock);
+
+    for (long i = 0; i < thread_count; i++) pthread_join(workers[i], NULL);
+    pthread_join(writer_thread, NULL);
+    double secs = now_secs() - start;
+
+    int status = 0;
+    if (in.failed) {
+        fprintf(stderr, "ERROR: %s ended in a partial row or could not be read\n", in_path);
+        status = 1;
+    }
+    if (p.failed) {
+        fprintf(stderr, "ERROR: could not write the output: %s\n", strerror(p.write_errno));
+        status = 1;
+    }
+    fprintf(stderr, "%zu rows, %zu -> %zu, in %.3f s: %.0f rows/s (%.1f MB/s in) on %ld threads\n",
+            p.rows_written, p.in_cols, p.out_cols, secs, p.rows_written / secs,
+            p.rows_written * p.in_cols * sizeof(float) / secs / 1e6, thread_count);
+
+    for (size_t i = 0; i < p.slot_count; i++) {
+        free(p.slots[i].in);
+        free(p.slots[i].out);
+    }
+    free(p.slots);
+    free(workers);
+    if (in.fd != STDIN_FILENO) close(in.fd);
+    if (mapped) {
+        nn_unmap(&nn);
+    } else {
+        nn_free(&nn);
+    }
+    return status;
+}
@@ -0,0 +1,419 @@
+// Inference daemon for models saved with nn_save, or published with nn_shm as shm:<name>.
+//
+// Protocol, over a SOCK_STREAM Unix socket in native byte order: on connect the server
+// sends two uint32_t, the input and output widths of the model. The client then sends
+// any number of requests of in_cols floats each and receives out_cols floats per request,
+// in request order. Requests from all connections are coalesced into one batch until
+// either --max-batch rows are waiting or the oldest has waited --max-wait-us.
+//
+// The model is reloaded without stopping when the file or segment changes (checked every
+// --watch-ms, 0 turns it off) or on SIGHUP. A model with different input or output widths is refused.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+#define MAX_CLIENTS 1024
+#define READ_CHUNK (64 * 1024)
+#define LATENCY_SAMPLES (1 << 16)
+#define OUT_LIMIT_BATCHES 4     // answers a client may leave unread, in full batches, before it is not read any further
+
+typedef struct {
+    int fd;                     // -1 for a free slot
+    uint32_t generation;        // bumped on close so answers for a gone client are dropped
+    uint8_t* in;                // the request being received, request_bytes long
+    size_t in_count;
+    uint8_t* out;               // answers the socket did not take yet
+    size_t out_count;
+    size_t out_capacity;
+} Client;
+
+typedef struct {
+    size_t client;
+    uint32_t generation;
+    double arrival;
+} Pending;
+
+typedef struct {
+    NN_Registry registry;
+    size_t reader;              // registry slot of the serving thread
+    NN_Context ctx;
+    size_t in_cols;
+    size_t out_cols;
+    size_t max_batch;
+    double max_wait;            // seconds
+    size_t out_limit;           // bytes of unread answers past which a client's requests wait in its socket
+    matrix x;                   // max_batch rows, row i belongs to pending[i]
+    matrix y;
+    Pending* pending;
+    size_t pending_count;
+    Client clients[MAX_CLIENTS];
+
+    size_t requests;            // since the last report
+    size_t batches;
+    float* latencies;           // microseconds, ring of the most recent LATENCY_SAMPLES
+    size_t latency_count;
+} Server;
+
+// Shared by the serving and reload threads, lock free so the signal handler may set them
+static atomic_bool quit = false;
+static atomic_bool reload_requested = false;
+
+static void on_signal(int sig) {
+    if (sig == SIGHUP) {
+        atomic_store(&reload_requested, true);
+    } else {
+        atomic_store(&quit, true);
+    }
+}
+
+char* args_shift(int* argc, char*** argv) {
+    assert(*argc > 0);
+    char* result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static void client_close(Client* c) {
+    close(c->fd);
+    c->fd = -1;
+    c->generation += 1;
+    c->in_count = 0;
+    c->out_count = 0;
+}
+
+static void client_queue(Client* c, const void* data, size_t size) {
+    if (c->out_count + size > c->out_capacity) {
+        while (c->out_count + size > c->out_capacity) c->out_capacity = c->out_capacity == 0 ? 4096 : c->out_capacity * 2;
+        c->out = realloc(c->out, c->out_capacity);
+        assert(c->out != NULL && "More RAM Needed");
+    }
+    memcpy(c->out + c->out_count, data, size);
+    c->out_count += size;
+}
+
+// Writes what the socket takes, the rest waits for POLLOUT
+static void client_flush(Client* c) {
+    size_t done = 0;
+    while (done < c->out_count) {
+        ssize_t n = write(c->fd, c->out + done, c->out_count - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client_close(c);
+                return;
+            }
+            break;
+        }
+        done += n;
+    }
+    memmove(c->out, c->out + done, c->out_count - done);
+    c->out_count -= done;
+}
+
+// One forward pass over everything pending, answers go back in arrival order
+static void run_batch(Server* s) {
+    size_t n = s->pending_count;
+    if (n == 0) return;
+    const NN_Registry_Entry* entry = nn_registry_enter(&s->registry, s->reader);
+    if (s->ctx.width < entry->model.width) {
+        nn_context_free(&s->ctx);
+        s->ctx = nn_context_alloc(entry->model, s->max_batch);
+    }
+    nn_infer(entry->model, &s->ctx,
+             matrix_data_alloc(s->x.elements, n, s->x.cols, s->x.stride),
+             matrix_data_alloc(s->y.elements, n, s->y.cols, s->y.stride));
+    nn_registry_exit(&s->registry, s->reader);
+    for (size_t i = 0; i < n; i++) {
+        Client* c = &s->clients[s->pending[i].client];
+        if (c->fd >= 0 && c->generation == s->pending[i].generation) {
+            client_queue(c, &MATRIX_AT(s->y, i, 0), s->out_cols * sizeof(float));
+        }
+    }
+    double done = now_secs();
+    for (size_t i = 0; i < n; i++) {
+        Client* c = &s->clients[s->pending[i].client];
+        if (c->fd >= 0 && c->out_count > 0) client_flush(c);
+        s->latencies[s->latency_count % LATENCY_SAMPLES] = (done - s->pending[i].arrival) * 1e6;
+        s->latency_count += 1;
+    }
+    s->requests += n;
+    s->batches += 1;
+    s->pending_count = 0;
+}
+
+// Reads everything available, every complete request lands in the next row of the batch
+static void client_read(Server* s, size_t index, double now) {
+    Client* c = &s->clients[index];
+    size_t request_bytes = s->in_cols * sizeof(float);
+    static uint8_t chunk[READ_CHUNK];
+    for (;;) {
+        // A client that does not read its answers is not read either, until client_flush catches up
+        if (c->out_count >= s->out_limit) return;
+        ssize_t n = read(c->fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            client_close(c);
+            return;
+        }
+        for (size_t at = 0; at < (size_t) n;) {
+            size_t take = request_bytes - c->in_count;
+            if (take > (size_t) n - at) take = n - at;
+            memcpy(c->in + c->in_count, chunk + at, take);
+            c->in_count += take;
+            at += take;
+            if (c->in_count < request_bytes) break;
+            c->in_count = 0;
+            memcpy(&MATRIX_AT(s->x, s->pending_count, 0), c->in, request_bytes);
+            s->pending[s->pending_count++] = (Pending) { .client = index, .generation = c->generation, .arrival = now };
+            if (s->pending_count == s->max_batch) run_batch(s);
+            if (c->fd < 0) return;
+        }
+    }
+}
+
+static void accept_clients(Server* s, int listen_fd) {
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        size_t slot = 0;
+        while (slot < MAX_CLIENTS && s->clients[slot].fd >= 0) slot++;
+        if (slot == MAX_CLIENTS || !set_nonblocking(fd)) {
+            fprintf(stderr, "WARNING: refusing connection, %d clients already connected\n", MAX_CLIENTS);
+            close(fd);
+            continue;
+        }
+        Client* c = &s->clients[slot];
+        c->fd = fd;
+        uint32_t hello[2] = { (uint32_t) s->in_cols, (uint32_t) s->out_cols };
+        client_queue(c, hello, sizeof(hello));
+        client_flush(c);
+    }
+}
+
+typedef struct {
+    NN_Registry* registry;
+    long watch_ms;
+} Reloader;
+
+// Loads and publishes new models off the serving thread, which never waits for it
+static void* reload_worker(void* arg) {
+    Reloader* r = arg;
+    double last_check = now_secs();
+    while (!quit) {
+        nanosleep(&(struct timespec) { .tv_nsec = 10 * 1000 * 1000 }, NULL);
+        bool check = r->watch_ms > 0 && now_secs() - last_check >= r->watch_ms * 1e-3;
+        if (!reload_requested && !check) continue;
+        last_check = now_secs();
+        bool forced = atomic_exchange(&reload_requested, false);
+        if (!forced && !nn_registry_changed(r->registry)) continue;
+        double start = now_secs();
+        if (nn_registry_reload(r->registry)) {
+            const NN_Registry_Entry* entry = atomic_load(&r->registry->current);
+            printf("reloaded %s as version %llu in %.3f ms\n", r->registry->path,
+                   (unsigned long long) entry->version, (now_secs() - start) * 1e3);
+        } else {
+            fprintf(stderr, "WARNING: could not reload %s, still serving the previous model\n", r->registry->path);
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+static int compare_floats(const void* a, const void* b) {
+    float x = *(const float*) a;
+    float y = *(const float*) b;
+    return (x > y) - (x < y);
+}
+
+static void report(Server* s, double secs) {
+    size_t count = s->latency_count < LATENCY_SAMPLES ? s->latency_count : LATENCY_SAMPLES;
+    float p50 = 0, p99 = 0;
+    if (count > 0) {
+        qsort(s->latencies, count, sizeof(float), compare_floats);
+        p50 = s->latencies[count / 2];
+        p99 = s->latencies[count * 99 / 100];
+    }
+    printf("%zu requests in %zu batches (%.1f rows per batch), %.0f req/s, latency p50 %.0f us p99 %.0f us\n",
+           s->requests, s->batches, s->batches > 0 ? (double) s->requests / s->batches : 0.0,
+           s->requests / secs, p50, p99);
+    fflush(stdout);
+    s->requests = 0;
+    s->batches = 0;
+    s->latency_count = 0;
+}
+
+int main(int argc, char** argv) {
+    const char* program = args_shift(&argc, &argv);
+    const char* usage = "Usage: %s <model.nn|shm:name> <socket path> [--max-batch <rows>] [--max-wait-us <us>] [--report-secs <s>] [--watch-ms <ms>]\n";
+    if (argc < 2) {
+        fprintf(stderr, usage, program);
+        return 1;
+    }
+    const char* model_path = args_shift(&argc, &argv);
+    const char* socket_path = args_shift(&argc, &argv);
+
+    size_t max_batch = 64;
+    long max_wait_us = 200;
+    double report_secs = 5;
+    long watch_ms = 500;
+    while (argc > 0) {
+        const char* flag = args_shift(&argc, &argv);
+        if (strcmp(flag, "--max-batch") == 0 && argc > 0) {
+            max_batch = strtoul(args_shift(&argc, &argv), NULL, 10);
+        } else if (strcmp(flag, "--max-wait-us") == 0 && argc > 0) {
+            max_wait_us = strtol(args_shift(&argc, &argv), NULL, 10);
+        } else if (strcmp(flag, "--report-secs") == 0 && argc > 0) {
+            report_secs = strtod(args_shift(&argc, &argv), NULL);
+        } else if (strcmp(flag, "--watch-ms") == 0 && argc > 0) {
+            watch_ms = strtol(args_shift(&argc, &argv), NULL, 10);
+        } else {
+            fprintf(stderr, usage, program);
+            return 1;
+        }
+    }
+    if (max_batch < 1) max_batch = 1;
+    if (max_wait_us < 0) max_wait_us = 0;
+    if (report_secs <= 0) report_secs = 5;
+
+    static Server s;
+    s.registry = nn_registry_alloc(model_path);
+    if (!nn_registry_reload(&s.registry)) {
+        fprintf(stderr, "ERROR: could not load model %s\n", model_path);
+        return 1;
+    }
+    s.reader = nn_registry_reader(&s.registry);
+    const NN_Registry_Entry* first = nn_registry_enter(&s.registry, s.reader);
+    s.ctx = nn_context_alloc(first->model, max_batch);
+    s.in_cols = NN_INPUT(first->nn).cols;
+    s.out_cols = NN_OUTPUT(first->nn).cols;
+    nn_registry_exit(&s.registry, s.reader);
+    s.max_batch = max_batch;
+    s.max_wait = max_wait_us * 1e-6;
+    s.out_limit = OUT_LIMIT_BATCHES * max_batch * s.out_cols * sizeof(float);
+    s.x = matrix_alloc(max_batch, s.in_cols, s.in_cols);
+    s.y = matrix_alloc(max_batch, s.out_cols, s.out_cols);
+    s.pending = malloc(max_batch * sizeof(*s.pending));
+    s.latencies = malloc(LATENCY_SAMPLES * sizeof(*s.latencies));
+    assert(s.pending != NULL && s.latencies != NULL);
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        s.clients[i].fd = -1;
+        s.clients[i].in = malloc(s.in_cols * sizeof(float));
+        assert(s.clients[i].in != NULL);
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: socket path %s is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+        || listen(listen_fd, SOMAXCONN) != 0 || !set_nonblocking(listen_fd)) {
+        fprintf(stderr, "ERROR: could not listen on %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGHUP, on_signal);
+
+    Reloader reloader = { .registry = &s.registry, .watch_ms = watch_ms };
+    pthread_t reload_thread;
+    if (pthread_create(&reload_thread, NULL, reload_worker, &reloader) != 0) {
+        fprintf(stderr, "ERROR: could not start the reload thread\n");
+        return 1;
+    }
+
+    printf("serving %s (%zu -> %zu) on %s, max batch %zu, max wait %ld us\n",
+           model_path, s.in_cols, s.out_cols, socket_path, max_batch, max_wait_us);
+    fflush(stdout);
+
+    static struct pollfd fds[MAX_CLIENTS + 1];
+    static size_t fd_client[MAX_CLIENTS + 1];
+    double last_report = now_secs();
+    while (!quit) {
+        size_t fd_count = 0;
+        fds[fd_count++] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+        for (size_t i = 0; i < MAX_CLIENTS; i++) {
+            Client* c = &s.clients[i];
+            if (c->fd < 0) continue;
+            fd_client[fd_count] = i;
+            short events = (c->out_count < s.out_limit ? POLLIN : 0) | (c->out_count > 0 ? POLLOUT : 0);
+            fds[fd_count++] = (struct pollfd) { .fd = c->fd, .events = events };
+        }
+
+        // Sleep until the oldest pending request is due, or the next report
+        double now = now_secs();
+        double wake = last_report + report_secs;
+        if (s.pending_count > 0 && s.pending[0].arrival + s.max_wait < wake) wake = s.pending[0].arrival + s.max_wait;
+        double wait = wake > now ? wake - now : 0;
+        struct timespec timeout = { .tv_sec = (time_t) wait, .tv_nsec = (long) ((wait - (time_t) wait) * 1e9) };
+        int ready = ppoll(fds, fd_count, &timeout, NULL);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "ERROR: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        now = now_secs();
+        for (size_t i = 1; ready > 0 && i < fd_count; i++) {
+            Client* c = &s.clients[fd_client[i]];
+            if (c->fd != fds[i].fd) continue;
+            if (fds[i].revents & POLLOUT) client_flush(c);
+            if (c->fd >= 0 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) client_read(&s, fd_client[i], now);
+        }
+        if (ready > 0 && (fds[0].revents & POLLIN)) accept_clients(&s, listen_fd);
+
+        now = now_secs();
+        if (s.pending_count > 0 && now >= s.pending[0].arrival + s.max_wait) run_batch(&s);
+        if (now >= last_report + report_secs) {
+            if (s.requests > 0) report(&s, now - last_report);
+            last_report = now;
+        }
+    }
+
+    run_batch(&s);
+    if (s.requests > 0) report(&s, now_secs() - last_report);
+    atomic_store(&quit, true);
+    pthread_join(reload_thread, NULL);
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        if (s.clients[i].fd >= 0) client_close(&s.clients[i]);
+        free(s.clients[i].in);
+        free(s.clients[i].out);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    free(s.pending);
+    free(s.latencies);
+    matrix_free(&s.x);
+    matrix_free(&s.y);
+    nn_context_free(&s.ctx);
+    nn_registry_free(&s.registry);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+// Publishes models into POSIX shared memory, where any number of processes attach to one
+// read only copy of the weights (nn_shm_attach, or shm:<name> in nn_serve)
+#include <assert.h>
+#include <time.h>
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+char* args_shift(int* argc, char*** argv) {
+    assert(*argc > 0);
+    char* result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s publish <model.nn> <name>\n", program);
+    fprintf(stderr, "       %s info <name>\n", program);
+    fprintf(stderr, "       %s unlink <name>\n", program);
+}
+
+int main(int argc, char** argv) {
+    const char* program = args_shift(&argc, &argv);
+    if (argc < 2) {
+        usage(program);
+        return 1;
+    }
+    const char* command = args_shift(&argc, &argv);
+
+    if (strcmp(command, "publish") == 0 && argc == 2) {
+        const char* model_path = args_shift(&argc, &argv);
+        const char* name = args_shift(&argc, &argv);
+        NN nn = nn_load(model_path);
+        if (nn.count == 0) {
+            fprintf(stderr, "ERROR: could not load model %s\n", model_path);
+            return 1;
+        }
+        double start = now_secs();
+        if (!nn_shm_publish(name, nn)) {
+            fprintf(stderr, "ERROR: could not publish %s as %s\n", model_path, name);
+            return 1;
+        }
+        printf("published %s as %s%s, %zu parameters in %.3f ms\n",
+               model_path, NN_SHM_PREFIX, name, nn_param_count(nn), (now_secs() - start) * 1e3);
+        nn_free(&nn);
+        return 0;
+    }
+
+    if (strcmp(command, "info") == 0 && argc == 1) {
+        const char* name = args_shift(&argc, &argv);
+        double start = now_secs();
+        NN nn = nn_shm_attach(name);
+        double attached = now_secs();
+        if (nn.count == 0) {
+            fprintf(stderr, "ERROR: no complete model is published as %s\n", name);
+            return 1;
+        }
+        printf("%s%s: %zu", NN_SHM_PREFIX, name, nn.weights[0].rows);
+        for (size_t i = 0; i < nn.count; i++) printf(" -> %zu", nn.weights[i].cols);
+        printf(", %zu parameters, attached in %.3f ms\n", nn_param_count(nn), (attached - start) * 1e3);
+        nn_unmap(&nn);
+        return 0;
+    }
+
+    if (strcmp(command, "unlink") == 0 && argc == 1) {
+        const char* name = args_shift(&argc, &argv);
+        if (!nn_shm_unlink(name)) {
+            fprintf(stderr, "ERROR: nothing is published as %s\n", name);
+            return 1;
+        }
+        return 0;
+    }
+
+    usage(program);
+    return 1;
+}
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <time.h>
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+#define BITS 4
+#define FINE_TUNE_ITERS 2000
+#define SPARSE_MAX_DENSITY 0.5f
+#define BENCH_REPEATS 200
+#define PRUNED_PATH "adder_pruned.nn"
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double bench_forward(NN nn, matrix ti) {
+    double start = now_secs();
+    for (size_t r = 0; r < BENCH_REPEATS; r++) {
+        for (size_t i = 0; i < ti.rows; i++) {
+            matrix_copy(NN_INPUT(nn), matrix_row(ti, i));
+            nn_forward(nn);
+        }
+    }
+    return (now_secs() - start) * 1e9 / (BENCH_REPEATS * ti.rows);
+}
+
+static size_t count_correct(NN nn, matrix ti, matrix to) {
+    size_t correct = 0;
+    for (size_t i = 0; i < ti.rows; i++) {
+        matrix_copy(NN_INPUT(nn), matrix_row(ti, i));
+        nn_forward(nn);
+        bool ok = true;
+        for (size_t j = 0; j < to.cols; j++) {
+            ok = ok && ((MATRIX_AT(NN_OUTPUT(nn), 0, j) > 0.5f) == (MATRIX_AT(to, i, j) > 0.5f));
+        }
+        correct += ok;
+    }
+    return correct;
+}
+
+int main(void) {
+    nn_seed((uint64_t)time(NULL));
+
+    Dataset_Gen gen = dataset_gen_adder(BITS);
+    size_t rows = gen.count;
+    matrix ti = matrix_alloc(rows, gen.in_cols, gen.in_cols);
+    matrix to = matrix_alloc(rows, gen.out_cols, gen.out_cols);
+    dataset_gen_fill(gen, 0, ti, to);
+
+    size_t architecture[] = { 2 * BITS, 4 * BITS, BITS + 1 };
+    NN nn = nn_alloc(architecture, ARRAY_SIZE(architecture));
+    NN g = nn_alloc(architecture, ARRAY_SIZE(architecture));
+    nn_randomise(nn, -1, 1);
+
+    NN_LBFGS opt = nn_lbfgs_alloc(nn, 4);
+    for (size_t iter = 0; iter < 2000; iter++) {
+        nn_lbfgs_step(nn, &g, &opt, ti, to);
+    }
+    nn_lbfgs_free(&opt);
+
+    size_t weight_count = 0;
+    for (size_t i = 0; i < nn.count; i++) weight_count += nn.weights[i].rows * nn.weights[i].cols;
+
+    float* trained = NN_MALLOC(nn_param_count(nn) * sizeof(float));
+    NN_ASSERT(trained != NULL);
+    nn_params_get(nn, trained);
+
+    printf("dense     cost = %f  accuracy = %zu/%zu  %.1f ns/row\n",
+           nn_cost(nn, ti, to), count_correct(nn, ti, to), rows, bench_forward(nn, ti));
+
+    float sparsities[] = { 0.5f, 0.8f, 0.9f, 0.95f };
+    for (size_t s = 0; s < ARRAY_SIZE(sparsities); s++) {
+        nn_params_set(nn, trained);
+        size_t pruned = nn_prune_top_k(nn, 1 - sparsities[s]);
+        float pruned_cost = nn_cost(nn, ti, to);
+
+        for (size_t iter = 0; iter < FINE_TUNE_ITERS; iter++) {
+            nn_backprop(nn, &g, ti, to);
+            nn_prune_mask(nn, g);
+            nn_learn(nn, g, 1.0f);
+        }
+
+        nn_sparsify(&nn, SPARSE_MAX_DENSITY);
+        size_t sparse_layers = 0, csr_bytes = 0;
+        for (size_t i = 0; i < nn.count; i++) {
+            if (nn.sparse[i].row_ptr == NULL) {
+                csr_bytes += nn.weights[i].rows * nn.weights[i].cols * sizeof(float);
+                continue;
+            }
+            sparse_layers++;
+            csr_bytes += (nn.sparse[i].rows + 1) * sizeof(*nn.sparse[i].row_ptr);
+            csr_bytes += nn.sparse[i].nnz * (sizeof(*nn.sparse[i].col_idx) + sizeof(*nn.sparse[i].values));
+        }
+
+        printf("%2.0f%% sparse  pruned %zu/%zu  cost %f -> %f after fine tune  accuracy = %zu/%zu  "
+               "%zu/%zu layers CSR  weights %zu -> %zu bytes  %.1f ns/row\n",
+               sparsities[s] * 100, pruned, weight_count, pruned_cost, nn_cost(nn, ti, to),
+               count_correct(nn, ti, to), rows, sparse_layers, nn.count,
+               weight_count * sizeof(float), csr_bytes, bench_forward(nn, ti));
+
+        // nn_save stores the CSR layers as such, so the file shrinks along with the weights
+        struct stat st = {0};
+        NN reloaded = {0};
+        if (nn_save(PRUNED_PATH, nn)) reloaded = nn_load(PRUNED_PATH);
+        if (reloaded.count == 0) {
+            fprintf(stderr, "ERROR: could not save and reload %s\n", PRUNED_PATH);
+            return 1;
+        }
+        stat(PRUNED_PATH, &st);
+        printf("           %s %lld bytes, reloaded cost %f\n", PRUNED_PATH, (long long) st.st_size, nn_cost(reloaded, ti, to));
+        nn_free(&reloaded);
+
+        for (size_t i = 0; i < nn.count; i++) matrix_csr_free(&nn.sparse[i]);
+    }
+
+    free(trained);
+    nn_free(&nn);
+    nn_free(&g);
+    matrix_free(&ti);
+    matrix_free(&to);
+    return 0;
+}
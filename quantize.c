@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <time.h>
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+#define BITS 4
+#define CALIBRATION_ROWS 64
+#define BENCH_REPEATS 200
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t count_correct(matrix y, matrix to) {
+    size_t correct = 0;
+    for (size_t i = 0; i < y.rows; i++) {
+        bool ok = true;
+        for (size_t j = 0; j < y.cols; j++) {
+            ok = ok && ((MATRIX_AT(y, i, j) > 0.5f) == (MATRIX_AT(to, i, j) > 0.5f));
+        }
+        correct += ok;
+    }
+    return correct;
+}
+
+int main(void) {
+    nn_seed((uint64_t)time(NULL));
+
+    Dataset_Gen gen = dataset_gen_adder(BITS);
+    size_t rows = gen.count;
+    matrix ti = matrix_alloc(rows, gen.in_cols, gen.in_cols);
+    matrix to = matrix_alloc(rows, gen.out_cols, gen.out_cols);
+    dataset_gen_fill(gen, 0, ti, to);
+
+    size_t architecture[] = { 2 * BITS, 4 * BITS, BITS + 1 };
+    NN nn = nn_alloc(architecture, ARRAY_SIZE(architecture));
+    NN g = nn_alloc(architecture, ARRAY_SIZE(architecture));
+    nn_randomise(nn, -1, 1);
+
+    NN_LBFGS opt = nn_lbfgs_alloc(nn, 4);
+    for (size_t iter = 0; iter < 2000; iter++) {
+        nn_lbfgs_step(nn, &g, &opt, ti, to);
+    }
+    nn_lbfgs_free(&opt);
+
+    // A random sample without replacement, so the activation ranges are not those of whatever
+    // happens to come first in the dataset
+    size_t* order = malloc(rows * sizeof(*order));
+    assert(order != NULL);
+    for (size_t i = 0; i < rows; i++) order[i] = i;
+    size_t calibration_rows = rows < CALIBRATION_ROWS ? rows : CALIBRATION_ROWS;
+    matrix calibration = matrix_alloc(calibration_rows, ti.cols, ti.cols);
+    for (size_t i = 0; i < calibration_rows; i++) {
+        size_t j = i + (size_t) (rand_float() * (rows - i));
+        if (j >= rows) j = rows - 1;
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+        matrix_copy(matrix_row(calibration, i), matrix_row(ti, order[i]));
+    }
+    free(order);
+    NN_Q8 q = nn_quantize(nn, calibration);
+
+    matrix yf = matrix_alloc(rows, to.cols, to.cols);
+    matrix yq = matrix_alloc(rows, to.cols, to.cols);
+
+    double start = now_secs();
+    for (size_t r = 0; r < BENCH_REPEATS; r++) {
+        for (size_t i = 0; i < rows; i++) {
+            matrix_copy(NN_INPUT(nn), matrix_row(ti, i));
+            nn_forward(nn);
+            matrix_copy(matrix_row(yf, i), NN_OUTPUT(nn));
+        }
+    }
+    double float_secs = now_secs() - start;
+
+    start = now_secs();
+    for (size_t r = 0; r < BENCH_REPEATS; r++) {
+        nn_predict(nn_model(nn), ti, yf);
+    }
+    double predict_secs = now_secs() - start;
+
+    start = now_secs();
+    for (size_t r = 0; r < BENCH_REPEATS; r++) {
+        nn_q8_forward(q, ti, yq);
+    }
+    double q8_secs = now_secs() - start;
+
+    float max_diff = 0;
+    size_t agree = 0;
+    for (size_t i = 0; i < rows; i++) {
+        bool same = true;
+        for (size_t j = 0; j < to.cols; j++) {
+            max_diff = fmaxf(max_diff, fabsf(MATRIX_AT(yf, i, j) - MATRIX_AT(yq, i, j)));
+            same = same && ((MATRIX_AT(yf, i, j) > 0.5f) == (MATRIX_AT(yq, i, j) > 0.5f));
+        }
+        agree += same;
+    }
+
+    float float_cost = nn_cost(nn, ti, to);
+    float q8_cost = nn_q8_cost(q, ti, to);
+    size_t float_bytes = nn_param_count(nn) * sizeof(float);
+
+    printf("calibrated on %zu of %zu rows\n", calibration.rows, rows);
+    printf("cost      float32 = %f  int8 = %f  delta = %+f\n", float_cost, q8_cost, q8_cost - float_cost);
+    printf("accuracy  float32 = %zu/%zu  int8 = %zu/%zu\n", count_correct(yf, to), rows, count_correct(yq, to), rows);
+    printf("agreement %zu/%zu rows, max |output delta| = %f\n", agree, rows, max_diff);
+    printf("size      float32 = %zu bytes  int8 = %zu bytes\n", float_bytes, nn_q8_bytes(q));
+    printf("latency   float32 = %.1f ns/row  float32 batched = %.1f ns/row  int8 batched = %.1f ns/row\n",
+           float_secs * 1e9 / (BENCH_REPEATS * rows), predict_secs * 1e9 / (BENCH_REPEATS * rows),
+           q8_secs * 1e9 / (BENCH_REPEATS * rows));
+
+    matrix_free(&calibration);
+    matrix_free(&yf);
+    matrix_free(&yq);
+    nn_q8_free(&q);
+    nn_free(&nn);
+    nn_free(&g);
+    matrix_free(&ti);
+    matrix_free(&to);
+    return 0;
+}
@@ -6,38 +6,34 @@ size_t arch[] = {2, 4, 1};
 size_t max_epoch = 100 * 1000;
 size_t epochs_per_frame = 103;
 float rate = 1.0f;
+size_t lbfgs_history = 4;
 bool paused = false;
+bool use_lbfgs = false;
 
-void verify_nn_gate(Font font, NN nn, float rx, float ry, float rw, float rh) {
+// ctx is the program's, so drawing a frame allocates nothing
+void verify_nn_gate(Font font, NN_Model model, NN_Context* ctx, float rx, float ry, float rw, float rh) {
     (void) rw;
     char buffer[256];
     float s = rh * 0.06;
     float pad = rh * 0.03;
+    float in[] = {0, 0, 0, 1, 1, 0, 1, 1};
+    float out[4];
+    nn_infer(model, ctx, matrix_data_alloc(in, 4, 2, 2), matrix_data_alloc(out, 4, 1, 1));
     for (size_t i = 0; i < 2; i++) {
         for (size_t j = 0; j < 2; j++) {
-            MATRIX_AT(NN_INPUT(nn), 0, 0) = i;
-            MATRIX_AT(NN_INPUT(nn), 0, 1) = j;
-            nn_forward(nn);
-            snprintf(buffer, sizeof(buffer), "%zu ^ %zu == %f", i, j, MATRIX_AT(NN_OUTPUT(nn), 0, 0));
+            snprintf(buffer, sizeof(buffer), "%zu ^ %zu == %f", i, j, out[i * 2 + j]);
             DrawTextEx(font, buffer, CLITERAL(Vector2) {rx, ry + (i * 2 + j) * (s + pad)}, s, 0, WHITE);
         }
     }
 }
 
 int main(void) {
-    matrix t = matrix_alloc(4, 3, 3);
-    for (size_t i = 0; i < 2; i++) {
-        for (size_t j = 0; j < 2; j++) {
-            size_t row = i * 2 + j;
-            MATRIX_AT(t, row, 0) = i;
-            MATRIX_AT(t, row, 1) = j;
-            MATRIX_AT(t, row, 2) = i ^ j;
-        }
-    }
+    Dataset_Gen gen = dataset_gen_xor();
+    matrix t = matrix_alloc(gen.count, gen.in_cols + gen.out_cols, gen.in_cols + gen.out_cols);
 
     matrix ti = {
         .rows = t.rows,
-        .cols = 2,
+        .cols = gen.in_cols,
         .stride = t.stride,
         .elements = &MATRIX_AT(t, 0, 0),
     };
@@ -48,11 +44,15 @@ int main(void) {
         .stride = t.stride,
         .elements = &MATRIX_AT(t, 0, ti.cols),
     };
+    dataset_gen_fill(gen, 0, ti, to);
 
 
     NN nn = nn_alloc(arch, ARRAY_SIZE(arch));
     NN g = nn_alloc(arch, ARRAY_SIZE(arch));
     nn_randomise(nn, -1, 1);
+    NN_LBFGS opt = nn_lbfgs_alloc(nn, lbfgs_history);
+    NN_Model model = nn_model(nn);
+    NN_Context ctx = nn_context_alloc(model, 4);
 
     size_t WINDOW_FACTOR = 80;
     size_t WINDOW_WIDTH = (16 * WINDOW_FACTOR);
@@ -75,14 +75,23 @@ int main(void) {
         if (IsKeyPressed(KEY_R)) {
             epoch = 0;
             nn_randomise(nn, -1, 1);
+            nn_lbfgs_reset(&opt);
             plot.count = 0;
         }
+        if (IsKeyPressed(KEY_L)) {
+            use_lbfgs = !use_lbfgs;
+            nn_lbfgs_reset(&opt);
+        }
 
         for (size_t i = 0; i < epochs_per_frame && !paused && epoch < max_epoch; i++) {
-            nn_backprop(nn, &g, ti, to);
-            nn_learn(nn, g, rate);
+            if (use_lbfgs) {
+                da_append(&plot, nn_lbfgs_step(nn, &g, &opt, ti, to));
+            } else {
+                nn_backprop(nn, &g, ti, to);
+                nn_learn(nn, g, rate);
+                da_append(&plot, nn_cost(nn, ti, to));
+            }
             epoch += 1;
-            da_append(&plot, nn_cost(nn, ti, to));
         }
 
         BeginDrawing();
@@ -101,14 +110,16 @@ int main(void) {
             rx += rw;
             gui_render_nn(nn, rx, ry, rw, rh);
             rx += rw;
-            verify_nn_gate(font, nn, rx, ry, rw, rh);
+            verify_nn_gate(font, model, &ctx, rx, ry, rw, rh);
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f", epoch, max_epoch, rate, nn_cost(nn, ti, to));
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, %s, Rate: %f, Cost: %f", epoch, max_epoch, use_lbfgs ? "L-BFGS" : "GD", rate, nn_cost(nn, ti, to));
             DrawTextEx(font, buffer, CLITERAL(Vector2){}, h * 0.04, 0, WHITE);
         }
         EndDrawing();
     }
 
+    nn_context_free(&ctx);
+    nn_lbfgs_free(&opt);
     return 0;
 }
\ No newline at end of file